@@ -40,6 +40,8 @@
 
 
 void __fastcall__ msleep(int ms);
+int __fastcall__ slurp (const char* name, void* buf, unsigned int max,
+                        unsigned long* size);
 
 
 // Note values: with counter starting at 00, our frequency is 122.05 Hz,
@@ -54,7 +56,16 @@ typedef struct Span
 } Span;
 
 
-Span* song = NULL;
+// What a song file starts with.
+struct SongHeader
+{
+    int address;    // save unfortunately inserts the load address. hm.
+    int version;
+    int len;        // # of spans
+};
+
+char* song_file = NULL;     // the whole file, header & all
+Span* song = NULL;          // the spans in song_file
 unsigned int songlen = 0;
 unsigned int range_begin = 0;
 unsigned int range_end = 0;
@@ -215,48 +226,49 @@ void warn (const char* format, const char* msg)
 int LoadSong (char* filename)
 {
     int result = 0;
-    FILE* f;
-    int len, read_len;
-    int version = 0;
-    int address = 0; // save unfortunately inserts the load address. hm.
+    unsigned long size;
+    int read_len;
+    struct SongHeader header;
 
-    // free the previous song struct
-    if (song)
+    // free the previous song
+    if (song_file)
     {
-        free(song);
+        free(song_file);
+        song_file = NULL;
         song = NULL;
         songlen = 0;
     }
 
-    f = fopen (filename, "rb");
-    if (f)
+    // One slurp for the header & the file's size, and another for the
+    // whole file, instead of an open, several reads and a close.
+    if (slurp (filename, &header, sizeof(header), &size) == -1)
     {
-        fread(&address,2,1,f);
-        fread(&version,2,1,f);
-        fread(&len, 2,1,f);
-        printf ("version is %d\r\n", version);
-        printf ("len is %d\r\n", len);
-        song = malloc (len * sizeof(struct Span));
-        if (song)
-        {
-            //read_len = fread(song, sizeof(struct Span), len, f);
-            read_len = fread(song, 1, len * sizeof(struct Span), f);
-            if (len * sizeof(struct Span) == read_len)
-            {
-                songlen = len;
-                result = 1;
-                printf ("loaded %s; #spans is %d\r\n", filename, songlen);
-            }
-            else
-            {
-                printf ("Warning: loaded %d spans, expected %d\r\n", read_len, len * sizeof(struct Span));
-            }
-        }
-        fclose(f);
+        warn ("%s", filename);
+        return 0;
     }
-    else
+    printf ("version is %d\r\n", header.version);
+    printf ("len is %d\r\n", header.len);
+    if (size > 0xffffUL || size < sizeof(header))
     {
-        warn ("%s", filename);
+        printf ("Warning: %s is the wrong size for a song\r\n", filename);
+        return 0;
+    }
+
+    song_file = malloc (size);
+    if (song_file)
+    {
+        read_len = slurp (filename, song_file, size, NULL) - sizeof(header);
+        song = (Span*)(song_file + sizeof(header));
+        if (read_len >= (int)(header.len * sizeof(struct Span)))
+        {
+            songlen = header.len;
+            result = 1;
+            printf ("loaded %s; #spans is %d\r\n", filename, songlen);
+        }
+        else
+        {
+            printf ("Warning: loaded %d spans, expected %d\r\n", read_len, header.len * sizeof(struct Span));
+        }
     }
 
     return result;
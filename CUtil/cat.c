@@ -0,0 +1,143 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above 
+ *    copyright notice, this list of conditions and the following 
+ *    disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, 
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED 
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Prints files, or with -o joins them into one. Joining happens on the
+// disk controller with splice(), so none of the data comes over the bus.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <p65.h>
+
+long __fastcall__ splice (int src, int dst, unsigned long count);
+
+#define BUFLEN 128
+
+char buffer[BUFLEN];
+
+
+
+void usage (void)
+{
+    fputs("usage: cat [-o outfile [-a]] file ...\r\n", stderr);
+    fputs("  -o  join the files into outfile\r\n", stderr);
+    fputs("  -a  add to the end of outfile\r\n", stderr);
+    exit(2);
+}
+
+
+
+void PrintError (const char* name)
+{
+    fprintf (stderr, "cat: %s: ", name);
+    if (__oserror != 0)
+        fprintf (stderr, "%s\r\n", __stroserror(_oserror));
+    else
+        fprintf (stderr, "%s\r\n", strerror(errno));
+    errno = _oserror = 0;
+}
+
+
+
+// Copies fd to out, or to the screen if out is -1.
+int Cat (int fd, int out)
+{
+    int n;
+
+    if (out != -1)
+        return (splice (fd, out, 0x7fffffffUL) == -1) ? -1 : 0;
+
+    while ((n = read (fd, buffer, BUFLEN)) > 0)
+        fwrite (buffer, 1, n, stdout);
+    return n;
+}
+
+
+
+int main (int argc, char** argv)
+{
+    int ch, i, fd;
+    int status = 0;
+    int out = -1;
+    int mode = O_WRONLY | O_CREAT | O_TRUNC;
+    const char* outfile = NULL;
+
+    while ((ch = getopt(argc, argv, "o:a")) != -1)
+    {
+        switch(ch)
+        {
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'a':
+            mode = O_WRONLY | O_CREAT | O_APPEND;
+            break;
+        case '?':
+        default:
+            usage();
+        }
+    }
+
+    if (optind == argc)
+        usage();
+
+    if (outfile)
+    {
+        out = open (outfile, mode);
+        if (out == -1)
+        {
+            PrintError (outfile);
+            return 1;
+        }
+    }
+
+    for (i = optind; i < argc; ++i)
+    {
+        fd = open (argv[i], O_RDONLY);
+        if (fd == -1)
+        {
+            PrintError (argv[i]);
+            status = 1;
+            continue;
+        }
+        if (Cat (fd, out) == -1)
+        {
+            PrintError (argv[i]);
+            status = 1;
+        }
+        close (fd);
+    }
+
+    if (out != -1)
+        close (out);
+    return status;
+}
@@ -0,0 +1,106 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+;; copyjob.asm - C wrappers for the disk controller's background file copy.
+;;
+;; int __fastcall__ cp_start (const char* src, const char* dst);
+;;     Start a copy. Returns 0, or -1 with the error in _oserror.
+;; int __fastcall__ cp_status (struct cp_progress* p);
+;;     Returns 1 while the copy is running, then 0 if it succeeded or -1
+;;     with the error in _oserror. Fills in p.
+;; int __fastcall__ cp_cancel (void);
+;;     Stops the copy and removes the partial file. Returns 0 or -1.
+;; int __fastcall__ getkey (void);
+;;     Returns the next key typed at the terminal, or 0 if there isn't one.
+
+.export _cp_start, _cp_status, _cp_cancel, _getkey
+.import popax, __oserror
+
+FS_CP_CANCEL = $FF7B
+FS_CP_STATUS = $FF7E
+FS_CP_START  = $FF81
+Read_Char    = $FFD5
+
+os_ptr1    = $30    ; The OS's ptr1, where cp_status wants the buffer.
+os_ptr2    = $32    ; The OS's ptr2, where cp_start wants the dest name.
+P65_EAGAIN = $80 | 10
+
+
+
+.proc _cp_start
+        sta os_ptr2         ; dst
+        stx os_ptr2+1
+        jsr popax           ; src
+        jsr FS_CP_START
+        jmp return_status
+.endproc
+
+
+
+.proc _cp_status
+        sta os_ptr1
+        stx os_ptr1+1
+        jsr FS_CP_STATUS
+        cmp #P65_EAGAIN
+        bne return_status
+        lda #1              ; still running
+        ldx #0
+        rts
+.endproc
+
+
+
+.proc _cp_cancel
+        jsr FS_CP_CANCEL
+        jmp return_status
+.endproc
+
+
+
+.proc _getkey
+        jsr Read_Char       ; carry set if there was a key
+        bcs done
+        lda #0
+done:   ldx #0
+        rts
+.endproc
+
+
+
+; Turns the P65 status in A into a C return value: 0 for P65_EOK, or
+; -1 with the status saved in _oserror.
+.proc return_status
+        cmp #0
+        beq ok
+        sta __oserror
+        lda #$ff
+        tax
+        rts
+ok:     tax
+        rts
+.endproc
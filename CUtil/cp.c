@@ -37,6 +37,12 @@
 // we'll pull from once we've closed the directory we're currently looking
 // at.
 //
+// Better still, the disk controller can do the whole recursive copy itself
+// with cptree(), and we just wait for it to finish. The queue is the
+// fallback for when it can't, e.g. if it's short on memory. Single files
+// get copied in the background with cp_start() too, so that we can show
+// how it's going and stop it with Ctrl-C.
+//
 // TODO: There's a fair amount of code here that assumes bufferlen will always
 // be "big enough". Not very safe. We'll revisit that once we have a more 
 // rigourous filestyem layer and we've decided what the maximum possible
@@ -50,10 +56,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include <p65.h>
 
 int recursive = 0;
 int verbose = 1;
+int verify = 0;
 
 char buffer1[128], buffer2[128];
 const int bufferlen = 128;
@@ -70,6 +78,33 @@ struct qdir_entry* qdir_first = NULL;
 struct qdir_entry* qdir_last = NULL;
 
 int __fastcall__ getfdtype(int fd);
+int __fastcall__ cptree (const char* src, const char* dst);
+int __fastcall__ treejob_status (unsigned* count);
+
+struct cp_progress {
+    unsigned char status;
+    unsigned long done;     // bytes copied so far
+    unsigned long total;    // size of the file
+};
+
+int __fastcall__ cp_start (const char* src, const char* dst);
+int __fastcall__ cp_status (struct cp_progress* p);
+int __fastcall__ cp_cancel (void);
+int __fastcall__ getkey (void);
+
+#define CTRL_C 3
+
+struct file_sum {
+    unsigned long crc32;
+    unsigned int crc16;
+    unsigned long count;    // bytes summed
+};
+
+int sum_file (const char* name, unsigned char which, unsigned long offset,
+              unsigned long length, struct file_sum* sum);
+
+#define SUM_CRC32 1
+#define SUM_ALL   0xffffffffUL
 
 // returns 1 iff name exists & is a directory,
 // 0 otherwise
@@ -159,17 +194,103 @@ void FreeQdirHead()
 
 
 
+// Hundredths of a second since whenever, for timing copies.
+unsigned long Centiseconds (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 100 + ts.tv_nsec / 10000000;
+}
+
+
+
+// Have the disk controller copy a file in the background, while we show
+// how far it's got. Returns 1 if the file was copied, -1 if that failed,
+// or 0 if it couldn't start the copy, in which case we have to use
+// copyfile().
+int CopyInBackground (char* src, char* dst)
+{
+    struct cp_progress p;
+    unsigned long start, elapsed;
+    unsigned percent = 101;
+    int status;
+
+    if (cp_start (src, dst) == -1)
+    {
+        errno = _oserror = 0; // don't need these
+        return 0;
+    }
+    start = Centiseconds();
+    while ((status = cp_status (&p)) == 1)
+    {
+        if (getkey() == CTRL_C)
+            cp_cancel();
+        else if (verbose && p.total && (p.done * 100 / p.total != percent))
+        {
+            percent = p.done * 100 / p.total;
+            printf ("\r%s %u%%", src, percent);
+        }
+    }
+    elapsed = Centiseconds() - start;
+    if (percent <= 100)
+        printf ("\r");
+
+    if (status == -1)
+    {
+        warn ("failed: %s", src);
+        return -1;
+    }
+    if (verbose)
+    {
+        printf ("%s -> %s (%lu bytes", src, dst, p.total);
+        if (elapsed)
+            printf (", %lu bytes/s", p.total * 100 / elapsed);
+        printf (")\r\n");
+    }
+    return 1;
+}
+
+
+
+// Have the disk controller checksum src and dst, and complain if they
+// don't match.
+void Verify (const char* src, const char* dst)
+{
+    struct file_sum a, b;
+
+    if ((sum_file (src, SUM_CRC32, 0, SUM_ALL, &a) == -1) ||
+        (sum_file (dst, SUM_CRC32, 0, SUM_ALL, &b) == -1))
+    {
+        warn ("cannot verify %s", dst);
+        errno = _oserror = 0;
+    }
+    else if ((a.crc32 != b.crc32) || (a.count != b.count))
+        warn ("verify failed: %s", dst);
+    else if (verbose)
+        printf ("verified %s (%08lx)\r\n", dst, b.crc32);
+}
+
+
+
 // Copy a single regular file. Will error out if src or dst are directories.
 void CopyFile (char* src, char* dst)
 {
+    int result;
     //printf ("CopyFile %s %s\r\n", src,dst);
-    if (copyfile (src, dst) != -1)
+    result = CopyInBackground (src, dst);
+    if (result == 0)
     {
-        if (verbose)
-            printf ("%s -> %s\r\n", src, dst);
+        if (copyfile (src, dst) != -1)
+        {
+            result = 1;
+            if (verbose)
+                printf ("%s -> %s\r\n", src, dst);
+        }
+        else
+            warn ("failed: %s", src);
     }
-    else
-        warn ("failed: %s", src);
+    if ((result == 1) && verify)
+        Verify (src, dst);
 }
 
 
@@ -230,6 +351,29 @@ int CopyFolder()
 
 
 
+// Have the disk controller copy the whole tree. Returns 0 if it couldn't
+// start the job, in which case we have to do it ourselves.
+int CopyTree (char* src, char* dst)
+{
+    unsigned count;
+    int status;
+
+    if (cptree (src, dst) == -1)
+    {
+        errno = _oserror = 0; // don't need these
+        return 0;
+    }
+    while ((status = treejob_status (&count)) == 1)
+        ;
+    if (status == -1)
+        warn ("failed: %s", src);
+    else if (verbose)
+        printf ("%s -> %s (%u entries)\r\n", src, dst, count);
+    return 1;
+}
+
+
+
 // Returns 1 if src is a parent folder of dst. Src and dst are both in 
 // canonical form (see CanonicalizeFilename).
 int CheckForIllegalRecursion (const char* src, const char* dst)
@@ -257,8 +401,13 @@ void DoCopy (char* src, char* dst)
     {
         if (recursive)
         {
-            QueueDirectory (src, dst);
-            CopyFolder();
+            // The controller's tree copy doesn't tell us which files it
+            // copied, so verifying means copying them one at a time.
+            if (verify || !CopyTree (src, dst))
+            {
+                QueueDirectory (src, dst);
+                CopyFolder();
+            }
         }
         else
         {
@@ -301,6 +450,8 @@ void usage (void)
 {
     fprintf(stderr, "usage: cp [-rv] source dest\r\n");
     fprintf(stderr, "   or: cp [-rv] source1 ... dest_folder\r\n");
+    fprintf(stderr, "  -r  copy directories recursively\r\n");
+    fprintf(stderr, "  -v  verify each file once it's copied\r\n");
     exit(2);
 }
 
@@ -320,7 +471,7 @@ int main (int argc, char** argv)
             recursive = 1;
             break;
         case 'v':
-            verbose = 1;
+            verify = 1;
             break;
         case '?':
         default:
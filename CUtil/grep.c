@@ -0,0 +1,230 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above 
+ *    copyright notice, this list of conditions and the following 
+ *    disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, 
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED 
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Prints the lines of files that contain a pattern. The disk controller
+// does the searching and only tells us where the matching lines are, so
+// the only file data that comes over the bus is the lines we print.
+// Naming a directory searches every file in it.
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <p65.h>
+
+struct grep_match {
+    unsigned long line;     // 0 when a file name follows
+    unsigned long offset;   // where the line starts, or the name's length
+};
+
+int __fastcall__ open_search (const char* path, const char* pattern,
+                              unsigned char flags);
+
+#define GREP_ICASE 1
+#define MAX_PATH 64
+#define MAX_LINE 80
+
+
+
+unsigned char show_names = 0;
+unsigned char show_lines = 0;
+char line[MAX_LINE + 1];
+
+
+
+void usage (void)
+{
+    fputs("usage: grep [-in] pattern file|dir ...\r\n", stderr);
+    fputs("  -i  ignore case\r\n", stderr);
+    fputs("  -n  print line numbers\r\n", stderr);
+    exit(2);
+}
+
+
+
+void PrintError (const char* name)
+{
+    fprintf (stderr, "grep: %s: ", name);
+    if (__oserror != 0)
+        fprintf (stderr, "%s\r\n", __stroserror(_oserror));
+    else
+        fprintf (stderr, "%s\r\n", strerror(errno));
+    errno = _oserror = 0;
+}
+
+
+
+// read() can come back short on a data channel.
+int ReadAll (int fd, void* buffer, unsigned int count)
+{
+    unsigned int total = 0;
+    int n;
+
+    while (total < count)
+    {
+        n = read (fd, (char*)buffer + total, count - total);
+        if (n <= 0)
+            return n;
+        total += n;
+    }
+    return total;
+}
+
+
+
+// Prints the line starting at offset in fd, cut off at MAX_LINE.
+int PrintLine (int fd, const char* name, const struct grep_match* m)
+{
+    int n;
+    char* end;
+
+    if (lseek (fd, m->offset, SEEK_SET) == -1)
+        return -1;
+    n = read (fd, line, MAX_LINE);
+    if (n == -1)
+        return -1;
+    line[n] = 0;
+    end = strpbrk (line, "\r\n");
+    if (end)
+        *end = 0;
+
+    if (show_names)
+        printf ("%s:", name);
+    if (show_lines)
+        printf ("%lu:", m->line);
+    printf ("%s\r\n", line);
+    return 0;
+}
+
+
+
+// Prints the matches in path. Returns 0 if there were any, 1 if not, or
+// 2 for an error.
+int Search (const char* path, const char* pattern, unsigned char flags)
+{
+    struct grep_match m;
+    char name[MAX_PATH];
+    int found = 0;
+    int file = -1;
+    int len;
+    int fd;
+
+    fd = open_search (path, pattern, flags);
+    if (fd == -1)
+    {
+        PrintError (path);
+        return 2;
+    }
+
+    // Until there's a record naming a file, path is the file.
+    strcpy (name, path);
+    while (ReadAll (fd, &m, sizeof(m)) == sizeof(m))
+    {
+        if (m.line == 0)
+        {
+            if (file != -1)
+                close (file);
+            file = -1;
+            len = strlen (path);
+            if (len + m.offset + 2 > MAX_PATH)
+                break;
+            strcpy (name, path);
+            if (len && path[len - 1] != '/')
+                name[len++] = '/';
+            if (ReadAll (fd, name + len, m.offset) != m.offset)
+                break;
+            name[len + m.offset] = 0;
+            show_names = 1;
+            continue;
+        }
+
+        if (file == -1)
+        {
+            file = open (name, O_RDONLY);
+            if (file == -1)
+            {
+                PrintError (name);
+                break;
+            }
+        }
+        if (PrintLine (file, name, &m) == -1)
+        {
+            PrintError (name);
+            break;
+        }
+        found = 1;
+    }
+
+    if (file != -1)
+        close (file);
+    close (fd);
+    return found ? 0 : 1;
+}
+
+
+
+int main (int argc, char** argv)
+{
+    int ch, i, result;
+    int status = 1;
+    unsigned char flags = 0;
+    const char* pattern;
+
+    while ((ch = getopt(argc, argv, "in")) != -1)
+    {
+        switch(ch)
+        {
+        case 'i':
+            flags |= GREP_ICASE;
+            break;
+        case 'n':
+            show_lines = 1;
+            break;
+        case '?':
+        default:
+            usage();
+        }
+    }
+
+    if (argc - optind < 2)
+        usage();
+    pattern = argv[optind++];
+    if (argc - optind > 1)
+        show_names = 1;
+
+    for (i = optind; i < argc; ++i)
+    {
+        result = Search (argv[i], pattern, flags);
+        if (result == 2 || (result == 0 && status == 1))
+            status = result;
+    }
+    return status;
+}
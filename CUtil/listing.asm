@@ -0,0 +1,88 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+;; listing.asm - C wrapper for directory listings sorted by the disk
+;; controller.
+;;
+;; int __fastcall__ open_listing (const char* dir, const char* pattern,
+;;                                const struct dirent* after);
+;;     Opens dir for a listing with directories first, then files, each
+;;     in name order. Only names that match pattern are listed, where ?
+;;     stands for any character and * for any run of them; NULL lists
+;;     everything. If after isn't NULL, the listing starts just after that
+;;     entry. Read it with read_listing(), and close() it at the end.
+;;     Returns the fd, or -1 with the error in _oserror.
+;;
+;; int __fastcall__ read_listing (int fd, struct dirent* d);
+;;     Reads the next entry into d. The controller sends entries in a
+;;     compact form, several at a time, which this unpacks, so it's much
+;;     cheaper than read()ing a whole struct dirent at a time. Also works
+;;     on a directory from open(). Returns 1 for an entry, 0 at the end,
+;;     or -1 with the error in _oserror.
+
+.export _open_listing, _read_listing
+.import popax, __oserror
+
+FS_READ_LISTING = $FF8A
+FS_OPEN_LISTING = $FF8D
+
+os_ptr1    = $30    ; The OS's ptr1 & ptr2, where FS_OPEN_LISTING and
+os_ptr2    = $32    ; FS_READ_LISTING want the dirent & pattern pointers.
+
+
+
+.proc _open_listing
+        sta os_ptr1         ; after
+        stx os_ptr1+1
+        jsr popax           ; pattern
+        sta os_ptr2
+        stx os_ptr2+1
+        jsr popax           ; dir
+        jsr FS_OPEN_LISTING
+        cpx #0
+        beq done            ; the fd is in A
+        sta __oserror
+        lda #$ff
+        tax
+done:   rts
+.endproc
+
+
+
+.proc _read_listing
+        sta os_ptr1         ; d
+        stx os_ptr1+1
+        jsr popax           ; fd
+        jsr FS_READ_LISTING
+        cpx #0
+        beq done            ; 1 or 0 is in A
+        sta __oserror
+        lda #$ff
+        tax
+done:   rts
+.endproc
@@ -28,8 +28,10 @@
  */
 
 // A very very stripped down optionless ls for the P:65.
+// The disk controller sorts the listing for us, so there's no limit on
+// how big a directory can be. An argument like dir/*.log lists only the
+// names in dir that match.
 
-// CJ Todo: remove fixed limit on dir size
 // CJ Todo: accept file names as arguments instead of just directories.
 
 #include <stdio.h>
@@ -41,75 +43,76 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
-struct dirent* list[200];
-const int max_count = 200;
+int __fastcall__ open_listing (const char* dir, const char* pattern,
+                               const struct dirent* after);
+int __fastcall__ read_listing (int fd, struct dirent* d);
 
 
-// sort comparison function
-int cmp_dirent (const void* p1, const void* p2)
+void PrintError (void)
 {
-	struct dirent* d1 = *(struct dirent**)p1;
-	struct dirent* d2 = *(struct dirent**)p2;
-	int result = d2->d_type - d1->d_type;
-	if (result == 0)
-		result = strcmp (d1->d_name, d2->d_name);
-	return result;
+	if (__oserror != 0)
+		printf ("%d %s\r\n", _oserror, __stroserror(_oserror));
+	else
+		printf ("%d %s\r\n", errno, strerror(errno));
 }
 
 
 
-void DisplayDirectory (const char* name)
+void DisplayDirectory (const char* name, const char* pattern)
 {
-	int count = 0, i;
 	long int total_size = 0;
-	struct dirent *d, *d2;
-	DIR* dir;
+	int filecount = 0;
+	int dircount = 0;
+	struct dirent d;
+	int fd;
+
+	fd = open_listing (name, pattern, NULL);
+	if (fd == -1)
+	{
+		PrintError ();
+		return;
+	}
 
-	dir = opendir(name);
-	if (dir)
+	while (read_listing (fd, &d) == 1)
 	{
-		int filecount = 0;
-		int dircount = 0;
-		while (d = readdir(dir))
+		if (d.d_type == 2)
 		{
-			if (d->d_type == 2)
-				++dircount;
-			else
-			{
-				++filecount;
-				total_size += d->d_size;
-			}
-			if (count < max_count)
-			{
-				d2 = malloc(sizeof(struct dirent));
-				memcpy (d2, d, sizeof(struct dirent));
-				list[count++] = d2;
-			}
-			
+			++dircount;
+			printf ("%-12s   <DIR>\r\n", d.d_name);
 		}
-		closedir(dir);
-		
-		qsort (list, count, sizeof(struct dirent*), cmp_dirent);
-		
-		for (i = 0; i < count; ++i)
+		else
 		{
-			d = list[i];
-			if (d->d_type == 2)
-				printf ("%-12s   <DIR>\r\n", d->d_name);
-			else
-				printf ("%-12s     %10ld\r\n", d->d_name, d->d_size);
+			++filecount;
+			total_size += d.d_size;
+			printf ("%-12s     %10ld\r\n", d.d_name, d.d_size);
 		}
-		
-		printf ("%4d File(s)     %10ld\r\n", filecount, total_size);
-		printf ("%4d Dir(s)\r\n\r\n", dircount);
 	}
-	else
+	close (fd);
+
+	printf ("%4d File(s)     %10ld\r\n", filecount, total_size);
+	printf ("%4d Dir(s)\r\n\r\n", dircount);
+}
+
+
+// Splits an argument like dir/*.log into a directory and a pattern, if
+// its last part has wildcards in it. Returns the pattern, or NULL if there
+// isn't one. dir is set to the directory, which is "." - the working
+// directory - for a pattern with no directory in front of it.
+char* SplitPattern (char* arg, const char** dir)
+{
+	char* slash = strrchr (arg, '/');
+	char* pattern = slash ? slash + 1 : arg;
+	if (!strpbrk (pattern, "*?"))
+		return NULL;
+	*dir = ".";
+	if (slash == arg)
+		*dir = "/";
+	else if (slash)
 	{
-		if (__oserror != 0)
-			printf ("oserr: %d %s\r\n", _oserror, __stroserror(_oserror));
-		else
-			printf ("errno: %d %s\r\n", errno, strerror(errno));
+		*slash = 0;
+		*dir = arg;
 	}
+	return pattern;
 }
 
 
@@ -123,25 +126,29 @@ int main(int argc, char** argv)
 {
 	int i;
 	struct stat st;
+	const char* dir;
+	char* pattern;
 
 	if (argc == 1)
-		DisplayDirectory ("/");
+		DisplayDirectory (".", NULL);
 	else
 		for (i = 1; i < argc; ++i)
 		{
-			//printf ("sizeof struct stat is %d\r\n", sizeof(struct stat));
-			if (0 == stat(argv[i],&st))
+			if (pattern = SplitPattern (argv[i], &dir))
+			{
+				if (i > 1)
+					printf ("\r\n");
+				printf ("%s:\r\n", dir);
+				DisplayDirectory (dir, pattern);
+			}
+			else if (0 == stat(argv[i],&st))
 			{
-				//printf ("stat success\r\n");
-				//printf ("device number: %ld\r\n", st.st_dev);
-				//printf ("file type: %d\r\n", st.st_mode);
-				//printf ("file size: %ld\r\n", st.st_size);
 				if ((st.st_mode & S_IFMT) == S_IFDIR)
 				{
 					if (i > 1)
 						printf ("\r\n");
 					printf ("%s:\r\n", argv[i]);
-					DisplayDirectory (argv[i]);
+					DisplayDirectory (argv[i], NULL);
 				}
 				else
 				{
@@ -150,14 +157,10 @@ int main(int argc, char** argv)
 			}
 			else
 			{
-				//printf ("stat failed\r\n");
 				if (i > 1)
 					printf ("\r\n");
 				printf ("%s: ", argv[i]);
-				if (__oserror != 0)
-					printf ("%d %s\r\n", _oserror, __stroserror(_oserror));
-				else
-					printf ("%d %s\r\n", errno, strerror(errno));				
+				PrintError ();
 			}
 		}
 }
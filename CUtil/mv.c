@@ -29,9 +29,10 @@
 
 // A very stripped-down UNIX-like mv program for the P:65 computer.
 //
-// Because the Arduino SD library doesn't give me a way to rename files,
-// we basically have to do a copy & then remove the original. This doesn't
-// sound dangerous at all.
+// The disk controller can rename a file or directory in place by rewriting
+// its directory entry, so that's what we try first. If that fails (say,
+// because the destination already exists) we fall back on doing a copy &
+// then removing the original. This doesn't sound dangerous at all.
 //
 // Because the P:65 has tight constraints on the number of files it can have
 // open at one time, and because that includes directories opened with 
@@ -358,6 +359,22 @@ int CheckForIllegalRecursion (const char* src, const char* dst)
 
 
 
+// Ask the disk controller to rename src to dst, which works for directories
+// as well as files. Returns 1 on success, 0 if we need to copy instead.
+int RenameInPlace (const char* src, const char* dst)
+{
+    if (rename (src, dst) != -1)
+    {
+        if (verbose)
+            printf ("%s -> %s\r\n", src, dst);
+        return 1;
+    }
+    errno = _oserror = 0; // don't need these
+    return 0;
+}
+
+
+
 void DoCopy (char* src, char* dst)
 {
     // Set up whatever direct or recursive copy we need for a particular 
@@ -373,6 +390,10 @@ void DoCopy (char* src, char* dst)
     {
         warn ("cannot copy a directory into itself. Omitting directory %s", src);
     }
+    else if (RenameInPlace (src, dst))
+    {
+        // nothing to copy or delete
+    }
     else if (is_directory(src))
     {
         QueueDirectoryHead (src, dst);
@@ -383,8 +404,6 @@ void DoCopy (char* src, char* dst)
     else
     {
         // simple file copy
-        //if (rename (src, dst) == -1)
-        //    warn ("failed: %s", src);
         num_errors += CopyFile (src,dst);
         if (num_errors == 0)
             DeleteFile (copy_of_src);
@@ -35,6 +35,10 @@
 // of the recursive remove. Instead, we remove regular files and put 
 // directories into a queue so that we can traverse them after closing the
 // current directory.
+//
+// Normally, though, the disk controller does the whole recursive remove
+// itself with rmtree(), and we just wait for it to finish. The queue is
+// the fallback for when it can't, e.g. if it's short on memory.
 
 
 #include <unistd.h>
@@ -62,6 +66,8 @@ struct qdir_entry {
 };
 
 int __fastcall__ getfdtype(int fd);
+int __fastcall__ rmtree (const char* path);
+int __fastcall__ treejob_status (unsigned* count);
 
 // returns 1 iff name exists & is a directory,
 // 0 otherwise
@@ -182,6 +188,29 @@ int DeleteFolder(const char* src)
 
 
 
+// Have the disk controller remove the whole tree. Returns 0 if it couldn't
+// start the job, in which case we have to do it ourselves.
+int RemoveTree (const char* src)
+{
+    unsigned count;
+    int status;
+
+    if (rmtree (src) == -1)
+    {
+        errno = _oserror = 0; // don't need these
+        return 0;
+    }
+    while ((status = treejob_status (&count)) == 1)
+        ;
+    if (status == -1)
+        warn ("cannot remove %s", src);
+    else if (verbose)
+        printf ("removed '%s' (%u entries)\r\n", src, count);
+    return 1;
+}
+
+
+
 void usage (void)
 {
     fprintf(stderr, "usage: rm [-rfv] file1 ...\r\n");
@@ -224,7 +253,8 @@ int main (int argc, char** argv)
         {
             if (recursive)
             {
-                DeleteFolder (src);
+                if (!RemoveTree (src))
+                    DeleteFolder (src);
             }
             else
                 warn ("cannot remove %s: is a directory", src);
@@ -0,0 +1,70 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+;; sdcmd.asm - C wrapper for sending binary command frames to the disk
+;; controller, for commands the OS doesn't have a routine for.
+;;
+;; int __fastcall__ sd_command (const void* frame, unsigned char len,
+;;                              void* reply, unsigned char reply_len);
+;;     frame is the opcode, the # of args, then each arg as a length byte
+;;     and that many bytes. Returns the controller's status, which is
+;;     negative for an error. reply_len bytes of reply are stored in reply
+;;     unless it's an error.
+
+.export _sd_command
+.import popa, popax
+.importzp tmp1
+
+SD_COMMAND = $FF90
+
+os_ptr1    = $30    ; The OS's ptr1 & ptr2, where SD_COMMAND wants the
+os_ptr2    = $32    ; frame & reply pointers.
+
+
+
+.proc _sd_command
+        pha                 ; reply_len
+        jsr popax           ; reply
+        sta os_ptr2
+        stx os_ptr2+1
+        jsr popa            ; len
+        sta tmp1
+        jsr popax           ; frame
+        sta os_ptr1
+        stx os_ptr1+1
+        pla
+        tax                 ; reply_len in X
+        lda tmp1            ; len in A
+        jsr SD_COMMAND
+        ldx #0              ; sign extend the status
+        cmp #$80
+        bcc done
+        dex
+done:   rts
+.endproc
@@ -0,0 +1,69 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+;; listing.asm - C wrapper for directory listings sorted by the disk
+;; controller.
+
+;; search.asm - C wrapper for searching files on the disk controller.
+;;
+;; int __fastcall__ open_search (const char* path, const char* pattern,
+;;                               unsigned char flags);
+;;     Starts a search of path, a file or every file in a directory, for
+;;     the lines that contain pattern, where ? stands for any character
+;;     and * for any run of them. Set bit 0 of flags to ignore case.
+;;     read() the matches from the fd as 8-byte records: the line number
+;;     and the offset where the line starts, 4 bytes each. Searching a
+;;     directory, each file's matches come after a record with line 0 and
+;;     the file's name, offset bytes long. close() it at the end.
+;;     Returns the fd, or -1 with the error in _oserror.
+
+.export _open_search
+.import popax, __oserror
+
+FS_OPEN_SEARCH = $FF78
+
+os_ptr2    = $32    ; The OS's ptr2, where FS_OPEN_SEARCH wants the pattern.
+
+
+
+.proc _open_search
+        pha                 ; flags
+        jsr popax           ; pattern
+        sta os_ptr2
+        stx os_ptr2+1
+        jsr popax           ; path
+        pla
+        tay                 ; flags in Y
+        jsr FS_OPEN_SEARCH
+        cpx #0
+        beq done            ; the fd is in A
+        sta __oserror
+        lda #$ff
+        tax
+done:   rts
+.endproc
@@ -0,0 +1,93 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+;; slurp.asm - C wrapper for reading a small file in one go.
+;;
+;; int __fastcall__ slurp (const char* name, void* buf, unsigned int max,
+;;                         unsigned long* size);
+;;     Reads up to max bytes from the start of file name into buf, with one
+;;     command to the disk controller instead of an open, reads and a
+;;     close. If size isn't NULL, it's set to the size of the whole file,
+;;     so a short buffer can be spotted, or the file's size found with a
+;;     max of 0. Returns the number of bytes read, or -1 with the error in
+;;     _oserror.
+
+.export _slurp
+.import popax, __oserror
+.importzp ptr1
+
+FS_SLURP = $FF72
+
+os_ptr1    = $30    ; The OS's ptr1 & ptr2, where FS_SLURP wants the
+os_ptr2    = $32    ; buffer & the size and count.
+
+.bss
+info:   .res 6      ; the file's size, then the count
+size:   .res 2
+
+.code
+
+.proc _slurp
+        sta size
+        stx size+1
+        jsr popax           ; max
+        sta info+4
+        stx info+5
+        jsr popax           ; buf
+        sta os_ptr1
+        stx os_ptr1+1
+        lda #<info
+        sta os_ptr2
+        lda #>info
+        sta os_ptr2+1
+        jsr popax           ; name
+        jsr FS_SLURP
+        cpx #0
+        bne error
+
+        lda size
+        ora size+1
+        beq done            ; no size wanted
+        lda size
+        sta ptr1
+        lda size+1
+        sta ptr1+1
+        ldy #3
+copy:   lda info,y
+        sta (ptr1),y
+        dey
+        bpl copy
+done:   lda info+4          ; bytes read
+        ldx info+5
+        rts
+error:  sta __oserror
+        lda #$ff
+        tax
+        rts
+.endproc
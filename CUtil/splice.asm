@@ -0,0 +1,85 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+;; splice.asm - C wrapper for moving data between two open files on the
+;; disk controller.
+;;
+;; long __fastcall__ splice (int src, int dst, unsigned long count);
+;;     Moves up to count bytes from file src to file dst, each from its
+;;     current position, without the data coming over the bus. Both have
+;;     to be files on the SD card, src open for reading and dst for
+;;     writing. Returns the number of bytes moved, which is fewer than
+;;     count if src ran out, or -1 with the error in _oserror.
+
+.export _splice
+.import popax, __oserror
+.importzp sreg
+
+FS_SPLICE = $FF75
+
+os_ptr1    = $30    ; The OS's ptr1, where FS_SPLICE wants the count.
+
+.bss
+count:  .res 4
+dst:    .res 1
+
+.code
+
+.proc _splice
+        sta count
+        stx count+1
+        lda sreg
+        sta count+2
+        lda sreg+1
+        sta count+3
+        jsr popax           ; dst
+        sta dst
+        jsr popax           ; src
+        ldx #<count
+        stx os_ptr1
+        ldx #>count
+        stx os_ptr1+1
+        ldx dst
+        jsr FS_SPLICE
+        cpx #0
+        bne error
+        lda count+2         ; bytes moved
+        sta sreg
+        lda count+3
+        sta sreg+1
+        lda count
+        ldx count+1
+        rts
+error:  sta __oserror
+        lda #$ff
+        sta sreg
+        sta sreg+1
+        tax
+        rts
+.endproc
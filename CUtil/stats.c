@@ -0,0 +1,131 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above 
+ *    copyright notice, this list of conditions and the following 
+ *    disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, 
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED 
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Prints the disk controller's performance counters: how many of each
+// kind of request it has handled, how many bytes they moved over the bus
+// and how long they took, plus its SD card, bus wait and idle times.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SD_CMD_STATS 12
+#define STATS_TOTALS 8
+#define STATS_RESET  0xff
+
+int __fastcall__ sd_command (const void* frame, unsigned char len,
+                             void* reply, unsigned char reply_len);
+
+// Layouts of the controller's replies.
+struct command_stats
+{
+    unsigned long count;
+    unsigned long bytes;
+    unsigned long total_us;
+    unsigned long max_us;
+};
+
+struct total_stats
+{
+    unsigned long sd_us;
+    unsigned long bus_wait_us;
+    unsigned long idle_us;
+    unsigned long elapsed_ms;
+};
+
+const char* names[] = { "other", "getc", "putc", "seek",
+                        "read", "write", "bulk", "command" };
+
+
+
+void usage (void)
+{
+    fputs("usage: stats [-r]\r\n", stderr);
+    fputs("  -r  reset the counters after printing them\r\n", stderr);
+    exit(2);
+}
+
+
+
+// Reads one set of counters. Exits if the controller says no.
+void get_stats (unsigned char index, void* reply)
+{
+    unsigned char frame[4];
+    frame[0] = SD_CMD_STATS;
+    frame[1] = 1;       // 1 arg
+    frame[2] = 1;       // 1 byte long
+    frame[3] = index;
+    if (sd_command (frame, 4, reply, sizeof(struct command_stats)) < 0)
+    {
+        fputs("stats: controller doesn't support stats\r\n", stderr);
+        exit(1);
+    }
+}
+
+
+
+int main (int argc, char** argv)
+{
+    int ch, i;
+    int reset = 0;
+    struct command_stats c;
+    struct total_stats t;
+
+    while ((ch = getopt(argc, argv, "r")) != -1)
+    {
+        switch(ch)
+        {
+        case 'r':
+            reset = 1;
+            break;
+        case '?':
+        default:
+            usage();
+        }
+    }
+
+    printf ("%-8s %9s %9s %9s %7s %7s\r\n",
+            "request", "count", "bytes", "total ms", "avg us", "max us");
+    for (i = 0; i < STATS_TOTALS; ++i)
+    {
+        get_stats (i, &c);
+        if (c.count == 0)
+            continue;
+        printf ("%-8s %9lu %9lu %9lu %7lu %7lu\r\n", names[i], c.count,
+                c.bytes, c.total_us / 1000, c.total_us / c.count, c.max_us);
+    }
+
+    get_stats (STATS_TOTALS, &t);
+    printf ("\r\nover %lu ms: SD card %lu ms, bus wait %lu ms, idle %lu ms\r\n",
+            t.elapsed_ms, t.sd_us / 1000, t.bus_wait_us / 1000, t.idle_us / 1000);
+
+    if (reset)
+        get_stats (STATS_RESET, &t);
+    return 0;
+}
@@ -0,0 +1,116 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above 
+ *    copyright notice, this list of conditions and the following 
+ *    disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, 
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED 
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// Prints the CRC-32 and size of each file, and optionally the CRC-16 that
+// XModem uses. The disk controller does the arithmetic, so none of the
+// file has to come over the bus.
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <p65.h>
+
+struct file_sum {
+    unsigned long crc32;
+    unsigned int crc16;
+    unsigned long count;    // bytes summed
+};
+
+int sum_file (const char* name, unsigned char which, unsigned long offset,
+              unsigned long length, struct file_sum* sum);
+
+#define SUM_CRC32 1
+#define SUM_CRC16 2
+
+
+
+void usage (void)
+{
+    fputs("usage: sum [-x] [-o offset] [-n length] file ...\r\n", stderr);
+    fputs("  -x  print the XModem CRC-16 too\r\n", stderr);
+    fputs("  -o  start offset bytes into each file\r\n", stderr);
+    fputs("  -n  sum at most length bytes\r\n", stderr);
+    exit(2);
+}
+
+
+
+int main (int argc, char** argv)
+{
+    int ch, i;
+    int status = 0;
+    unsigned char which = SUM_CRC32;
+    unsigned long offset = 0;
+    unsigned long length = 0xffffffffUL;
+    struct file_sum sum;
+
+    while ((ch = getopt(argc, argv, "xo:n:")) != -1)
+    {
+        switch(ch)
+        {
+        case 'x':
+            which |= SUM_CRC16;
+            break;
+        case 'o':
+            offset = strtoul (optarg, NULL, 0);
+            break;
+        case 'n':
+            length = strtoul (optarg, NULL, 0);
+            break;
+        case '?':
+        default:
+            usage();
+        }
+    }
+
+    if (optind == argc)
+        usage();
+
+    for (i = optind; i < argc; ++i)
+    {
+        if (sum_file (argv[i], which, offset, length, &sum) == -1)
+        {
+            fprintf (stderr, "sum: %s: ", argv[i]);
+            if (__oserror != 0)
+                fprintf (stderr, "%s\r\n", __stroserror(_oserror));
+            else
+                fprintf (stderr, "%s\r\n", strerror(errno));
+            errno = _oserror = 0;
+            status = 1;
+            continue;
+        }
+        if (which & SUM_CRC16)
+            printf ("%08lx %04x %lu %s\r\n", sum.crc32, sum.crc16, sum.count, argv[i]);
+        else
+            printf ("%08lx %lu %s\r\n", sum.crc32, sum.count, argv[i]);
+    }
+    return status;
+}
@@ -0,0 +1,91 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without 
+ * modification, are permitted provided that the following conditions 
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright 
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above 
+ *    copyright notice, this list of conditions and the following 
+ *    disclaimer in the documentation and/or other materials 
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS 
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT 
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS 
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE 
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, 
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, 
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; 
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER 
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, 
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) 
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED 
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// sum_file() asks the disk controller for a file's CRC-32 and XModem
+// CRC-16, so checking a file costs a few bytes over the bus instead of
+// reading the whole thing. Shared by sum and cp.
+
+#include <string.h>
+#include <errno.h>
+#include <p65.h>
+
+#define SD_CMD_SUM 21
+#define MAX_NAME   64
+
+struct file_sum {
+    unsigned long crc32;
+    unsigned int crc16;
+    unsigned long count;    // bytes summed
+};
+
+int __fastcall__ sd_command (const void* frame, unsigned char len,
+                             void* reply, unsigned char reply_len);
+
+
+
+// Sums length bytes of name, starting at offset, or up to the end of the
+// file if that comes first. which is 1 for the CRC-32, 2 for the CRC-16,
+// or 3 for both; sums not asked for come back 0.
+// Returns 0, or -1 with the error in _oserror or errno.
+int sum_file (const char* name, unsigned char which, unsigned long offset,
+              unsigned long length, struct file_sum* sum)
+{
+    unsigned char frame[MAX_NAME + 16];
+    unsigned char* p = frame;
+    unsigned char n;
+    int status;
+
+    if (strlen(name) > MAX_NAME)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    n = strlen(name);
+    *p++ = SD_CMD_SUM;
+    *p++ = 4;           // 4 args
+    *p++ = n;
+    memcpy (p, name, n);
+    p += n;
+    *p++ = 1;
+    *p++ = which;
+    *p++ = 4;
+    memcpy (p, &offset, 4);
+    p += 4;
+    *p++ = 4;
+    memcpy (p, &length, 4);
+    p += 4;
+
+    status = sd_command (frame, p - frame, sum, sizeof(struct file_sum));
+    if (status < 0)
+    {
+        _oserror = status;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,101 @@
+;; Copyright (c) 2024, Christopher Just
+;; All rights reserved.
+;;
+;; Redistribution and use in source and binary forms, with or without
+;; modification, are permitted provided that the following conditions
+;; are met:
+;;
+;;    Redistributions of source code must retain the above copyright
+;;    notice, this list of conditions and the following disclaimer.
+;;
+;;    Redistributions in binary form must reproduce the above
+;;    copyright notice, this list of conditions and the following
+;;    disclaimer in the documentation and/or other materials
+;;    provided with the distribution.
+;;
+;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+;; "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+;; LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+;; FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+;; COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+;; INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+;; BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+;; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+;; CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+;; STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+;; ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+;; OF THE POSSIBILITY OF SUCH DAMAGE.
+
+;; treejob.asm - C wrappers for the disk controller's recursive copy and
+;; delete jobs.
+;;
+;; int __fastcall__ rmtree (const char* path);
+;; int __fastcall__ cptree (const char* src, const char* dst);
+;;     Start a job. Return 0, or -1 with the error in _oserror.
+;; int __fastcall__ treejob_status (unsigned* count);
+;;     Returns 1 while the job is running, then 0 if it succeeded or -1
+;;     with the error in _oserror. Stores the # of entries done in count.
+
+.export _rmtree, _cptree, _treejob_status
+.import popax, __oserror
+.importzp ptr1
+
+FS_TREEJOB_STATUS = $FF93
+FS_CPTREE         = $FF96
+FS_RMTREE         = $FF99
+
+os_ptr2    = $32    ; The OS's ptr2, where cptree wants the dest name.
+P65_EAGAIN = $80 | 10
+
+
+
+.proc _rmtree
+        jsr FS_RMTREE
+        jmp return_status
+.endproc
+
+
+
+.proc _cptree
+        sta os_ptr2         ; dst
+        stx os_ptr2+1
+        jsr popax           ; src
+        jsr FS_CPTREE
+        jmp return_status
+.endproc
+
+
+
+.proc _treejob_status
+        sta ptr1
+        stx ptr1+1
+        jsr FS_TREEJOB_STATUS   ; status in A, count in X (low) & Y (high)
+        pha
+        tya
+        ldy #1
+        sta (ptr1),y
+        txa
+        dey
+        sta (ptr1),y
+        pla
+        cmp #P65_EAGAIN
+        bne return_status
+        lda #1              ; still running
+        ldx #0
+        rts
+.endproc
+
+
+
+; Turns the P65 status in A into a C return value: 0 for P65_EOK, or
+; -1 with the status saved in _oserror.
+.proc return_status
+        cmp #0
+        beq ok
+        sta __oserror
+        lda #$ff
+        tax
+        rts
+ok:     tax
+        rts
+.endproc
@@ -7,11 +7,39 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#define SD_CMD_FALLOCATE 14
+#define O_CONTIG 0x08
+
+int __fastcall__ sd_command (const void* frame, unsigned char len,
+                             void* reply, unsigned char reply_len);
+
 int write_test = 0;
 int read_test = 0;
+int contiguous = 0;
 int test_size = 10 * 1024;
 
 
+// Has the controller create ds_test.dat in one contiguous piece, so that
+// it can be written without any FAT updates.
+int Preallocate ()
+{
+    static const char name[] = "ds_test.dat";
+    unsigned char frame[4 + sizeof(name) - 1 + 5];
+    unsigned char* p = frame;
+    *p++ = SD_CMD_FALLOCATE;
+    *p++ = 2;
+    *p++ = sizeof(name) - 1;
+    memcpy (p, name, sizeof(name) - 1);
+    p += sizeof(name) - 1;
+    *p++ = 4;
+    *p++ = (unsigned char)test_size;
+    *p++ = (unsigned char)(test_size >> 8);
+    *p++ = 0;
+    *p++ = 0;
+    return sd_command (frame, p - frame, NULL, 0);
+}
+
+
 void PerformWriteTest ()
 {
     register char* buffer;
@@ -42,7 +70,19 @@ void PerformWriteTest ()
         buffer[i] = (char)i;        //   1.31 s 
     putchar('*');
 
-    fd = open ("ds_test.dat", O_WRONLY | O_CREAT | O_TRUNC);
+    if (contiguous)
+    {
+        if (Preallocate () < 0)
+        {
+            printf ("Unable to preallocate ds_test.dat.\r\n");
+            exit(1);
+        }
+        fd = open ("ds_test.dat", O_WRONLY | O_CONTIG);
+    }
+    else
+    {
+        fd = open ("ds_test.dat", O_WRONLY | O_CREAT | O_TRUNC);
+    }
     if (fd == -1)
     {
         printf ("Unable to open test file ds_test.dat: %s.\r\n", strerror(errno));
@@ -132,7 +172,8 @@ void PerformReadTest ()
 void usage (void)
 {
     fprintf(stderr, "usage: diskspeed -r\r\n");
-    fprintf(stderr, "   or: diskspeed -w [-s size_kb]\r\n");
+    fprintf(stderr, "   or: diskspeed -w [-c] [-s size_kb]\r\n");
+    fprintf(stderr, "  -c  preallocate the test file in one piece\r\n");
     exit(2);
 }
 
@@ -141,7 +182,7 @@ int main (int argc, char** argv)
 {
     int ch;
 
-    while ((ch = getopt(argc, argv, "rws:")) != -1)
+    while ((ch = getopt(argc, argv, "rwcs:")) != -1)
     {
         switch(ch)
         {
@@ -151,6 +192,9 @@ int main (int argc, char** argv)
         case 'w':
             write_test = 1;
             break;
+        case 'c':
+            contiguous = 1;
+            break;
         case 's':
             test_size = 1024 * atoi (optarg);
             break;
@@ -39,9 +39,6 @@
 // to better ensure both sides never try to drive
 // the bus simultaneously.
 
-// Todo: Management of current directory, cwd
-// support, etc.
-
 // Todo: detect SD Card removal/insertion?
 
 // Todo: Because P:65 seek uses a signed int, we should probably fail to
@@ -64,6 +61,7 @@
 constexpr uint8_t P65_O_RDONLY = 0x01;
 constexpr uint8_t P65_O_WRONLY = 0x02;
 constexpr uint8_t P65_O_RDWR = 0x03;
+constexpr uint8_t P65_O_CONTIG = 0x08;  // P:65 only. Write a contiguous file straight to the card.
 constexpr uint8_t P65_O_CREAT = 0x10;
 constexpr uint8_t P65_O_TRUNC = 0x20;
 constexpr uint8_t P65_O_APPEND = 0x40;
@@ -73,12 +71,18 @@ constexpr uint8_t P65_O_EXCL = 0x80;
 // bit 7 set so they're all negative values (except EOK).
 constexpr uint8_t P65_EOK = 0;
 constexpr uint8_t P65_ENOENT = 0x80 | 1;
+constexpr uint8_t P65_ENOMEM = 0x80 | 2;
+constexpr uint8_t P65_EBUSY = 0x80 | 6;
 constexpr uint8_t P65_EINVAL = 0x80 | 7;
+constexpr uint8_t P65_ENOSPC = 0x80 | 8;
 constexpr uint8_t P65_EEXIST = 0x80 | 9;
+constexpr uint8_t P65_EAGAIN = 0x80 | 10;
 constexpr uint8_t P65_EIO = 0x80 | 11;
+constexpr uint8_t P65_EINTR = 0x80 | 12;
 constexpr uint8_t P65_ENOSYS = 0x80 | 13;
 constexpr uint8_t P65_ERANGE = 0x80 | 15;
 constexpr uint8_t P65_EBADF = 0x80 | 16;
+constexpr uint8_t P65_ENOEXEC = 0x80 | 17;
 constexpr uint8_t P65_EUNKNOWN = 0x80 | 18;
 constexpr uint8_t P65_ENOTDIR = 0x80 | 20;
 constexpr uint8_t P65_EISDIR = 0x80 | 21;
@@ -92,8 +96,9 @@ constexpr uint8_t P65_SEEK_END = 1;
 constexpr uint8_t P65_SEEK_SET = 2;
 
 // Indices of the first and last file channels. Command channel is 0.
+// MAX_CHANNEL has to match SD_DATA_CHANNELS in OS/os3.inc.
 constexpr int MIN_CHANNEL = 1;
-constexpr int MAX_CHANNEL = 2;
+constexpr int MAX_CHANNEL = 3;
 
 
 constexpr int data0 = 1;
@@ -107,8 +112,6 @@ constexpr int data7 = 9;
 constexpr int ca1 = 0;
 constexpr int ca2 = 2;  // needs to be 2 or 3 so we can recv interrupts.
 
-volatile int signal_received = 0;
-
 void ErrorFlash()
 {
     pinMode(13, OUTPUT);
@@ -122,24 +125,333 @@ void ErrorFlash()
     }
 }
 
-/*
-void InterruptHandler()
+/* Instrumentation. Timer1 runs freely at 2 ticks per microsecond (16 MHz
+ * with a /8 prescaler), and its overflow interrupt extends it to 32 bits.
+ * loop() records the time and the bus bytes of every request, by protocol
+ * command. On top of that we add up the time spent on SD card transfers
+ * for the caches, waiting for the 6502's side of a handshake in the middle
+ * of a request, and running idle tasks. SD time overlaps the other two.
+ * The 6502 reads it all with CMD_STATS.
+ *
+ * The counters take about 150 bytes of RAM the '328 can't spare in normal
+ * use, so they're only built with P65_STATS set to 1 (the host bench does).
+ * Otherwise CMD_STATS replies P65_ENOSYS and none of this costs anything.
+ */
+#ifndef P65_STATS
+#define P65_STATS 0
+#endif
+
+struct CommandStats
+{
+    uint32_t count;
+    uint32_t bytes;     // sent and received, including the protocol byte
+    uint32_t total_us;
+    uint32_t max_us;
+};
+
+struct TotalStats
+{
+    uint32_t sd_us;
+    uint32_t bus_wait_us;
+    uint32_t idle_us;
+    uint32_t start_ms;  // millis() when the stats were reset. Sent as ms since.
+};
+
+constexpr uint8_t StatsTotalsIndex = 8;
+constexpr uint8_t StatsResetIndex = 0xff;
+static_assert(sizeof(CommandStats) == sizeof(TotalStats));
+
+#if P65_STATS
+
+struct Stats
+{
+    CommandStats commands[8];   // by protocol command >> 4. 0 for unknown ones.
+    TotalStats totals;
+} stats;
+
+#ifdef P65_HOST_SIM
+
+inline void StartStatsTimer()
+{
+    ;
+}
+
+inline uint32_t Ticks()
 {
-    //++signal_received;
-    signal_received = 1;
+    return micros() * 2;
 }
-*/
 
+#else
 
-char ReadByte()
+volatile uint16_t timer1_overflows = 0;
+
+ISR(TIMER1_OVF_vect)
+{
+    ++timer1_overflows;
+}
+
+void StartStatsTimer()
+{
+    TCCR1A = 0;
+    TCCR1B = _BV(CS11);     // clk/8, normal mode
+    TCNT1 = 0;
+    TIMSK1 = _BV(TOIE1);
+}
+
+uint32_t Ticks()
+{
+    uint8_t sreg = SREG;
+    noInterrupts();
+    uint16_t high = timer1_overflows;
+    uint16_t low = TCNT1;
+    // An overflow that happened since we turned interrupts off hasn't been
+    // counted yet.
+    if ((TIFR1 & _BV(TOV1)) && (low < 0x8000))
+        ++high;
+    SREG = sreg;
+    return ((uint32_t)high << 16) | low;
+}
+
+#endif // P65_HOST_SIM
+
+inline uint32_t MicrosSince(uint32_t start_ticks)
+{
+    return (Ticks() - start_ticks) >> 1;
+}
+
+// Adds the time from its construction to its destruction to the SD total.
+class SdBusyTimer
+{
+    uint32_t start = Ticks();
+public:
+    ~SdBusyTimer()
+    {
+        stats.totals.sd_us += MicrosSince(start);
+    }
+};
+
+#else
+
+inline void StartStatsTimer()
+{
+    ;
+}
+
+class SdBusyTimer
+{
+public:
+    SdBusyTimer()
+    {
+        ;
+    }
+};
+
+#endif // P65_STATS
+
+
+#ifdef P65_HOST_SIM
+
+// Built to run on a PC, talking to a simulated 6502. See host/README.md.
+#include "host/HostBus.h"
+
+inline uint32_t BusBytes()
+{
+    return host_bus.handshakes;
+}
+
+#else
+
+#if P65_STATS
+
+uint32_t bus_bytes = 0;  // every byte ReadByte() or Write*() moves
+
+inline uint32_t BusBytes()
+{
+    return bus_bytes;
+}
+
+inline void CountBusByte()
+{
+    ++bus_bytes;
+}
+
+// Waits for the 6502 to drop CA2, counting the time as bus wait.
+inline void WaitForCA2Low()
+{
+    if (PIND & 4)
+    {
+        uint32_t start = Ticks();
+        while (PIND & 4)
+            ;
+        stats.totals.bus_wait_us += MicrosSince(start);
+    }
+}
+
+#else
+
+inline void CountBusByte()
+{
+    ;
+}
+
+inline void WaitForCA2Low()
 {
-    while (PIND & 4) // wait for CA2 to go low
+    while (PIND & 4)
         ;
+}
+
+#endif // P65_STATS
+
 
-    char result = 
+/* Receive FIFO. The 6502's side of the handshake is: put a byte on the bus,
+ * drop CA2, wait for CA1 to go high, raise CA2, wait for CA1 to go low.
+ * An interrupt on each CA2 edge does our side of that, so the 6502 doesn't
+ * have to wait for loop() to finish whatever SD card work it's doing.
+ * Bytes go into rx_fifo and ReadByte() takes them from there.
+ *
+ * The data lines don't say which way a byte is going, so the interrupt
+ * can't tell a byte being sent from the 6502 getting ready to read a reply.
+ * It follows enough of the protocol to know where each request ends, and
+ * disarms itself after the first byte of any request that gets a reply.
+ * Only putc (0x20) and write (0x50) are taken whole. The rest of a request
+ * and our reply are handled by polling, as before, and loop() re-arms the
+ * interrupt once the reply is sent. It also disarms if the FIFO fills up,
+ * leaving the 6502 waiting with its byte on the bus until loop() catches up.
+ */
+constexpr uint8_t RxFifoSize = 32;  // must be a power of 2
+volatile uint8_t rx_fifo[RxFifoSize];
+volatile uint8_t rx_head = 0;       // written by the interrupt
+volatile uint8_t rx_tail = 0;       // written by ReadByte()
+volatile bool rx_armed = false;     // the interrupt takes new bytes
+volatile bool rx_acked = false;     // the interrupt raised CA1 and has to drop it
+
+// Where the interrupt is in the current request.
+enum : uint8_t { RX_REQUEST, RX_PUTC_DATA, RX_WRITE_COUNT_LO, RX_WRITE_COUNT_HI, RX_WRITE_DATA };
+uint8_t rx_state = RX_REQUEST;
+uint16_t rx_count = 0;
+
+
+inline char GetDataLines()
+{
+    return
         ((PIND & 0b00000010) >> 1) |
         ((PIND & 0b11111000) >> 2) |
         ((PINB & 0b00000011) << 6);
+}
+
+
+// Returns true if the 6502 sends more after byte b without waiting for a
+// reply from us.
+bool RxExpectsMore(uint8_t b)
+{
+    switch (rx_state)
+    {
+        case RX_REQUEST:
+            if ((b & 0xf0) == 0x20)
+                rx_state = RX_PUTC_DATA;
+            else if ((b & 0xf0) == 0x50)
+                rx_state = RX_WRITE_COUNT_LO;
+            else
+                return false;
+            return true;
+        case RX_PUTC_DATA:
+            rx_state = RX_REQUEST;
+            return true;
+        case RX_WRITE_COUNT_LO:
+            rx_count = b;
+            rx_state = RX_WRITE_COUNT_HI;
+            return true;
+        case RX_WRITE_COUNT_HI:
+            rx_count |= (uint16_t)b << 8;
+            rx_state = RX_WRITE_DATA;
+            return rx_count != 0;
+        default: // RX_WRITE_DATA
+            return --rx_count != 0;
+    }
+}
+
+
+// Interrupt handler for both edges of CA2.
+void HandshakeInterrupt()
+{
+    if (PIND & 4)
+    {
+        // CA2 went high, so the 6502 has seen our CA1.
+        if (rx_acked)
+        {
+            PORTD &= 0b11111110; // set CA1 low
+            rx_acked = false;
+        }
+        return;
+    }
+
+    // Already acked this one. CA2 stays low until the 6502 sees it.
+    if (!rx_armed || rx_acked)
+        return;
+    uint8_t next = (rx_head + 1) & (RxFifoSize - 1);
+    if (next == rx_tail)
+    {
+        rx_armed = false;  // full. ReadByte() will poll for this one.
+        return;
+    }
+    uint8_t b = GetDataLines();
+    rx_fifo[rx_head] = b;
+    rx_head = next;
+    PORTD |= 1; // Set CA1 high
+    rx_acked = true;
+    rx_armed = RxExpectsMore(b);
+}
+
+
+// Lets the interrupt take the next request. Only call between requests.
+void ArmReceiver()
+{
+    noInterrupts();
+    if (!rx_armed && (rx_head == rx_tail))
+    {
+        rx_state = RX_REQUEST;
+        rx_armed = true;
+        // If the 6502 has already put a byte on the bus, we missed the edge.
+        if (!rx_acked && ((PIND & 4) == 0))
+            HandshakeInterrupt();
+    }
+    interrupts();
+}
+
+
+// True if the 6502 has started a request that we haven't read yet.
+inline bool RequestPending()
+{
+    return (rx_head != rx_tail) || ((PIND & 4) == 0);
+}
+
+
+char ReadByte()
+{
+    for (;;)
+    {
+        // Check armed first. Once it's clear, the interrupt won't add
+        // anything else to the FIFO.
+        bool armed = rx_armed;
+        if (rx_tail != rx_head)
+        {
+            CountBusByte();
+            char result = rx_fifo[rx_tail];
+            rx_tail = (rx_tail + 1) & (RxFifoSize - 1);
+            return result;
+        }
+        if (!armed)
+            break;
+    }
+
+    // Let the interrupt finish its last handshake before we start ours.
+    while (rx_acked)
+        ;
+
+    WaitForCA2Low();
+    CountBusByte();
+
+    char result = GetDataLines();
 
     PORTD |= 1; // Set CA1 high
 
@@ -153,16 +465,59 @@ char ReadByte()
 }
 
 
-void WriteByte(char data)
+/* Burst writes. Rather than switching the data lines to outputs and back
+ * for every byte, a multi-byte frame switches them once at the start and
+ * once at the end, and the handshake loop in between only strobes data.
+ * Every byte of a frame except the last goes out with WriteBurstByte().
+ * The last goes out with EndWriteBurst(), which releases the bus before
+ * completing the final handshake, so that the 6502 never sees CA1 drop
+ * while we're still driving the data lines.
+ */
+inline void BeginWriteBurst()
 {
-    while (PIND & 4) // wait for CA2 to go low
+    // We only reply once the interrupt has disarmed, but it may still be
+    // finishing the handshake for the byte before.
+    while (rx_acked)
         ;
-
+    // The 6502 keeps driving the data lines until it has switched them to
+    // inputs and dropped CA2, so only drive them after that.
+    WaitForCA2Low();
     DDRD = 0b11111011;
     DDRB |= 0b00000011;
+}
 
+
+inline void PutDataLines(char data)
+{
     PORTD = ((data & 0b00000001) << 1) | ((data & 0b11111110) << 2);
     PORTB = (PORTB & 0b11111100) | (data >> 6);
+}
+
+
+void WriteBurstByte(char data)
+{
+    WaitForCA2Low();
+    CountBusByte();
+
+    PutDataLines(data);
+
+    // data is ready to be read, de-assert wait
+    PORTD |= 1; // Set CA1 high
+
+    // Wait for CA2 to go high
+    while ((PIND & 4) == 0)
+        ;
+
+    PORTD &= 0b11111110; // Set CA1 low
+}
+
+
+void EndWriteBurst(char data)
+{
+    WaitForCA2Low();
+    CountBusByte();
+
+    PutDataLines(data);
 
     // data is ready to be read, de-assert wait
     PORTD |= 1; // Set CA1 high
@@ -179,6 +534,16 @@ void WriteByte(char data)
 }
 
 
+#endif // P65_HOST_SIM
+
+
+void WriteByte(char data)
+{
+    BeginWriteBurst();
+    EndWriteBurst(data);
+}
+
+
 
 /* Writes a character with standard escaping. -1 is treated as EOF. */
 void WriteEscapedChar (int ch)
@@ -210,7 +575,94 @@ void WriteEscapedError (uint8_t error_code)
 
 
 
+/* Writes the header of a bulk read frame: status P65_EOK and the number
+ * of raw bytes that will follow. This starts a burst. If count is nonzero,
+ * the caller sends exactly count more bytes, the last one with
+ * EndWriteBurst().
+ */
+void WriteBulkHeader (int count)
+{
+    BeginWriteBurst();
+    WriteBurstByte((char)P65_EOK);
+    WriteBurstByte(((unsigned char*)&count)[0]);
+    if (count == 0)
+        EndWriteBurst(((unsigned char*)&count)[1]);
+    else
+        WriteBurstByte(((unsigned char*)&count)[1]);
+}
+
+
+
+/* Sends n bytes of data PackBits style, as part of a burst: a header byte
+ * h of 0-127 is followed by h+1 literal bytes, and one of 129-255 by one
+ * byte to repeat 257-h times. It's cheap for the 6502 to undo as the bytes
+ * arrive, and at worst it costs a byte per 128. If last is set, the burst
+ * ends with the final byte. Runs don't carry over from one call to the
+ * next, so callers can pack whatever they have in hand.
+ */
+inline void WritePackedByte(unsigned char b, bool end)
+{
+    if (end)
+        EndWriteBurst(b);
+    else
+        WriteBurstByte(b);
+}
+
+void WritePacked(const unsigned char* data, int n, bool last)
+{
+    int i = 0;
+    while (i < n)
+    {
+        int run = 1;
+        while ((i + run < n) && (run < 128) && (data[i + run] == data[i]))
+            ++run;
+        if (run >= 3)
+        {
+            WriteBurstByte(257 - run);
+            i += run;
+            WritePackedByte(data[i - 1], last && (i == n));
+            continue;
+        }
+
+        // Literals, up to where a run of 3 or more starts.
+        int j = i;
+        while ((j < n) && (j - i < 128) &&
+               !((j + 2 < n) && (data[j] == data[j + 1]) && (data[j] == data[j + 2])))
+            ++j;
+        WriteBurstByte(j - i - 1);
+        for (; i < j; ++i)
+            WritePackedByte(data[i], last && (i == n - 1));
+    }
+}
+
+
+
+/* Writes a status byte followed by a 4-byte value as a single burst. */
+void WriteStatusAndLong (uint8_t status, long int value)
+{
+    char* buf = (char*)(&value);
+    BeginWriteBurst();
+    WriteBurstByte(status);
+    WriteBurstByte(buf[0]);
+    WriteBurstByte(buf[1]);
+    WriteBurstByte(buf[2]);
+    EndWriteBurst(buf[3]);
+}
+
+
+
+/* Writes a 2-byte count as a single burst. */
+void WriteCount (int count)
+{
+    BeginWriteBurst();
+    WriteBurstByte(((unsigned char*)&count)[0]);
+    EndWriteBurst(((unsigned char*)&count)[1]);
+}
+
+
+
 
+class FileRW;
 
 class FileIO
 {
@@ -245,6 +697,12 @@ class FileIO
         // Flush any buffered writes
         ;
     }
+    // Called from loop() when the 6502 isn't waiting on us, so that
+    // handlers can get ahead on slow SD card work.
+    virtual void idle()
+    {
+        ;
+    }
     // 6502 reads n chars
     virtual void  read()
     {
@@ -252,11 +710,36 @@ class FileIO
         ReadByte();
         WriteEscapedError(P65_ENOSYS);
     }
+    // 6502 reads up to n chars as a single unescaped frame. The reply is a
+    // status byte and, if that's P65_EOK, a 2-byte count followed by
+    // exactly that many raw bytes. A count of 0 means end of file.
+    virtual void bulkRead()
+    {
+        ReadByte(); // read 2 bytes of count
+        ReadByte();
+        WriteByte(P65_ENOSYS);
+    }
+    // Like bulkRead(), but the bytes after the count are packed with
+    // WritePacked(). The count is how many they unpack to.
+    virtual void packedRead()
+    {
+        ReadByte(); // read 2 bytes of count
+        ReadByte();
+        WriteByte(P65_ENOSYS);
+    }
+    // For directories. Like bulkRead(), but the bytes are whole entries
+    // in the CompactDirent() format.
+    virtual void listRead()
+    {
+        ReadByte(); // read 2 bytes of count
+        ReadByte();
+        WriteByte(P65_ENOSYS);
+    }
     // 6502 writes n chars
     virtual void write()
     {
         // some dubious type punning here
-        int count;
+        int count = 0;
         unsigned char* c = (unsigned char*)&count;
         c[0] = ReadByte();
         c[1] = ReadByte();
@@ -265,11 +748,17 @@ class FileIO
         WriteByte((char)P65_EBADF);
         WriteByte((char)0xFF);
     }
+    // The open file behind this channel, for commands like CMD_SPLICE that
+    // work on two channels at once. nullptr if it isn't a file.
+    virtual FileRW* asFile()
+    {
+        return nullptr;
+    }
 };
 
 
 
-struct dirent
+struct __attribute__((packed)) dirent
 {
     char d_name[13];  // 8.3 plus terminating zero
     char d_type;      // 1 for regular file, 2 for directory
@@ -278,10 +767,44 @@ struct dirent
 
 
 
+// Fills in d for a directory entry.
+void FillDirent(File& entry, struct dirent* d)
+{
+    strncpy(d->d_name, entry.name(), 12);
+    d->d_name[12] = 0;
+    d->d_type = entry.isDirectory() ? 2 : 1;
+    d->d_size = entry.size();
+}
+
+
+
+/* The compact form of a dirent that listing reads send, since most of a
+ * struct dirent is padding. There's a header byte with the length of the
+ * name in bits 0-3, bit 4 set for a directory, and the number of bytes of
+ * size in bits 5-7. Then come the name, without its terminator, and the
+ * size, low byte first, without its high zero bytes. A directory's size
+ * is 0, so it has none. Returns the number of bytes in out.
+ */
+constexpr int MaxCompactDirent = 1 + 12 + 4;
+
+int CompactDirent(const struct dirent* d, unsigned char* out)
+{
+    int len = strnlen(d->d_name, 12);
+    int size_len = 0;
+    while ((size_len < 4) && (d->d_size >> (8 * size_len)))
+        ++size_len;
+    out[0] = len | ((d->d_type == 2) ? 0x10 : 0) | (size_len << 5);
+    memcpy(out + 1, d->d_name, len);
+    memcpy(out + 1 + len, &d->d_size, size_len);  // little endian
+    return 1 + len + size_len;
+}
+
+
+
 class DirectoryReader2 : public FileIO
 {
+  protected:
     File dir;
-    File entry;
     bool dir_open;
     int read_position = 0;
     int write_position = 0;
@@ -304,30 +827,12 @@ class DirectoryReader2 : public FileIO
     ~DirectoryReader2() override
     {
         dir.close();
-        entry.close();
     }
 
     int getChar() override
     {
-        if (read_position == write_position)
-        {
-            // try to get another entry
-            if (entry = dir.openNextFile())
-            {
-                strncpy(dirent->d_name, entry.name(), 12);
-                dirent->d_name[12] = 0;
-                dirent->d_type = entry.isDirectory() ? 2 : 1;
-                dirent->d_size = entry.size();
-                write_position = sizeof(struct dirent);
-                read_position = 0;
-                entry.close();
-            }
-            else
-            {
-                dir.close();
-                return -1;
-            }
-        }
+        if ((read_position == write_position) && !fill())
+            return -1;
         unsigned char retval = buffer[read_position];
         ++read_position;
         return retval;
@@ -335,7 +840,7 @@ class DirectoryReader2 : public FileIO
 
     void read() override
     {
-        int count;
+        int count = 0;
         unsigned char* c = (unsigned char*)&count;
         c[0] = ReadByte();
         c[1] = ReadByte();
@@ -355,60 +860,514 @@ class DirectoryReader2 : public FileIO
         }
 
     }
-};
 
+    // Bulk frames never cross a dirent boundary, so the 6502 will see
+    // a short count and ask again for the rest.
+    void bulkRead() override
+    {
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
 
+        if (!dir_open)
+        {
+            WriteByte(P65_EBADF);
+            return;
+        }
 
-class FileRW : public FileIO
-{
-// CJ BUG all the file open stuff here is probably not needed.
-private:
-    File file;
-    bool use_buffered_io = false;
-    uint8_t mode = 0; // file mode expressed using P65_O_* / cc65 mode values.
-    
-    static constexpr int buflen = 32;
-    unsigned char buffer[buflen];   // for buffered reads or writes - but not both!
-    int read_position = 0;
-    int write_position = 0; 
+        if ((read_position == write_position) && !fill())
+        {
+            WriteBulkHeader(0);
+            return;
+        }
 
-public:
+        int n = min(count, write_position - read_position);
+        WriteBulkHeader(n);
+        if (n > 0)
+        {
+            for (int i = 1; i < n; ++i)
+                WriteBurstByte(buffer[read_position++]);
+            EndWriteBurst(buffer[read_position++]);
+        }
+    }
 
-    FileRW(File f, uint8_t _mode)
+    // As many whole entries as fit in count bytes. There's always room for
+    // at least one, so a count of 0 still means the end of the directory.
+    void listRead() override
+    {
+        constexpr int max_count = 64;
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
+
+        if (!dir_open)
+        {
+            WriteByte(P65_EBADF);
+            return;
+        }
+        if (count < MaxCompactDirent)
+        {
+            WriteByte(P65_EINVAL);
+            return;
+        }
+        count = min(count, max_count);
+
+        // An entry that doesn't fit stays in buffer for next time. One
+        // that getChar() or read() has started on is dropped.
+        unsigned char packed[max_count];
+        int n = 0;
+        for (;;)
+        {
+            bool have_entry = (read_position == 0) && (write_position == sizeof(struct dirent));
+            if (!have_entry && !fill())
+                break;
+            unsigned char entry[MaxCompactDirent];
+            int k = CompactDirent(dirent, entry);
+            if (n + k > count)
+                break;
+            memcpy(packed + n, entry, k);
+            n += k;
+            read_position = write_position;
+        }
+
+        WriteBulkHeader(n);
+        if (n > 0)
+        {
+            for (int i = 0; i < n - 1; ++i)
+                WriteBurstByte(packed[i]);
+            EndWriteBurst(packed[n - 1]);
+        }
+    }
+
+protected:
+
+    // Reads the next directory entry into buffer. Returns false at the end
+    // of the directory.
+    virtual bool fill()
+    {
+        if (File entry = dir.openNextFile())
+        {
+            FillDirent(entry, dirent);
+            write_position = sizeof(struct dirent);
+            read_position = 0;
+            entry.close();
+            return true;
+        }
+        else
+        {
+            dir.close();
+            return false;
+        }
+    }
+};
+
+
+
+/* Handler objects for the data channels, and any buffers they need, are
+ * allocated from one fixed arena rather than each channel having a slot
+ * sized for the worst case. A channel reading a file needs a lot less than
+ * one reading a directory, so more channels fit in the same RAM. Blocks are
+ * placed first-fit; there are few enough of them that a linear search is
+ * fine.
+ */
+class HandlerArena
+{
+    static constexpr int max_blocks = 2 * MAX_CHANNEL + 3;  // a handler and a buffer each, a TreeJob, a CopyJob and the directory cache
+    char* arena;
+    int arena_size;
+    struct Block
+    {
+        int start;
+        int size;   // 0 if this block isn't in use
+    } blocks[max_blocks] = {};
+
+public:
+
+    HandlerArena(char* _arena, int _arena_size)
+        : arena(_arena), arena_size(_arena_size)
+    {
+        ;
+    }
+
+    // Returns nullptr if there's no room.
+    void* allocate(int size)
+    {
+        Block* free_block = nullptr;
+        for (auto& b : blocks)
+        {
+            if (b.size == 0)
+            {
+                free_block = &b;
+                break;
+            }
+        }
+        if (!free_block || size <= 0)
+            return nullptr;
+
+        // Try the start of the arena, then the end of each block in use.
+        for (int i = -1; i < max_blocks; ++i)
+        {
+            if ((i >= 0) && (blocks[i].size == 0))
+                continue;
+            int start = (i < 0) ? 0 : blocks[i].start + blocks[i].size;
+            if (start + size > arena_size)
+                continue;
+            bool overlaps = false;
+            for (auto& b : blocks)
+            {
+                if (b.size && (start < b.start + b.size) && (b.start < start + size))
+                {
+                    overlaps = true;
+                    break;
+                }
+            }
+            if (!overlaps)
+            {
+                free_block->start = start;
+                free_block->size = size;
+                return arena + start;
+            }
+        }
+        return nullptr;
+    }
+
+    void release(void* p)
+    {
+        for (auto& b : blocks)
+        {
+            if (b.size && (arena + b.start == p))
+            {
+                b.size = 0;
+                return;
+            }
+        }
+    }
+};
+
+// Defined after the handler and job classes, which its size depends on.
+// See "RAM budget" there.
+extern HandlerArena handler_arena;
+
+// Allocates from handler_arena, taking back the directory cache's share
+// if need be. See "Directory cache" below.
+void* AllocateHandlerMemory(int size);
+
+
+
+// Sort order for sorted listings: directories first, then by name.
+int CompareDirents(const struct dirent* a, const struct dirent* b)
+{
+    if (a->d_type != b->d_type)
+        return b->d_type - a->d_type;
+    return strcmp(a->d_name, b->d_name);
+}
+
+
+
+/** Matches name against a pattern where '?' stands for any one character
+ *  and '*' for any run of them. Case doesn't matter, as on FAT.
+ */
+bool GlobMatch(const char* pattern, const char* name)
+{
+    const char* star = nullptr;   // just past the last '*' we saw
+    const char* retry = nullptr;  // where that '*' stopped matching name
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = ++pattern;
+            retry = name;
+        }
+        else if ((*pattern == '?') ||
+                 (*pattern && (toupper(*pattern) == toupper(*name))))
+        {
+            ++pattern;
+            ++name;
+        }
+        else if (star)
+        {
+            // Let the '*' take one more character and try again.
+            pattern = star;
+            name = ++retry;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        ++pattern;
+    return (*pattern == 0);
+}
+
+
+
+/* A directory listing sent in CompareDirents() order, and optionally only
+ * the names that match a pattern. The directory may well have more
+ * entries than we have RAM for, so we never hold more than a batch of
+ * them: each pass over the directory picks out the next few that come
+ * after the last one sent. That's a pass per batch instead of one in all,
+ * but the passes are on our side of the bus, and the 6502 doesn't need to
+ * keep or sort anything either.
+ *
+ * Passing in the last entry of an earlier listing picks up where it
+ * stopped, so a long listing can be read a page at a time.
+ */
+class SortedDirectoryReader : public DirectoryReader2
+{
+    static constexpr int max_batch = 8;
+    char pattern[13];               // empty to match everything
+    struct dirent* batch;           // the next entries to send, in order
+    uint8_t batch_size = 1;         // how many fit in batch
+    uint8_t batch_count = 0;        // how many it holds
+    uint8_t batch_next = 0;         // the next one to send
+    bool done = false;
+
+  public:
+
+    // after is the entry to start after, or has an empty name to start at
+    // the top.
+    SortedDirectoryReader(File _dir, const char* _pattern, const struct dirent* after)
+        : DirectoryReader2(_dir)
+    {
+        strncpy(pattern, _pattern, 12);
+        pattern[12] = 0;
+
+        // As big a batch as the arena has room for, or make do with the
+        // one entry in buffer.
+        batch = dirent;
+        for (int n = max_batch; n > 1; n /= 2)
+        {
+            if (void* p = AllocateHandlerMemory(n * sizeof(struct dirent)))
+            {
+                batch = (struct dirent*)p;
+                batch_size = n;
+                break;
+            }
+        }
+
+        // The entry to start after goes in as if it was the end of the
+        // last batch.
+        if (after->d_name[0])
+        {
+            batch[0] = *after;
+            batch_count = batch_next = 1;
+        }
+    }
+
+    ~SortedDirectoryReader() override
+    {
+        if (batch != dirent)
+            handler_arena.release(batch);
+    }
+
+  protected:
+
+    bool fill() override
+    {
+        if ((batch_next == batch_count) && !nextBatch())
+            return false;
+        memmove(buffer, &batch[batch_next++], sizeof(struct dirent));
+        write_position = sizeof(struct dirent);
+        read_position = 0;
+        return true;
+    }
+
+  private:
+
+    // Finds the batch_size entries that come next after the last one in
+    // the batch. Returns false if there aren't any more.
+    bool nextBatch()
+    {
+        if (done || !dir_open)
+            return false;
+        struct dirent last;
+        bool have_last = (batch_count > 0);
+        if (have_last)
+            last = batch[batch_count - 1];
+        batch_count = batch_next = 0;
+
+        SdBusyTimer timer;
+        dir.rewindDirectory();
+        while (File entry = dir.openNextFile())
+        {
+            struct dirent d;
+            FillDirent(entry, &d);
+            entry.close();
+            if ((pattern[0] && !GlobMatch(pattern, d.d_name)) ||
+                (have_last && (CompareDirents(&d, &last) <= 0)))
+                continue;
+
+            // Insertion sort, keeping the first batch_size.
+            int i = batch_count;
+            if (batch_count == batch_size)
+            {
+                if (CompareDirents(&d, &batch[batch_size - 1]) >= 0)
+                    continue;
+                --i;
+            }
+            else
+            {
+                ++batch_count;
+            }
+            for (; (i > 0) && (CompareDirents(&d, &batch[i - 1]) < 0); --i)
+                batch[i] = batch[i - 1];
+            batch[i] = d;
+        }
+        done = (batch_count == 0);
+        return !done;
+    }
+};
+
+
+
+// Our own handles on the card and volume, for the few things the SD
+// library's File class can't do, like rename. SD.begin() keeps its copies
+// of these private. Ours talk to the same card. The root directory is
+// opened from raw_volume when it's needed, which costs no card access.
+Sd2Card raw_card;
+SdVolume raw_volume;
+
+constexpr int SdBlockSize = 512;  // bytes in a card block
+
+
+/* Block cache for files opened for reading. It holds a piece of one SD
+ * card block, aligned to a boundary of its own size in the file. The SD
+ * library already keeps the whole block in its own 512 byte buffer, and
+ * the '328 only has 2K of RAM, so ours is just big enough to save going
+ * back to the library for every few bytes. The card read happens when the
+ * library has to load the next block, which read-ahead in idle() gets out
+ * of the way between requests. There's just the one cache, shared by all
+ * channels. Whichever FileRW filled it last owns it.
+ *
+ * Read-write files also write into the cache. Only the bytes between
+ * dirty_start and dirty_end have changed, and only those get written back
+ * through the library, when the cache is flushed or handed to another
+ * file.
+ *
+ * Whole blocks that go straight to or from the card, like those of
+ * P65_O_CONTIG files, don't fit here. They borrow the library's buffer
+ * with SdVolume::cacheClear(), for as long as it takes to move one block
+ * and no longer, since the library uses it for everything else.
+ */
+struct BlockCache
+{
+    static constexpr int size = 128;
+    unsigned char data[size];
+    File* owner = nullptr;  // file of the FileRW whose data is in the cache
+    uint32_t base = 0;      // file offset of data[0]
+    int length = 0;         // number of valid bytes in data
+    int dirty_start = 0;    // range of data that needs to be written back
+    int dirty_end = 0;
+
+    // Writes back the dirty range. Returns false if the write failed, in
+    // which case the data is lost - there's nobody left to tell.
+    bool flush()
+    {
+        if (dirty_end <= dirty_start)
+            return true;
+        SdBusyTimer timer;
+        int n = dirty_end - dirty_start;
+        bool ok = owner->seek(base + dirty_start) &&
+                  (owner->write(data + dirty_start, n) == (size_t)n);
+        dirty_start = dirty_end = 0;
+        return ok;
+    }
+};
+
+BlockCache block_cache;
+
+
+
+class FileRW : public FileIO
+{
+// CJ BUG all the file open stuff here is probably not needed.
+private:
+    File file;
+    bool use_buffered_io = false;
+    bool cached = false;  // read (and write) through block_cache. not for write-only files.
+    bool writable = false;  // opened with P65_O_WRONLY. Writes to anything else are dropped.
+    uint8_t mode = 0; // file mode expressed using P65_O_* / cc65 mode values.
+
+    static constexpr int buflen = 32;
+    unsigned char* buffer = nullptr;  // for buffered writes to write-only files
+    int write_position = 0;  // next byte in buffer
+    int write_end = 0;       // bytes in buffer. More than write_position after a seek back.
+    uint32_t position = 0;   // file position the 6502 sees, when cached
+    // Card blocks holding the file's data, if it's contiguous. Whole
+    // blocks in this range are written on the card directly, not through
+    // the SD library. 0 if it isn't.
+    uint32_t first_block = 0;
+    uint32_t end_block = 0;  // one past the last
+
+public:
+
+    FileRW(File f, uint8_t _mode, uint32_t _first_block = 0, uint32_t _end_block = 0)
     {
         file = f;
         mode = _mode;
-        // only use FileRW's buffer if the file is readonly or
-        // writeonly.
-        use_buffered_io = ((mode & P65_O_RDWR) != P65_O_RDWR);
+        first_block = _first_block;
+        end_block = _end_block;
+        // write-only files use FileRW's buffer. Anything readable goes
+        // through the block cache, and so do P65_O_CONTIG files, whose
+        // whole blocks go straight to the card.
+        // If the arena is short on room, write-only files make do without.
+        if (((mode & P65_O_RDWR) == P65_O_WRONLY) && !(mode & P65_O_CONTIG))
+            buffer = (unsigned char*)AllocateHandlerMemory(buflen);
+        use_buffered_io = (buffer != nullptr);
+        cached = (mode & (P65_O_RDONLY | P65_O_CONTIG));
+        writable = (mode & P65_O_WRONLY);
+        // Opening for writing leaves the SD file at its end, but a
+        // contiguous file is there to be written over from the start.
+        position = (mode & P65_O_CONTIG) ? 0 : file.position();
     }
 
     ~FileRW() override
     {
         flush();
         file.close();
+        handler_arena.release(buffer);
+        // The next handler may be constructed at this same address, so
+        // don't leave it looking like it owns our data.
+        if (block_cache.owner == &file)
+            block_cache.owner = nullptr;
     }
 
     int getChar() override
     {
-        if (use_buffered_io)
+        if (cached)
             return nextchar();
-        else
-            return file.read();
+        SdBusyTimer timer;
+        return file.read();
     }
 
     void putChar(char ch) override
     {
-        if (use_buffered_io)
+        // The SD library refuses writes to a file opened read-only, and so
+        // do we, rather than let them into the cache.
+        if (!writable)
+            return;
+        if (cached)
+        {
+            cachedwrchar(ch);
+        }
+        else if (use_buffered_io)
+        {
             wrchar(ch);
+        }
         else
+        {
+            SdBusyTimer timer;
             file.write(ch);
+        }
     }
 
     void seek() override
     {
-        long int offset;
-        int whence;
+        int32_t offset;
+        int whence = 0;
         unsigned char* c = (unsigned char*)&offset;
         c[0] = ReadByte();
         c[1] = ReadByte();
@@ -418,67 +1377,44 @@ public:
         c[0] = ReadByte();
         c[1] = 0;
 
-        flush(); // flush any buffered writes
+        if (cached)
+            return cachedSeek(offset, whence);
+
+        // A write-only file's position is wherever the SD file is, plus
+        // whatever is sitting in the buffer.
+        uint32_t buffer_base = file.position();
+        uint32_t end = file.size();
+        if (buffer_base + write_end > end)
+            end = buffer_base + write_end;
 
+        long int target;
         if (whence == P65_SEEK_CUR)
-        {
-            long int current = (long int)file.position();
-            if (file.seek((uint32_t)(current + offset)))
-            {
-                read_position = write_position = 0;
-                WriteByte(0);
-                long int pos = file.position();
-                char* buf = (char*)(&pos);
-                WriteByte(buf[0]);
-                WriteByte(buf[1]);
-                WriteByte(buf[2]);
-                WriteByte(buf[3]);
-            }
-            else
-            {
-                WriteByte(P65_EIO);
-            }
-        }
+            target = offset + (long int)(buffer_base + write_position);
         else if (whence == P65_SEEK_END)
+            target = offset + (long int)end;
+        else if (whence == P65_SEEK_SET)
+            target = offset;
+        else
+            return WriteByte(P65_EINVAL);
+
+        // Inside the buffer, just move the cursor. Later writes overwrite
+        // what's there, and it all goes out in one piece when it's full.
+        if (use_buffered_io && (target >= (long int)buffer_base) &&
+            (target <= (long int)(buffer_base + write_end)))
         {
-            long int end = (long int)file.size();
-            if (file.seek((uint32_t)(end + offset)))
-            {
-                read_position = write_position = 0;
-                WriteByte(0);
-                long int pos = file.position();
-                char* buf = (char*)(&pos);
-                WriteByte(buf[0]);
-                WriteByte(buf[1]);
-                WriteByte(buf[2]);
-                WriteByte(buf[3]);
-            }
-            else
-            {
-                WriteByte(P65_EIO);
-            }
+            write_position = target - buffer_base;
+            return WriteStatusAndLong(P65_EOK, target);
         }
-        else if (whence == P65_SEEK_SET)
+
+        flush();
+        if (file.seek((uint32_t)target))
         {
-            if (file.seek((uint32_t)offset))
-            {
-                read_position = write_position = 0;
-                WriteByte(0);
-                long int pos = file.position();
-                char* buf = (char*)(&pos);
-                WriteByte(buf[0]);
-                WriteByte(buf[1]);
-                WriteByte(buf[2]);
-                WriteByte(buf[3]);
-            }
-            else
-            {
-                WriteByte(P65_EIO);
-            }
+            position = file.position();
+            WriteStatusAndLong(P65_EOK, file.position());
         }
         else
         {
-            WriteByte(P65_EINVAL);
+            WriteByte(P65_EIO);
         }
     }
 
@@ -486,12 +1422,12 @@ public:
 
     void read() override
     {
-        int count;
+        int count = 0;
         unsigned char* c = (unsigned char*)&count;
         c[0] = ReadByte();
         c[1] = ReadByte();
 
-        if (use_buffered_io)
+        if (cached)
         {
             for (int i = 0; i < count; ++i)
             {
@@ -514,24 +1450,137 @@ public:
         }
     }
 
+
+
+    void bulkRead() override
+    {
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
+
+        if (!cached)
+        {
+            WriteByte(P65_EBADF);
+            return;
+        }
+
+        // We have to commit to an exact count before sending any data, so
+        // work out how much is left between the current position and EOF.
+        uint32_t remaining = size() - position;
+        int n = (remaining < (uint32_t)count) ? (int)remaining : count;
+
+        WriteBulkHeader(n);
+        if (n == 0)
+            return;
+        for (int i = 1; i < n; ++i)
+            WriteBurstByte(nextchar());
+        EndWriteBurst(nextchar());
+    }
+
+    // Packs straight out of the block cache, a cache full at a time, so
+    // runs stop at the cache's boundaries.
+    void packedRead() override
+    {
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
+
+        if (!cached)
+        {
+            WriteByte(P65_EBADF);
+            return;
+        }
+
+        uint32_t remaining = size() - position;
+        int n = (remaining < (uint32_t)count) ? (int)remaining : count;
+
+        WriteBulkHeader(n);
+        while (n > 0)
+        {
+            if (((block_cache.owner != &file) ||
+                 (position - block_cache.base >= (uint32_t)block_cache.length)) &&
+                !fillCache(position))
+            {
+                // We've promised n bytes, so send something, like
+                // bulkRead() does.
+                block_cache.owner = nullptr;
+                block_cache.base = position;
+                block_cache.length = BlockCache::size;
+                memset(block_cache.data, 0xff, BlockCache::size);
+            }
+            int offset = position - block_cache.base;
+            int k = min(n, block_cache.length - offset);
+            n -= k;
+            position += k;
+            WritePacked(block_cache.data + offset, k, n == 0);
+        }
+    }
+
     void flush() override
     {
-        if ((mode & P65_O_RDWR) == P65_O_WRONLY)
+        if (use_buffered_io)
+        {
+            SdBusyTimer timer;
+            file.write (buffer, write_end);
+            // A seek back into the buffer leaves the cursor short of the end.
+            if (write_position != write_end)
+                file.seek(file.position() - (write_end - write_position));
+            write_position = write_end = 0;
+        }
+        else if (block_cache.owner == &file)
         {
-            file.write (buffer, write_position);
-            write_position = 0;
+            block_cache.flush();
         }
     }
 
     void write() override
     {
-        int count;
+        int count = 0;
         unsigned char* c = (unsigned char*)&count;
         c[0] = ReadByte();
         c[1] = ReadByte();
 
         int written_count = 0;
-        if (use_buffered_io)
+        if (!writable)
+        {
+            // Nothing gets written, like putChar().
+            for (int i = 0; i < count; ++i)
+                ReadByte();
+        }
+        else if (cached)
+        {
+            // read-write files write into the block cache. Whole blocks of
+            // a P65_O_CONTIG file can skip it.
+            int i = 0;
+            if (mode & P65_O_CONTIG)
+            {
+                // Up to a block boundary the usual way, then whole blocks.
+                for (; (i < count) && (position & (SdBlockSize - 1)); ++i)
+                {
+                    char ch = ReadByte();
+                    written_count += cachedwrchar(ch);
+                }
+                int streamed = 0;
+                int taken = streamWrite(count - i, streamed);
+                i += taken;
+                written_count += streamed;
+                if (streamed < taken)
+                {
+                    // The card failed partway. Don't write anything after
+                    // the gap.
+                    for (; i < count; ++i)
+                        ReadByte();
+                }
+            }
+            for (; i < count; ++i)
+            {
+                char ch = ReadByte();
+                written_count += cachedwrchar(ch);
+            }
+        }
+        else if (use_buffered_io)
         {
             // write-only files use buffered write
             for (int i = 0; i < count; ++i)
@@ -542,43 +1591,307 @@ public:
         }
         else
         {
-            // read-write files don't use buffer
             for (int i = 0; i < count; ++i)
             {
                 char ch = ReadByte();
                 written_count += file.write (ch);
             }
         }
-        WriteByte (((unsigned char*)&written_count)[0]);
-        WriteByte (((unsigned char*)&written_count)[1]);
+        WriteCount (written_count);
     }
 
-private:
-
-    // buffered char read. Only use for read-only files.
-    inline int nextchar()
+    // Prefetch what comes next once the 6502 has used up what's in the
+    // cache, so that it's ready before the next read command arrives. At
+    // the end of a block, that's when the library reads the next one off
+    // the card. For read-write files this also writes back the finished
+    // piece, even if there's nothing after it to read, so that the write
+    // happens now and not on the next cache miss.
+    // We don't take the cache away from another channel to do it.
+    // A contiguous file is being written over, so there's no point reading
+    // what comes after; just write the finished piece.
+    void idle() override
     {
-        if (read_position >= write_position)
+        if (!cached)
+            return;
+        if (mode & P65_O_CONTIG)
         {
-            read_position = 0;
-            write_position = file.read(buffer, buflen);
-            if (write_position == 0)
-                return -1;
+            if ((block_cache.owner == &file) && (block_cache.length == BlockCache::size) &&
+                (position == block_cache.base + BlockCache::size))
+                block_cache.flush();
+            return;
         }
-
-        return buffer[read_position++];
-    }
-
-    // buffered char write - only for writeonly files
+        if (block_cache.owner == nullptr)
+        {
+            if (position < file.size())
+                fillCache(position);
+        }
+        else if ((block_cache.owner == &file) &&
+                 (block_cache.length == BlockCache::size) &&
+                 (position == block_cache.base + BlockCache::size))
+        {
+            if (position < size())
+                fillCache(position);
+            else
+                block_cache.flush();
+        }
+    }
+
+    FileRW* asFile() override
+    {
+        return this;
+    }
+
+    // Moves up to count bytes from this file to dst, each from its own
+    // position, for CMD_SPLICE. A block at a time comes into the block
+    // cache from here and goes out to dst through the SD library, so the
+    // two files never fight over the cache. Stops early at the end of this
+    // file; moved is how many bytes got to dst.
+    char spliceTo(FileRW& dst, uint32_t count, uint32_t& moved)
+    {
+        moved = 0;
+        if (!cached || !dst.writable)
+            return P65_EBADF;
+
+        // Anything of dst's in its buffer or the cache has to be on the
+        // card before the library writes after it.
+        dst.flush();
+        while (moved < count)
+        {
+            if (((block_cache.owner != &file) ||
+                 (position - block_cache.base >= (uint32_t)block_cache.length)) &&
+                !fillCache(position))
+                break;
+            uint32_t offset = position - block_cache.base;
+            uint32_t n = min(count - moved, (uint32_t)block_cache.length - offset);
+            if (!dst.writeThrough(block_cache.data + offset, n))
+                return P65_EIO;
+            position += n;
+            moved += n;
+        }
+        return P65_EOK;
+    }
+
+private:
+
+    // Writes n bytes at the file position the 6502 sees, straight through
+    // the SD library, leaving the block cache alone. The cache mustn't be
+    // holding anything of ours that's newer - see spliceTo().
+    bool writeThrough(const unsigned char* data, uint32_t n)
+    {
+        SdBusyTimer timer;
+        if (cached)
+        {
+            if (mode & P65_O_APPEND)
+                position = size();
+            if ((file.position() != position) && !file.seek(position))
+                return false;
+        }
+        uint32_t written = file.write(data, n);
+        if (cached)
+            position += written;
+        return written == n;
+    }
+
+    // Size of the file including anything still waiting in the cache.
+    uint32_t size()
+    {
+        uint32_t s = file.size();
+        if ((block_cache.owner == &file) && (block_cache.base + block_cache.length > s))
+            s = block_cache.base + block_cache.length;
+        return s;
+    }
+
+    // cached char read. Only use for readable files.
+    inline int nextchar()
+    {
+        // unsigned math, so an offset below base also counts as a miss.
+        if ((block_cache.owner != &file) ||
+            (position - block_cache.base >= (uint32_t)block_cache.length))
+        {
+            if (!fillCache(position))
+                return -1;
+        }
+
+        return block_cache.data[position++ - block_cache.base];
+    }
+
+    // cached char write - only for read-write files. We can write at
+    // the end of the valid data in the block but not past it, which would
+    // leave a hole.
+    inline int cachedwrchar(char ch)
+    {
+        if (mode & P65_O_APPEND)
+            position = size();
+
+        uint32_t i = position - block_cache.base;
+        if ((block_cache.owner != &file) || (i >= BlockCache::size) ||
+            (i > (uint32_t)block_cache.length))
+        {
+            // Coming back empty is fine if we're at the end of the file.
+            // A contiguous file written from the start of a piece doesn't
+            // need the old contents read in. The library merges in what
+            // we've got when it's flushed.
+            if ((mode & P65_O_CONTIG) && !(position & (BlockCache::size - 1)))
+                claimCache(position);
+            else
+                fillCache(position);
+            i = position - block_cache.base;
+            if (i > (uint32_t)block_cache.length)
+                return 0;
+        }
+
+        block_cache.data[i] = ch;
+        if (i == (uint32_t)block_cache.length)
+            ++block_cache.length;
+        if (block_cache.dirty_end == 0)
+            block_cache.dirty_start = i;
+        else if ((int)i < block_cache.dirty_start)
+            block_cache.dirty_start = i;
+        if ((int)i >= block_cache.dirty_end)
+            block_cache.dirty_end = i + 1;
+        ++position;
+        return 1;
+    }
+
+    // Loads the piece of the file containing offset into the cache,
+    // writing back whatever was there before. Returns false if offset is
+    // at or past the end of the file, or the read failed.
+    bool fillCache(uint32_t offset)
+    {
+        uint32_t base = offset & ~(uint32_t)(BlockCache::size - 1);
+        claimCache(base);
+
+        SdBusyTimer timer;
+        if ((file.position() != base) && !file.seek(base))
+            return false;
+        int n = file.read(block_cache.data, BlockCache::size);
+        if (n > 0)
+            block_cache.length = n;
+        return (offset - base) < (uint32_t)block_cache.length;
+    }
+
+    // The cache stays valid across the seek, and the SD file is only
+    // repositioned when a read or write actually needs another block. So a
+    // seek that lands inside the cached block costs nothing more than
+    // moving position, plus writing back whatever has changed in it, so
+    // that anything reading the file by name, like stat or cp, sees the
+    // same data we do.
+    void cachedSeek(int32_t offset, int whence)
+    {
+        long int target;
+        if (whence == P65_SEEK_CUR)
+            target = offset + (long int)position;
+        else if (whence == P65_SEEK_END)
+            target = offset + (long int)size();
+        else if (whence == P65_SEEK_SET)
+            target = offset;
+        else
+            return WriteByte(P65_EINVAL);
+
+        // Same limits file.seek() has.
+        if ((target < 0) || ((uint32_t)target > size()))
+            return WriteByte(P65_EIO);
+
+        if ((block_cache.owner == &file) && (block_cache.dirty_end > block_cache.dirty_start))
+        {
+            if (!block_cache.flush())
+                return WriteByte(P65_EIO);
+            SdBusyTimer timer;
+            file.flush();  // and the size in its directory entry
+        }
+        position = target;
+        WriteStatusAndLong(P65_EOK, position);
+    }
+
+    // Sends whole blocks of a P65_O_CONTIG file from the bus to the card
+    // with one multi-block write, as long as position is at the start of a
+    // block and there are whole blocks to send. Each block is staged in the
+    // library's buffer, which nothing else touches until we're done.
+    // Returns the number of bytes taken from the bus; written is how many
+    // of them made it to the card.
+    int streamWrite(int count, int& written)
+    {
+        uint32_t block = cardBlock(position);
+        uint32_t blocks = count / SdBlockSize;
+        uint32_t s = file.size();
+        if (!block || (position & (SdBlockSize - 1)) || (position >= s))
+            return 0;
+        // Stay inside the contiguous range and the file, since this won't
+        // change the file's size.
+        blocks = min(blocks, end_block - block);
+        blocks = min(blocks, (s - position) / SdBlockSize);
+        if (blocks == 0)
+            return 0;
+
+        // Nothing in the cache may be written back over these blocks
+        // later.
+        if (block_cache.owner)
+            block_cache.flush();
+        block_cache.owner = nullptr;
+        uint8_t* data = SdVolume::cacheClear();
+        bool ok;
+        {
+            SdBusyTimer timer;
+            ok = raw_card.writeStart(block, blocks);
+        }
+        int taken = 0;
+        for (uint32_t b = 0; b < blocks; ++b)
+        {
+            for (int j = 0; j < SdBlockSize; ++j)
+                data[j] = ReadByte();
+            taken += SdBlockSize;
+            if (ok)
+            {
+                SdBusyTimer timer;
+                ok = raw_card.writeData(data);
+                if (ok)
+                    written = taken;
+            }
+        }
+        if (ok)
+        {
+            SdBusyTimer timer;
+            ok = raw_card.writeStop();
+            if (!ok)
+                written = 0;
+        }
+        position += written;
+        return taken;
+    }
+
+    // Makes the cache ours, empty, for the piece starting at base, writing
+    // back whatever was there before.
+    void claimCache(uint32_t base)
+    {
+        if (block_cache.owner)
+            block_cache.flush();
+        block_cache.owner = &file;
+        block_cache.base = base;
+        block_cache.length = 0;
+    }
+
+    // The card block holding offset, if we know where that is. Else 0.
+    uint32_t cardBlock(uint32_t offset)
+    {
+        if (!first_block)
+            return 0;
+        uint32_t block = first_block + offset / SdBlockSize;
+        return (block < end_block) ? block : 0;
+    }
+
+    // buffered char write - only for writeonly files
     inline int wrchar(char ch)
     {
         buffer[write_position++] = ch;
+        if (write_position > write_end)
+            write_end = write_position;
         if (write_position == buflen)
         {
             // Is there a realistic concern here of write not writing the
             // full amount? If so, what do we do? Return 0?
-            file.write(buffer, write_position);
-            write_position = 0;
+            SdBusyTimer timer;
+            file.write(buffer, write_end);
+            write_position = write_end = 0;
         }
         return 1;
     }
@@ -588,6 +1901,377 @@ private:
 
 
 
+/* A search of a file, or of every file in a directory, for the lines that
+ * contain a pattern, for CMD_GREP. '?' in the pattern stands for any one
+ * byte and '*' for any run of them within the line. The 6502 reads
+ * GrepMatch records off the channel like file data: only the line number
+ * and offset of each matching line, so it just has to read the lines it
+ * wants to show. When it's a directory being searched, the first match
+ * in each file comes after a record with line 0, followed by the file's
+ * name, offset bytes long.
+ *
+ * The file comes in a cache full at a time through the block cache, like
+ * a FileRW's. The search runs as the 6502 reads, and in idle() until the
+ * next match turns up.
+ */
+struct __attribute__((packed)) GrepMatch
+{
+    uint32_t line;    // from 1. 0 for a record naming the next file.
+    uint32_t offset;  // where the line starts. For a file record, the length of the name.
+};
+
+constexpr uint8_t GREP_ICASE = 1;  // CMD_GREP flags
+
+class GrepReader : public FileIO
+{
+public:
+    static constexpr int max_pattern = 24;
+
+    // pattern has to pass ValidPattern().
+    GrepReader(File f, const char* _pattern, uint8_t _flags)
+        : flags(_flags)
+    {
+        int i = 0;
+        for (; _pattern[i]; ++i)
+            pattern[i] = fold(_pattern[i]);
+        pattern[i] = 0;
+        if (f.isDirectory())
+        {
+            dir = f;
+            dir.rewindDirectory();
+            searching_dir = true;
+            done = !nextFile();
+        }
+        else
+        {
+            file = f;
+        }
+        startLine();
+    }
+
+    ~GrepReader() override
+    {
+        if (block_cache.owner == &file)
+            block_cache.owner = nullptr;
+        file.close();
+        dir.close();
+    }
+
+    // Something to look for, and not so much that we can't keep track.
+    static bool ValidPattern(const char* p)
+    {
+        if (strlen(p) > max_pattern)
+            return false;
+        for (; *p; ++p)
+            if (*p != '*')
+                return true;
+        return false;
+    }
+
+    int getChar() override
+    {
+        if ((read_position == write_position) && !fill())
+            return -1;
+        return buffer[read_position++];
+    }
+
+    void read() override
+    {
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
+
+        for (int i = 0; i < count; ++i)
+        {
+            int ch = getChar();
+            WriteEscapedChar(ch);
+            if (ch == -1)
+                break;
+        }
+    }
+
+    void bulkRead() override
+    {
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
+
+        if ((read_position == write_position) && !fill())
+        {
+            WriteBulkHeader(0);
+            return;
+        }
+
+        int n = min(count, write_position - read_position);
+        WriteBulkHeader(n);
+        if (n > 0)
+        {
+            for (int i = 1; i < n; ++i)
+                WriteBurstByte(buffer[read_position++]);
+            EndWriteBurst(buffer[read_position++]);
+        }
+    }
+
+    // A block at a time, so we're never long in answering the 6502. Like
+    // FileRW::idle(), we don't take the cache away from another channel to
+    // do it; grep.c reads the matching lines from the file while we search.
+    void idle() override
+    {
+        if (block_cache.owner && (block_cache.owner != &file))
+            return;
+        scan(BlockCache::size);
+    }
+
+private:
+    File dir;   // open if searching a directory
+    File file;  // the file being searched
+    char pattern[max_pattern + 1];
+    uint8_t flags;
+    bool searching_dir = false;
+    bool named = false;    // sent the record naming file
+    bool matched = false;  // this line matches, so skip the rest of it
+    bool done = false;     // no more to search
+
+    uint32_t position = 0;  // of the next byte of file
+    uint32_t line = 1;
+    uint32_t line_start = 0;
+
+    // We look for the pieces of pattern between '*'s in turn. The last
+    // max_pattern bytes of the line are in history, so we can check the
+    // latest few against segment.
+    const char* segment;
+    uint8_t segment_len;
+    uint8_t seen;  // bytes since the last segment matched, up to max_pattern
+    uint8_t history_pos = 0;
+    char history[max_pattern];
+
+    unsigned char buffer[2 * sizeof(GrepMatch) + 12];  // records to send
+    int read_position = 0;
+    int write_position = 0;
+
+    char fold(char ch)
+    {
+        return (flags & GREP_ICASE) ? toupper(ch) : ch;
+    }
+
+    bool fill()
+    {
+        while (!scan(BlockCache::size) && !done)
+            ;
+        return (read_position < write_position);
+    }
+
+    // Searches up to budget more bytes, stopping early if there's a record
+    // to send. Returns true if there is one.
+    bool scan(int budget)
+    {
+        while ((read_position == write_position) && !done && (budget-- > 0))
+        {
+            int ch = nextByte();
+            if (ch < 0)
+            {
+                done = !searching_dir || !nextFile();
+                startLine();
+            }
+            else if (ch == '\n')
+            {
+                ++line;
+                startLine();
+            }
+            else if (!matched)
+            {
+                history[history_pos] = fold(ch);
+                if (++history_pos == max_pattern)
+                    history_pos = 0;
+                if (seen < max_pattern)
+                    ++seen;
+                if ((seen >= segment_len) && segmentMatches())
+                {
+                    segment += segment_len;
+                    nextSegment();
+                    if (segment_len == 0)
+                        addMatch();
+                }
+            }
+        }
+        return (read_position < write_position);
+    }
+
+    void startLine()
+    {
+        line_start = position;
+        matched = false;
+        segment = pattern;
+        nextSegment();
+    }
+
+    // Skips segment past any '*'s and works out how long it is. It's 0
+    // once the whole pattern has matched.
+    void nextSegment()
+    {
+        while (*segment == '*')
+            ++segment;
+        segment_len = 0;
+        while (segment[segment_len] && (segment[segment_len] != '*'))
+            ++segment_len;
+        seen = 0;
+    }
+
+    bool segmentMatches()
+    {
+        int h = history_pos - segment_len;
+        if (h < 0)
+            h += max_pattern;
+        for (int i = 0; i < segment_len; ++i)
+        {
+            if ((segment[i] != '?') && (segment[i] != history[h]))
+                return false;
+            if (++h == max_pattern)
+                h = 0;
+        }
+        return true;
+    }
+
+    void addMatch()
+    {
+        matched = true;
+        read_position = write_position = 0;
+        if (searching_dir && !named)
+        {
+            const char* name = file.name();
+            int n = min(strlen(name), (size_t)12);
+            addRecord(0, n);
+            memcpy(buffer + write_position, name, n);
+            write_position += n;
+            named = true;
+        }
+        addRecord(line, line_start);
+    }
+
+    void addRecord(uint32_t _line, uint32_t offset)
+    {
+        GrepMatch m = {_line, offset};
+        memcpy(buffer + write_position, &m, sizeof(m));
+        write_position += sizeof(m);
+    }
+
+    // The byte at position, or -1 at the end of the file.
+    int nextByte()
+    {
+        uint32_t i = position - block_cache.base;
+        if ((block_cache.owner != &file) || (i >= (uint32_t)block_cache.length))
+        {
+            if (!fillCache())
+                return -1;
+            i = position - block_cache.base;
+        }
+        ++position;
+        return (unsigned char)block_cache.data[i];
+    }
+
+    bool fillCache()
+    {
+        if (block_cache.owner)
+            block_cache.flush();
+        block_cache.owner = &file;
+        block_cache.base = position & ~(uint32_t)(BlockCache::size - 1);
+        block_cache.length = 0;
+
+        SdBusyTimer timer;
+        if ((file.position() != block_cache.base) && !file.seek(block_cache.base))
+            return false;
+        int n = file.read(block_cache.data, BlockCache::size);
+        if (n > 0)
+            block_cache.length = n;
+        return (position - block_cache.base) < (uint32_t)block_cache.length;
+    }
+
+    // Moves on to the next regular file in the directory. Returns false
+    // when there are no more.
+    bool nextFile()
+    {
+        // The next file's in the same place, so the cache mustn't look
+        // like it's still ours.
+        if (block_cache.owner == &file)
+            block_cache.owner = nullptr;
+        file.close();
+        for (;;)
+        {
+            File f = dir.openNextFile();
+            if (!f)
+                return false;
+            if (!f.isDirectory())
+            {
+                file = f;
+                break;
+            }
+            f.close();
+        }
+        position = 0;
+        line = 1;
+        named = false;
+        return true;
+    }
+};
+
+
+
+/* Declarations used by HandleStat. These match cc65's layout and go over
+ * the bus as they are, so they're packed with fixed-size fields - the AVR
+ * doesn't pad anyway, but a PC build would.
+ */
+struct __attribute__((packed)) timespec
+{
+    uint32_t tv_sec;
+    int32_t tv_nsec;
+};
+struct __attribute__((packed)) stat
+{
+    uint32_t st_dev;
+    uint32_t st_ino;
+    unsigned char st_mode;
+    uint32_t st_nlink;
+    unsigned char st_uid;
+    unsigned char st_gid;
+    int32_t st_size;
+    struct timespec st_atim;
+    struct timespec st_ctim;
+    struct timespec st_mtim;
+};
+
+
+// The command handlers are defined further down. The Arduino IDE would
+// generate these prototypes for us, but other compilers won't.
+char HandleFileOpen(char* command_buffer);
+char HandleFileClose(char* command_buffer);
+void HandleStat(char* command_buffer);
+char HandleDeleteFile(char* command_buffer);
+char HandleDeleteDirectory(char* command_buffer);
+char HandleMkdir(char* command_buffer);
+char HandleCopyFile(char* command_buffer);
+char HandleRename(char* command_buffer);
+char HandleRemoveTree(char* command_buffer);
+char HandleCopyTree(char* command_buffer);
+void HandleTreeJobStatus();
+char OpenFile(int channel, uint8_t mode, char* filename);
+char OpenSortedDirectory(int channel, char* dirname, const char* pattern, const struct dirent* after);
+char OpenSearch(int channel, char* path, const char* pattern, uint8_t flags);
+char Splice(int src, int dst, uint32_t count, uint32_t* moved);
+char CloseFile(int channel);
+char DeleteFile(char* filename);
+char DeleteDirectory(char* filename);
+char MakeDirectory(char* filename);
+char CopyFile(char* src_filename, char* dst_filename);
+char Rename(char* src_filename, char* dst_filename);
+char RemoveTree(char* path);
+char CopyTree(char* src, char* dst);
+void GetTreeJobStatus(char* buffer);
+
+
+
+
 class CommandHandler : public FileIO
 {
 private:
@@ -598,12 +2282,16 @@ private:
 
     int read_position = 0;
     int write_position = 0;
-    char buffer[30];
+
+    char buffer[1 + sizeof(struct stat)];  // big enough for a stat reply
 
 public:
 
     CommandHandler() = default;
 
+    // Reads and replies to a binary command frame. See binary_commands.
+    void binaryCommand();
+
     void SetCommandResponse(const char* output, int len)
     {
         memcpy(buffer, output, len);
@@ -677,6 +2365,22 @@ public:
             {
                 SetCommandResponse(HandleCopyFile(command_buffer));
             }
+            else if (!strcmp(command_buffer, "mv"))
+            {
+                SetCommandResponse(HandleRename(command_buffer));
+            }
+            else if (!strcmp(command_buffer, "rmtree"))
+            {
+                SetCommandResponse(HandleRemoveTree(command_buffer));
+            }
+            else if (!strcmp(command_buffer, "cptree"))
+            {
+                SetCommandResponse(HandleCopyTree(command_buffer));
+            }
+            else if (!strcmp(command_buffer, "treejob"))
+            {
+                HandleTreeJobStatus();
+            }
             else if (!strcmp(command_buffer, "stat"))
             {
                 HandleStat(command_buffer);
@@ -704,7 +2408,7 @@ public:
 
     void read() override
     {
-        int count;
+        int count = 0;
         unsigned char* c = (unsigned char*)&count;
         c[0] = ReadByte();
         c[1] = ReadByte();
@@ -718,12 +2422,29 @@ public:
         }
     }
 
+    void bulkRead() override
+    {
+        int count = 0;
+        unsigned char* c = (unsigned char*)&count;
+        c[0] = ReadByte();
+        c[1] = ReadByte();
+
+        int n = min(count, write_position - read_position);
+        WriteBulkHeader(n);
+        if (n > 0)
+        {
+            for (int i = 1; i < n; ++i)
+                WriteBurstByte(nextChar());
+            EndWriteBurst(nextChar());
+        }
+    }
+
     void write() override
     {
         // CJ BUG. It would be nice if this stopped processing
         // when we reached the end of a command, and return the
         // actual # of bytes processed.
-        int count;
+        int count = 0;
         unsigned char* c = (unsigned char*)&count;
         c[0] = ReadByte();
         c[1] = ReadByte();
@@ -734,13 +2455,13 @@ public:
             putChar(ch);
         }
 
-        WriteByte (((unsigned char*)&count)[0]);
-        WriteByte (((unsigned char*)&count)[1]);
+        WriteCount (count);
     }
 };
 
 
-constexpr int FileIOSize = max (sizeof(FileIO), max (sizeof(FileRW), sizeof(DirectoryReader2)));
+constexpr int FileIOSize = max (max (sizeof(FileIO), sizeof(FileRW)),
+                                max (sizeof(DirectoryReader2), sizeof(SortedDirectoryReader)));
 
 
 
@@ -751,8 +2472,28 @@ CommandHandler command_handler;
 // channel IO handlers. Channel 0 handler is permanent. Data channels
 // will have handlers emplaced & removed when files are opened and
 // closed.
-FileIO* channel_io[MAX_CHANNEL + 1] = {&command_handler, nullptr, nullptr};
-char ChannelHandlerBuffer[2][FileIOSize];
+FileIO* channel_io[MAX_CHANNEL + 1] = {&command_handler};
+
+// Where the directory entry of what's open on each data channel is, so
+// Rename() can tell it's about to move something in use. block is 0 for
+// a closed channel and for the root, which has no entry.
+struct EntryRef
+{
+    uint32_t block = 0;
+    uint8_t index = 0;
+};
+EntryRef channel_entry[MAX_CHANNEL - MIN_CHANNEL + 1];
+
+// True if the entry for f is open on a data channel.
+bool EntryOpen(const SdFile& f)
+{
+    for (auto& e : channel_entry)
+    {
+        if (e.block && (e.block == f.dirBlock()) && (e.index == f.dirIndex()))
+            return true;
+    }
+    return false;
+}
 
 void SetCommandResponse(const char* output, int len)
 {
@@ -770,32 +2511,37 @@ void *operator new(size_t size, char* c) {
   return c;
 }
 
-template<class T, typename... Args>
-void SetChannel(int channel, Args&&... args)
+void ClearChannel(int channel)
 {
-    // Am I safe without std::forward on args? I think it just amounts to a wierd static cast
-    if ((channel >= MIN_CHANNEL) && (channel <= MAX_CHANNEL))
+    if ((channel >= MIN_CHANNEL) && (channel <= MAX_CHANNEL) && channel_io[channel])
     {
-        // destruct previous channel object
-        if (channel_io[channel])
-        {
-            channel_io[channel]->~FileIO();
-        }
-        // and create new one
-        channel_io[channel] = new((char*)ChannelHandlerBuffer[channel-1]) T(args...);
+        channel_io[channel]->~FileIO();
+        handler_arena.release(channel_io[channel]);
+        channel_io[channel] = nullptr;
+        channel_entry[channel - MIN_CHANNEL] = EntryRef();
     }
 } 
 
-void ClearChannel(int channel)
+// Returns false if there's no room in the arena for the new handler.
+template<class T, typename... Args>
+bool SetChannel(int channel, Args&&... args)
 {
-    if ((channel >= MIN_CHANNEL) && (channel <= MAX_CHANNEL) && channel_io[channel])
+    // Am I safe without std::forward on args? I think it just amounts to a wierd static cast
+    if ((channel >= MIN_CHANNEL) && (channel <= MAX_CHANNEL))
     {
-        channel_io[channel]->~FileIO();
-        channel_io[channel] = nullptr;
+        // destruct previous channel object
+        ClearChannel(channel);
+        // and create new one
+        char* p = (char*)AllocateHandlerMemory(sizeof(T));
+        if (!p)
+            return false;
+        channel_io[channel] = new(p) T(args...);
+        return true;
     }
+    return false;
 } 
 
-class FileIO* GetIOHandler (char channel)
+class FileIO* GetIOHandler (int channel)
 {
     if ((channel < 0) || (channel > MAX_CHANNEL) || (channel_io[channel] == nullptr))
         return &default_io;
@@ -805,6 +2551,395 @@ class FileIO* GetIOHandler (char channel)
 
 
 
+/* Directory cache. The SD library finds a file by reading every directory
+ * on its path, starting from the root, and the old open, stat and delete
+ * commands did that twice - once for SD.exists() and again for SD.open().
+ * FindDirectory() keeps the directories it opens here, so a lookup only
+ * reads the ones it hasn't seen lately. Each entry is found by its name
+ * and its parent's entry, never by a hash of the path, so a hit is always
+ * the right directory.
+ *
+ * There isn't RAM to set aside for this, so the entries live in whatever
+ * room the handler arena has left over. Handlers and buffers come first:
+ * AllocateHandlerMemory() gives the cache's room back to them when they
+ * need it, and the next lookup starts a new, possibly smaller, cache.
+ * Removing or moving a directory clears the cache, so it never holds one
+ * that's gone. Creating anything in a directory can give it another
+ * cluster, which an older copy of it wouldn't look in, so whatever does
+ * that puts its copy in the cache with DirCacheRefresh().
+ */
+struct DirCacheEntry
+{
+    SdFile dir;
+    char name[13];          // empty if the entry isn't in use
+    int8_t parent;          // entry of the directory it's in. -1 for the root.
+    uint8_t last_used;      // dir_cache_clock when it was last looked up
+};
+
+constexpr int DirCacheSize = 4;
+DirCacheEntry* dir_cache = nullptr;
+int8_t dir_cache_size = 0;
+// Ticks once per FindDirectory(), so everything on the path it's walking
+// has the same last_used, and none of it gets evicted to make room for
+// the rest.
+uint8_t dir_cache_clock = 0;
+
+
+void DirCacheRelease()
+{
+    if (!dir_cache)
+        return;
+    for (int i = 0; i < dir_cache_size; ++i)
+        dir_cache[i].~DirCacheEntry();
+    handler_arena.release(dir_cache);
+    dir_cache = nullptr;
+    dir_cache_size = 0;
+}
+
+
+// Forgets every directory, for when one may have been removed or moved.
+void DirCacheClear()
+{
+    for (int i = 0; i < dir_cache_size; ++i)
+        dir_cache[i].name[0] = 0;
+}
+
+
+// Replaces the cached copy of dir, if there is one, with dir, which has
+// just had something created in it.
+void DirCacheRefresh(const SdFile& dir)
+{
+    for (int i = 0; i < dir_cache_size; ++i)
+    {
+        DirCacheEntry& e = dir_cache[i];
+        if (e.name[0] && (e.dir.firstCluster() == dir.firstCluster()))
+            e.dir = dir;
+    }
+}
+
+
+void* AllocateHandlerMemory(int size)
+{
+    void* p = handler_arena.allocate(size);
+    if (!p && dir_cache)
+    {
+        DirCacheRelease();
+        p = handler_arena.allocate(size);
+    }
+    return p;
+}
+
+
+// Makes a cache as big as the arena has room for, if there isn't one.
+void DirCacheAllocate()
+{
+    for (int n = DirCacheSize; !dir_cache && (n > 0); n /= 2)
+    {
+        if (char* p = (char*)handler_arena.allocate(n * sizeof(DirCacheEntry)))
+        {
+            dir_cache = (DirCacheEntry*)p;
+            dir_cache_size = n;
+            for (int i = 0; i < n; ++i)
+            {
+                new((char*)&dir_cache[i]) DirCacheEntry;
+                dir_cache[i].name[0] = 0;
+            }
+        }
+    }
+}
+
+
+// Returns the entry for directory name in the directory at entry parent,
+// or -1 if it isn't cached.
+int8_t DirCacheFind(int8_t parent, const char* name)
+{
+    for (int8_t i = 0; i < dir_cache_size; ++i)
+    {
+        DirCacheEntry& e = dir_cache[i];
+        if (e.name[0] && (e.parent == parent) && !strcasecmp(e.name, name))
+        {
+            e.last_used = dir_cache_clock;
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+// Adds directory dir, called name, in the directory at entry parent.
+// Evicts the least recently used entry, and everything cached under it,
+// unless they're all on the path being looked up. Returns the new entry,
+// or -1 if it wasn't added.
+int8_t DirCacheAdd(int8_t parent, const char* name, const SdFile& dir)
+{
+    int8_t victim = -1;
+    uint8_t oldest = 0;
+    for (int8_t i = 0; i < dir_cache_size; ++i)
+    {
+        DirCacheEntry& e = dir_cache[i];
+        uint8_t age = dir_cache_clock - e.last_used;
+        if (!e.name[0])
+        {
+            victim = i;
+            break;
+        }
+        if (age > oldest)
+        {
+            victim = i;
+            oldest = age;
+        }
+    }
+    if (victim < 0)
+        return -1;
+
+    // Anything under the victim would have a dangling parent.
+    dir_cache[victim].name[0] = 0;
+    for (bool changed = true; changed; )
+    {
+        changed = false;
+        for (int8_t i = 0; i < dir_cache_size; ++i)
+        {
+            DirCacheEntry& e = dir_cache[i];
+            if (e.name[0] && (e.parent >= 0) && !dir_cache[e.parent].name[0])
+            {
+                e.name[0] = 0;
+                changed = true;
+            }
+        }
+    }
+
+    DirCacheEntry& e = dir_cache[victim];
+    e.dir = dir;
+    strcpy(e.name, name);
+    e.parent = parent;
+    e.last_used = dir_cache_clock;
+    return victim;
+}
+
+
+/* Opens the directory made up of the first len characters of path, which
+ * is taken to start at the root. Returns false if it isn't a directory.
+ */
+bool FindDirectory(const char* path, int len, SdFile& dir)
+{
+    DirCacheAllocate();
+    ++dir_cache_clock;
+
+    const char* end = path + len;
+    int8_t entry = -1;      // dir's entry, or -1 for the root
+    bool cached = true;     // false once we're past what the cache can hold
+    dir.close();
+    if (!dir.openRoot(&raw_volume))
+        return false;
+
+    for (;;)
+    {
+        while ((path < end) && (*path == '/'))
+            ++path;
+        if (path == end)
+            return true;
+        const char* slash = path;
+        while ((slash < end) && (*slash != '/'))
+            ++slash;
+        int n = slash - path;
+        if (n > 12)
+            return false;
+        char name[13];
+        memcpy(name, path, n);
+        name[n] = 0;
+        path = slash;
+
+        int8_t found = cached ? DirCacheFind(entry, name) : -1;
+        if (found >= 0)
+        {
+            dir = dir_cache[found].dir;
+            entry = found;
+            continue;
+        }
+        SdFile next;
+        if (!next.open(&dir, name, O_READ) || !next.isDir())
+            return false;
+        dir = next;
+        if (cached)
+        {
+            entry = DirCacheAdd(entry, name, dir);
+            cached = (entry >= 0);
+        }
+    }
+}
+
+
+
+/** Opens the directory that contains path, which is taken to start at the
+ *  root. On success, name points to the last component of path.
+ */
+bool OpenParentDir(const char* path, SdFile& parent, const char*& name)
+{
+    const char* slash = strrchr(path, '/');
+    name = slash ? slash + 1 : path;
+    return (*name != 0) && FindDirectory(path, name - path, parent);
+}
+
+
+
+/** Like SD.exists(), but finds path's directory with FindDirectory(). */
+bool PathExists(const char* path)
+{
+    SdFile dir, f;
+    const char* name;
+    if (!OpenParentDir(path, dir, name) || !f.open(&dir, name, O_READ))
+        return false;
+    f.close();
+    return true;
+}
+
+
+
+/** Finds the card blocks holding f's data, if they're all one contiguous
+ *  run. end_block is one past the last. Returns false, with both 0, if
+ *  the data is in pieces or there isn't any.
+ */
+bool ContiguousRange(SdFile& f, uint32_t& first_block, uint32_t& end_block)
+{
+    uint32_t last;
+    if (!f.contiguousRange(&first_block, &last))
+    {
+        first_block = end_block = 0;
+        return false;
+    }
+    end_block = last + 1;
+    return true;
+}
+
+
+
+/** Opens path like SD.open(), but finds its directory with
+ *  FindDirectory(). If entry isn't null, it gets where path's directory
+ *  entry is. If first_block isn't null, it and end_block get the file's
+ *  block range, as from ContiguousRange(), from the entry we just opened.
+ *  Returns P65_EOK or an error code.
+ */
+char OpenPath(const char* path, uint8_t mode, File& file, EntryRef* entry = nullptr,
+              uint32_t* first_block = nullptr, uint32_t* end_block = nullptr)
+{
+    SdFile dir, f;
+    const char* name;
+
+    if (*path == 0)
+        return P65_EINVAL;
+    if (!OpenParentDir(path, dir, name))
+    {
+        // "/" has no last component, but it's the one path we don't need
+        // to look up.
+        bool is_root = true;
+        for (const char* p = path; *p; ++p)
+            is_root = is_root && (*p == '/');
+        if (!is_root)
+            return P65_ENOENT;
+        file = SD.open("/");
+        return file ? P65_EOK : P65_EIO;
+    }
+    if (!f.open(&dir, name, mode))
+    {
+        if (!f.open(&dir, name, O_READ))
+            return (mode & O_CREAT) ? P65_EIO : P65_ENOENT;
+        bool is_dir = f.isDir();
+        f.close();
+        return is_dir ? P65_EISDIR : (mode & O_EXCL) ? P65_EEXIST : P65_EIO;
+    }
+    if (mode & O_CREAT)
+        DirCacheRefresh(dir);
+    // Like SD.open(), files opened for writing start at the end.
+    if (mode & (O_APPEND | O_WRITE))
+        f.seekSet(f.fileSize());
+    if (entry)
+    {
+        entry->block = f.dirBlock();
+        entry->index = f.dirIndex();
+    }
+    if (first_block && !f.isDir())
+        ContiguousRange(f, *first_block, *end_block);
+    file = File(f, name);
+    return file ? P65_EOK : P65_ENOMEM;
+}
+
+
+
+/* The working directory. Paths in binary commands that don't start with a
+ * slash are relative to it; see MakeFullPath(). It's always a full path,
+ * with no "." or "..", and the cache usually has it.
+ */
+constexpr int MaxCwd = 32;
+char cwd[MaxCwd] = "/";
+
+
+/** Turns the path at p, which has room for size bytes, into a full path
+ *  from the root: one that doesn't start with a slash gets the working
+ *  directory put in front, and then ".", ".." and repeated slashes are
+ *  taken out. An empty path stays empty. Returns false if there isn't
+ *  room.
+ */
+bool MakeFullPath(char* p, int size)
+{
+    int len = strlen(p);
+    if (len == 0)
+        return true;
+    if (p[0] != '/')
+    {
+        int cwd_len = strlen(cwd);
+        if (cwd_len + 1 + len + 1 > size)
+            return false;
+        memmove(p + cwd_len + 1, p, len + 1);
+        memcpy(p, cwd, cwd_len);
+        p[cwd_len] = '/';
+    }
+
+    // Nothing we write is longer than what we've read, so this works in
+    // place.
+    const char* r = p;
+    char* w = p;
+    while (*r)
+    {
+        while (*r == '/')
+            ++r;
+        const char* name = r;
+        while (*r && (*r != '/'))
+            ++r;
+        int n = r - name;
+        if ((n == 0) || ((n == 1) && (name[0] == '.')))
+            continue;
+        if ((n == 2) && (name[0] == '.') && (name[1] == '.'))
+        {
+            while ((w > p) && (*--w != '/'))
+                ;
+            continue;
+        }
+        *w++ = '/';
+        memmove(w, name, n);
+        w += n;
+    }
+    if (w == p)
+        *w++ = '/';
+    *w = 0;
+    return true;
+}
+
+
+/** Makes path, which has to be a full path, the working directory. */
+char ChangeDirectory(char* path)
+{
+    SdFile dir;
+    if (*path == 0)
+        return P65_EINVAL;
+    if (strlen(path) >= MaxCwd)
+        return P65_ERANGE;
+    if (!FindDirectory(path, strlen(path), dir))
+        return PathExists(path) ? P65_ENOTDIR : P65_ENOENT;
+    strcpy(cwd, path);
+    return P65_EOK;
+}
+
+
 
 void setup()
 {
@@ -818,7 +2953,11 @@ void setup()
     pinMode(data7, INPUT);
     pinMode(ca1, OUTPUT);
     pinMode(ca2, INPUT);
-    //attachInterrupt(digitalPinToInterrupt(ca2) /*0*/, InterruptHandler, RISING);
+    attachInterrupt(digitalPinToInterrupt(ca2), HandshakeInterrupt, CHANGE);
+    StartStatsTimer();
+#if P65_STATS
+    stats.totals.start_ms = millis();
+#endif
 
 
     pinMode(13, OUTPUT);
@@ -833,6 +2972,10 @@ void setup()
     pinMode(10, OUTPUT);
     if (!SD.begin(10))
         ErrorFlash();
+    // SD.begin() starts the card at half speed. The SPI settings are shared,
+    // so this speeds up the library's own transfers as well as ours.
+    if (!raw_card.init(SPI_FULL_SPEED, 10) || !raw_volume.init(&raw_card))
+        ErrorFlash();
 
     //Serial.begin (9600);
 }
@@ -860,331 +3003,1704 @@ uint8_t TranslateMode(uint8_t in)
     return mode;
 }
 
-/* Declarations used by HandleStat */
-struct timespec
+/** Fills in s for filename. Returns P65_EOK or an error code. */
+char Stat(char* filename, struct stat* s)
 {
-    uint32_t tv_sec;
-    long tv_nsec;
-};
-struct stat
+    File f;
+    char result = OpenPath(filename, O_RDONLY, f);
+    if (result != P65_EOK)
+        return result;
+
+    s->st_dev = 0;  // this probably should be filled in on 6502 side
+    s->st_ino = 0;  // yeah, we don't really have inodes.
+    s->st_mode = (f.isDirectory() ? 2 : 1);
+    s->st_nlink = 1;  // I guess?
+    s->st_uid = 0;
+    s->st_gid = 0;
+    s->st_size = f.size();
+    s->st_atim = s->st_ctim = s->st_mtim = {};
+
+    f.close();
+    return P65_EOK;
+}
+
+
+
+void HandleStat(char* command_buffer)
 {
-    uint32_t st_dev;
-    uint32_t st_ino;
-    unsigned char st_mode;
-    uint32_t st_nlink;
-    unsigned char st_uid;
-    unsigned char st_gid;
-    int32_t st_size;
-    struct timespec st_atim;
-    struct timespec st_ctim;
-    struct timespec st_mtim;
-};
+    char buffer[1 + sizeof(struct stat)];
+    buffer[0] = Stat(command_buffer + 5, (struct stat*)(buffer + 1));
+    if (buffer[0] != P65_EOK)
+        return SetCommandResponse(buffer[0]);
+    return SetCommandResponse(buffer, 1 + sizeof(struct stat));
+}
+
+
+
+/** Parse a file open command and create file reader/writer.
+ *  On success, the return value is the file type. On failure, an error code.
+ */
+char HandleFileOpen(char* command_buffer)
+{
+    if (strlen(command_buffer) < 4)
+    {
+        return P65_EINVAL;
+    }
+
+    int channel = command_buffer[1] - 48;  // convert ascii to int
+    return OpenFile(channel, command_buffer[2], command_buffer + 3);
+}
+
+
+
+/** Opens filename on channel, creating a file reader/writer.
+ *  On success, the return value is the file type. On failure, an error code.
+ */
+char OpenFile(int channel, uint8_t mode, char* filename)
+{
+    if (channel < MIN_CHANNEL || channel > MAX_CHANNEL)
+    {
+        return P65_EINVAL;
+    }
+
+    uint8_t sd_mode = TranslateMode(mode);
+
+    ClearChannel(channel);
+
+    // Contiguous files are made by CMD_FALLOCATE, and written over as they
+    // are - not truncated or appended to.
+    uint32_t first_block = 0, end_block = 0;
+    EntryRef entry;
+    if (mode & P65_O_CONTIG)
+    {
+        if (!(mode & P65_O_WRONLY) || (mode & (P65_O_TRUNC | P65_O_APPEND)))
+            return P65_EINVAL;
+        sd_mode |= O_READ;  // to fill the cache for writes that don't start a block
+    }
+
+    if (mode & P65_O_WRONLY) // includes read/write
+    {
+        // Opening a directory for writing fails with P65_EISDIR.
+        File f;
+        char result = (mode & P65_O_CONTIG) ?
+            OpenPath(filename, sd_mode, f, &entry, &first_block, &end_block) :
+            OpenPath(filename, sd_mode, f, &entry);
+        if (result != P65_EOK)
+            return result;
+        if ((mode & P65_O_CONTIG) && !first_block)
+        {
+            f.close();
+            return P65_EINVAL;
+        }
+        if (SetChannel<FileRW>(channel, f, mode, first_block, end_block))
+        {
+            channel_entry[channel - MIN_CHANNEL] = entry;
+            return 1;  // return filetype for regular file
+        }
+        f.close();
+        return P65_ENOMEM;
+    }
+    else if (mode & P65_O_RDONLY)
+    {
+        // A read-only file is read straight off the card if it's in one
+        // piece, which most files are.
+        File f;
+        char result = OpenPath(filename, O_RDONLY, f, &entry, &first_block, &end_block);
+        if (result != P65_EOK)
+            return result;
+        char type = 0;
+        if (f.isDirectory())
+        {
+            if (SetChannel<DirectoryReader2>(channel, f))
+                type = 2;  // return filetype directory
+        }
+        else
+        {
+            if (SetChannel<FileRW>(channel, f, mode, first_block, end_block))
+                type = 1;  // return filetype regular file
+        }
+        if (type)
+        {
+            channel_entry[channel - MIN_CHANNEL] = entry;
+            return type;
+        }
+        f.close();
+        return P65_ENOMEM;
+    }
+
+    // fallthrough error
+    return P65_EINVAL;
+}
+
+
+
+/** Opens dirname on channel for a sorted listing; see
+ *  SortedDirectoryReader. On success, the return value is the file type,
+ *  which is always directory.
+ */
+char OpenSortedDirectory(int channel, char* dirname, const char* pattern, const struct dirent* after)
+{
+    if (channel < MIN_CHANNEL || channel > MAX_CHANNEL)
+        return P65_EINVAL;
+    ClearChannel(channel);
+    File f;
+    EntryRef entry;
+    char result = OpenPath(dirname, O_RDONLY, f, &entry);
+    if (result != P65_EOK)
+        return result;
+    if (!f.isDirectory())
+    {
+        f.close();
+        return P65_ENOTDIR;
+    }
+    if (SetChannel<SortedDirectoryReader>(channel, f, pattern, after))
+    {
+        channel_entry[channel - MIN_CHANNEL] = entry;
+        return 2;  // return filetype directory
+    }
+    f.close();
+    return P65_ENOMEM;
+}
+
+
+
+/** Starts a search of path, a file or a directory, on channel. See
+ *  GrepReader.
+ */
+char OpenSearch(int channel, char* path, const char* pattern, uint8_t flags)
+{
+    if (channel < MIN_CHANNEL || channel > MAX_CHANNEL)
+        return P65_EINVAL;
+    if (!GrepReader::ValidPattern(pattern))
+        return P65_EINVAL;
+    ClearChannel(channel);
+    File f;
+    EntryRef entry;
+    char result = OpenPath(path, O_RDONLY, f, &entry);
+    if (result != P65_EOK)
+        return result;
+    if (SetChannel<GrepReader>(channel, f, pattern, flags))
+    {
+        channel_entry[channel - MIN_CHANNEL] = entry;
+        return P65_EOK;
+    }
+    f.close();
+    return P65_ENOMEM;
+}
+
+
+
+char HandleDeleteFile(char* command_buffer)
+{
+    return DeleteFile(command_buffer + 3);
+}
+
+
+
+char DeleteFile(char* filename)
+{
+    SdFile dir, f;
+    const char* name;
+
+    if (*filename == 0)
+        return P65_EINVAL;
+    if (!OpenParentDir(filename, dir, name) || !f.open(&dir, name, O_READ))
+        return P65_ENOENT;
+    bool is_dir = f.isDir();
+    f.close();
+    if (is_dir)
+        return P65_EISDIR;
+    if (SdFile::remove(&dir, name))
+        return P65_EOK;
+    else
+        return P65_EIO;
+}
+
+
+
+char HandleDeleteDirectory(char* command_buffer)
+{
+    return DeleteDirectory(command_buffer + 6);
+}
+
+
+
+char DeleteDirectory(char* filename)
+{
+    SdFile parent, dir;
+    const char* name;
+    dir_t entry;
+
+    if (*filename == 0)
+        return P65_EINVAL;
+    if (!OpenParentDir(filename, parent, name) || !dir.open(&parent, name, O_READ))
+        return P65_ENOENT;
+    if (!dir.isDir())
+    {
+        dir.close();
+        return P65_ENOTDIR;
+    }
+    if (dir.readDir(&entry) != 0)
+    {
+        dir.close();
+        return P65_EEXIST;
+    }
+    DirCacheClear();
+    if (dir.rmDir())
+        return P65_EOK;
+    else
+        return P65_EIO;
+}
+
+
+
+char HandleMkdir(char* command_buffer)
+{
+    return MakeDirectory(command_buffer + 6);
+}
+
+
+
+// Makes the one directory path, if its parent is there. Returns
+// P65_EEXIST if it's already a directory, and P65_ENOTDIR if it's a file.
+char MakeOneDirectory(const char* path)
+{
+    SdFile dir, f;
+    const char* name;
+
+    if (!OpenParentDir(path, dir, name))
+        return P65_ENOENT;
+    if (f.open(&dir, name, O_READ))
+    {
+        bool is_dir = f.isDir();
+        f.close();
+        return is_dir ? P65_EEXIST : P65_ENOTDIR;
+    }
+    if (!f.makeDir(&dir, name))
+        return P65_EIO;
+    f.close();
+    DirCacheRefresh(dir);
+    return P65_EOK;
+}
+
+
+
+/** Makes directory filename, and like SD.mkdir(), any directories above it
+ *  that aren't there yet.
+ */
+char MakeDirectory(char* filename)
+{
+    uint8_t result = P65_EEXIST;  // for "/"
+
+    if (*filename == 0)
+        return P65_EINVAL;
+    // Each directory on the path in turn, with the rest cut off.
+    for (char* p = filename; ; ++p)
+    {
+        if (*p && (*p != '/'))
+            continue;
+        if ((p > filename) && (p[-1] != '/'))
+        {
+            char c = *p;
+            *p = 0;
+            result = MakeOneDirectory(filename);
+            *p = c;
+            if ((result != P65_EOK) && (result != P65_EEXIST) && *p)
+                return result;
+        }
+        if (*p == 0)
+            return (result == P65_ENOTDIR) ? P65_EEXIST : result;
+    }
+}
+
+
+
+char HandleCopyFile(char* command_buffer)
+{
+    char* src_filename = command_buffer + 3;
+    char* dst_filename = src_filename + strlen(src_filename) + 1;
+
+    if ((src_filename[0] == '\0') || (dst_filename[0] == '\0'))
+        return P65_EINVAL;
+    return CopyFile(src_filename, dst_filename);
+}
+
+
+
+/* Copies one regular file, a block at a time. CopyFile() runs a copy
+ * straight through, for "cp". CMD_COPY starts one in the background
+ * instead: it runs a block at a time from RunIdleTasks(), so the 6502 can
+ * carry on, poll its progress with CMD_COPYJOB and stop it with
+ * CMD_COPYCANCEL. cptree jobs copy each file the same way.
+ *
+ * The destination is created as one contiguous run of blocks when the
+ * card has room for that, and then each block is written straight to the
+ * card from the SD library's own buffer, borrowed with cacheClear(). It's
+ * read into that buffer straight off the card too if the source happens
+ * to be contiguous, or else by the library, which leaves it there as it
+ * goes. Nothing else gets a chance to use the buffer in between.
+ *
+ * Without a contiguous destination the library has to write the block
+ * itself, and its buffer can't hold both files' blocks, so the copy goes
+ * a block_cache.data at a time instead. That's several steps and card
+ * reads per block, but only when the card is too fragmented for the
+ * usual way.
+ */
+class CopyJob
+{
+public:
+    uint32_t done = 0;   // bytes copied so far
+    uint32_t total = 0;  // size of the source
+
+    CopyJob() = default;
+    ~CopyJob()
+    {
+        src.close();
+        dst.close();
+    }
+
+    // Opens src and creates dst in place of any file already there.
+    // Returns P65_EOK or an error code.
+    char start(char* src_filename, char* dst_filename)
+    {
+        SdFile f;
+        const char* name;
+        uint32_t last;
+
+        // SD library doesn't give me any exact way to tell if two files
+        // are the same thing, but we'll try to canonicalize as much as
+        // possible. Copying a file over itself would delete it.
+        const char* a = src_filename;
+        const char* b = dst_filename;
+        while (*a == '/')
+            ++a;
+        while (*b == '/')
+            ++b;
+        if (0 == strcasecmp(a, b))
+            return P65_EINVAL;
+        char result = OpenPath(src_filename, O_READ, src, nullptr, &src_block, &src_end);
+        if (result != P65_EOK)
+            return result;
+        if (src.isDirectory())
+            return P65_EISDIR;
+        total = src.size();
+        if (src_block &&
+            (src_end - src_block < (total + SdBlockSize - 1) / SdBlockSize))
+            src_block = src_end = 0;  // shouldn't happen, but don't read past it
+
+        if (!OpenParentDir(dst_filename, dst_dir, name))
+            return P65_ENOENT;
+        strncpy(dst_name, name, sizeof(dst_name) - 1);
+        dst_name[sizeof(dst_name) - 1] = 0;
+        if (f.open(&dst_dir, dst_name, O_READ))
+        {
+            bool is_dir = f.isDir();
+            f.close();
+            if (is_dir)
+                return P65_EISDIR;
+            if (!SdFile::remove(&dst_dir, dst_name))
+                return P65_EIO;
+        }
+        if ((total > 0) && f.createContiguous(&dst_dir, dst_name, total))
+        {
+            if (f.contiguousRange(&dst_block, &last))
+                dst_end = last + 1;
+            else
+                dst_block = 0;
+        }
+        else if (!f.open(&dst_dir, dst_name, O_WRITE | O_CREAT | O_TRUNC))
+        {
+            return P65_EIO;
+        }
+        DirCacheRefresh(dst_dir);
+        dst = File(f, dst_name);
+        if (!dst)
+        {
+            remove();
+            return P65_ENOMEM;
+        }
+        return P65_EOK;
+    }
+
+    // Copies the next block. Returns P65_EAGAIN while there's more to do,
+    // and P65_EOK or an error once the copy is finished. A failed copy
+    // leaves no destination behind.
+    uint8_t step()
+    {
+        if (done >= total)
+        {
+            src.close();
+            dst.close();
+            return P65_EOK;
+        }
+
+        // The cache's owner can fill it again when it next needs it.
+        if (block_cache.owner)
+            block_cache.flush();
+        block_cache.owner = nullptr;
+
+        uint32_t block = done / SdBlockSize;
+        int n;
+        bool ok;
+        SdBusyTimer timer;
+        if (dst_block + block < dst_end)
+        {
+            // A whole block, or what's left, through the library's buffer.
+            // Reading may load a FAT block into it first, but the data
+            // comes last, and then the library mustn't think the buffer
+            // still holds whatever it loaded.
+            n = min(total - done, (uint32_t)SdBlockSize);
+            uint8_t* data = SdVolume::cacheClear();
+            if (src_block + block < src_end)
+                ok = raw_card.readBlock(src_block + block, data);
+            else
+                ok = (src.read(data, n) == n);
+            SdVolume::cacheClear();
+            ok = ok && raw_card.writeBlock(dst_block + block, data);
+        }
+        else
+        {
+            n = min(total - done, (uint32_t)BlockCache::size);
+            ok = (src.read(block_cache.data, n) == n) &&
+                 (dst.write(block_cache.data, n) == (size_t)n);
+        }
+        if (!ok)
+        {
+            cancel();
+            return P65_EIO;
+        }
+        done += n;
+        return P65_EAGAIN;
+    }
+
+    // Stops the copy and removes what there is of the destination.
+    void cancel()
+    {
+        src.close();
+        remove();
+    }
+
+private:
+    File src, dst;
+    SdFile dst_dir;
+    char dst_name[13];
+    // Card blocks of src and dst, if they're contiguous. Else 0.
+    uint32_t src_block = 0, src_end = 0;
+    uint32_t dst_block = 0, dst_end = 0;
+
+    void remove()
+    {
+        dst.close();
+        SdFile::remove(&dst_dir, dst_name);
+    }
+};
+
+
+
+/** Copies one regular file. Used by HandleCopyFile. The job goes in the
+ *  handler arena, since on the stack it would be the deepest path there
+ *  is (see HandlerArenaSize).
+ */
+char CopyFile(char* src_filename, char* dst_filename)
+{
+    char* p = (char*)AllocateHandlerMemory(sizeof(CopyJob));
+    if (!p)
+        return P65_ENOMEM;
+    CopyJob* job = new(p) CopyJob;
+    uint8_t status = job->start(src_filename, dst_filename);
+    if (status == P65_EOK)
+    {
+        while ((status = job->step()) == P65_EAGAIN)
+            ;
+    }
+    job->~CopyJob();
+    handler_arena.release(job);
+    return status;
+}
+
+
+
+CopyJob* copy_job = nullptr;
+uint8_t copy_job_status = P65_EOK;  // result of the last copy, or P65_EAGAIN
+uint32_t copy_job_done = 0;
+uint32_t copy_job_total = 0;
+
+
+
+void EndCopyJob()
+{
+    copy_job->~CopyJob();
+    handler_arena.release(copy_job);
+    copy_job = nullptr;
+}
+
+
+
+/** Starts copying src to dst in the background. Like cptree jobs, only
+ *  one runs at a time.
+ */
+char StartCopyJob(char* src_filename, char* dst_filename)
+{
+    if (copy_job)
+        return P65_EBUSY;
+    char* p = (char*)AllocateHandlerMemory(sizeof(CopyJob));
+    if (!p)
+        return P65_ENOMEM;
+    copy_job = new(p) CopyJob;
+    char result = copy_job->start(src_filename, dst_filename);
+    copy_job_done = 0;
+    copy_job_total = copy_job->total;
+    if (result != P65_EOK)
+    {
+        EndCopyJob();
+        return result;
+    }
+    copy_job_status = P65_EAGAIN;
+    return P65_EOK;
+}
+
+
+
+// Returns true if there's still work for the job to do.
+bool RunCopyJob()
+{
+    if (!copy_job)
+        return false;
+    copy_job_status = copy_job->step();
+    copy_job_done = copy_job->done;
+    if (copy_job_status != P65_EAGAIN)
+        EndCopyJob();
+    return (copy_job != nullptr);
+}
+
+
+
+char CancelCopyJob()
+{
+    if (!copy_job)
+        return P65_EINVAL;
+    copy_job->cancel();
+    EndCopyJob();
+    copy_job_status = P65_EINTR;
+    return P65_EOK;
+}
+
+
+
+// Fills buffer with the job status (P65_EAGAIN while it's still running)
+// and 4-byte counts of the bytes done and the bytes in all.
+void GetCopyJobStatus(char* buffer)
+{
+    buffer[0] = copy_job_status;
+    memcpy(buffer + 1, &copy_job_done, sizeof(copy_job_done));
+    memcpy(buffer + 5, &copy_job_total, sizeof(copy_job_total));
+}
+
+
+
+/* Recursive copy and delete run in the background from RunIdleTasks(), a
+ * directory entry or a block of a file at a time. The 6502 starts one
+ * with "rmtree" or "cptree" and then polls "treejob" until it's done,
+ * instead of walking the tree itself over the bus. Only one job runs at a
+ * time. Its state lives in the handler arena only while it runs.
+ *
+ * The directory being walked stays open in the job, so each step carries
+ * on from where the last one left off. Its path is only looked up again
+ * when the job comes back up out of a subdirectory. Files are copied by a
+ * CopyJob of the job's own, stepped like a CMD_COPY one.
+ */
+class TreeJob
+{
+public:
+    static constexpr int pathlen = 64;
+    static constexpr int max_depth = 8;
+
+    uint16_t count = 0;  // entries copied or removed so far
+
+    // src and dst have been through CanonicalizeTreePath(). dst is
+    // ignored unless copying.
+    TreeJob(bool _copying, const char* _src, const char* _dst)
+        : copying(_copying)
+    {
+        strcpy(src, _src);
+        strcpy(dst, copying ? _dst : "");
+        positions[0] = 0;
+    }
+
+    ~TreeJob()
+    {
+        if (copy)
+        {
+            copy->cancel();
+            endCopy();
+        }
+    }
+
+    // Does the next bit of work. Returns P65_EAGAIN while there's more to
+    // do, and P65_EOK or an error once the job is finished.
+    uint8_t step()
+    {
+        if (copy)
+            return copyStep();
+        if (!dir.isOpen() && !openDir())
+            return P65_EIO;
+
+        dir_t entry;
+        int8_t n;
+        {
+            SdBusyTimer timer;
+            n = dir.readDir(&entry);
+        }
+        if (n < 0)
+            return P65_EIO;
+        if (n == 0)
+            return copying ? leaveDir() : removeDir();
+        char name[13];
+        SdFile::dirName(entry, name);
+        if (!PushPath(src, name) || (copying && !PushPath(dst, name)))
+            return P65_ERANGE;
+        if (DIR_IS_SUBDIR(&entry))
+            return enterDir(name);
+        return copying ? startCopy() : removeFile(name);
+    }
+
+private:
+    bool copying;
+    int8_t depth = 0;
+    char src[pathlen];
+    char dst[pathlen];
+    uint16_t positions[max_depth];  // entry we were at in each dir above this one
+    SdFile dir;                     // the one at src, if it's open
+    CopyJob* copy = nullptr;        // the file being copied, if there is one
+
+    // Opens the directory at src again, after coming back up to it, at
+    // the entry after the one we went down into.
+    bool openDir()
+    {
+        if (!FindDirectory(src, strlen(src), dir))
+            return false;
+        if (copying && !dir.seekSet((uint32_t)positions[depth] * sizeof(dir_t)))
+            return false;
+        return true;
+    }
+
+    // src (and dst) have the name of subdirectory name of dir on the end.
+    uint8_t enterDir(const char* name)
+    {
+        if (depth + 1 >= max_depth)
+            return P65_ERANGE;
+        if (copying)
+        {
+            uint8_t result = MakeDirectory(dst);
+            if ((result != P65_EOK) && (result != P65_EEXIST))
+                return result;
+            ++count;
+        }
+        // FAT directories stop at 65536 entries, so this fits.
+        positions[depth] = dir.curPosition() / sizeof(dir_t);
+        SdFile parent = dir;
+        dir.close();
+        SdBusyTimer timer;
+        if (!dir.open(&parent, name, O_READ))
+            return P65_EIO;
+        ++depth;
+        return P65_EAGAIN;
+    }
+
+    // Done with every entry of dir.
+    uint8_t leaveDir()
+    {
+        dir.close();
+        if (depth == 0)
+            return P65_EOK;
+        PopPath(src);
+        PopPath(dst);
+        --depth;
+        return P65_EAGAIN;
+    }
+
+    // Since we delete everything we find, dir is empty when we get to the
+    // end of it.
+    uint8_t removeDir()
+    {
+        DirCacheClear();
+        SdBusyTimer timer;
+        if (!dir.rmDir())
+            return P65_EIO;
+        ++count;
+        if (depth == 0)
+            return P65_EOK;
+        PopPath(src);
+        --depth;
+        return P65_EAGAIN;
+    }
+
+    uint8_t removeFile(const char* name)
+    {
+        PopPath(src);
+        SdBusyTimer timer;
+        if (!SdFile::remove(&dir, name))
+            return P65_EIO;
+        ++count;
+        return P65_EAGAIN;
+    }
+
+    // Sets up copy for the file at src, to dst. Its blocks get copied by
+    // the steps after this one.
+    uint8_t startCopy()
+    {
+        uint8_t result = P65_ENOMEM;
+        if (char* p = (char*)AllocateHandlerMemory(sizeof(CopyJob)))
+        {
+            copy = new(p) CopyJob;
+            result = copy->start(src, dst);
+            if (result != P65_EOK)
+                endCopy();
+        }
+        PopPath(src);
+        PopPath(dst);
+        return (result == P65_EOK) ? P65_EAGAIN : result;
+    }
+
+    uint8_t copyStep()
+    {
+        uint8_t result = copy->step();
+        if (result == P65_EAGAIN)
+            return result;
+        endCopy();
+        if (result != P65_EOK)
+            return result;
+        ++count;
+        return P65_EAGAIN;
+    }
+
+    void endCopy()
+    {
+        copy->~CopyJob();
+        handler_arena.release(copy);
+        copy = nullptr;
+    }
+
+    // Appends "/name" to path. Returns false if it won't fit.
+    static bool PushPath(char* path, const char* name)
+    {
+        int n = strlen(path);
+        if (n + 1 + strlen(name) >= pathlen)
+            return false;
+        path[n] = '/';
+        strcpy(path + n + 1, name);
+        return true;
+    }
+
+    static void PopPath(char* path)
+    {
+        if (char* slash = strrchr(path, '/'))
+            *slash = 0;
+    }
+};
+
+/* RAM budget. The '328 has 2048 bytes. Counted by hand for avr-gcc (2-byte
+ * ints and pointers; vtables and string constants are copied to RAM too):
+ *
+ *   SD library: its block buffer, the SD object, vtables       ~620
+ *   block_cache                                                 140
+ *   handler arena: a TreeJob and a CopyJob, plus handler_arena  339
+ *   command_handler                                             149
+ *   our vtables and string constants                           ~240
+ *   raw_card, raw_volume, rx FIFO, cwd and the other globals    162
+ *   Arduino core                                                ~20
+ *
+ * That's about 1670 bytes, leaving 378 for the heap and the stack. Every
+ * open File keeps a 31-byte SdFile on the heap. The most there can be at
+ * once is six: one per channel, the two of a copy running in the
+ * background, and one for the command being run, 186 bytes in all. The
+ * deepest stack, a path being looked up under a command, with the bus
+ * interrupt on top, is about 180 bytes. The job of a cp would add another
+ * 120 there, so it goes in the arena like the others.
+ *
+ * Nothing here can grow unless something else shrinks. The arena is only
+ * big enough for every channel's handler, or for a tree job and the file
+ * it's copying. Write buffers, sorted listing batches, grep, copy and tree
+ * jobs and the directory cache use its room while channels are closed;
+ * otherwise they do without or fail with P65_ENOMEM.
+ */
+constexpr int HandlerArenaSize = max ((MAX_CHANNEL - MIN_CHANNEL + 1) * FileIOSize,
+                                     (int)(sizeof(TreeJob) + sizeof(CopyJob)));
+char HandlerArenaBuffer[HandlerArenaSize];
+HandlerArena handler_arena(HandlerArenaBuffer, HandlerArenaSize);
+
+TreeJob* tree_job = nullptr;
+uint8_t tree_job_status = P65_EOK;  // result of the last job, or P65_EAGAIN
+uint16_t tree_job_count = 0;
+
+#if defined(RAMEND) && defined(RAMSTART)
+// The budget above. Every global of ours and the SD library's is counted
+// by the compiler; the rest are the estimates from there.
+constexpr int SdLibraryOtherRam = 11 + 20;  // SdVolume's cache state and dateTime_, File's vtable
+constexpr int VtableAndStringRam = 240;
+constexpr int CoreRam = 20;
+constexpr int HeapReserve = (MAX_CHANNEL - MIN_CHANNEL + 4) * (sizeof(SdFile) + 2);
+constexpr int StackReserve = 180;
+static_assert(sizeof(cache_t) + sizeof(SD) + SdLibraryOtherRam +
+              sizeof(raw_card) + sizeof(raw_volume) + sizeof(block_cache) +
+              sizeof(HandlerArenaBuffer) + sizeof(handler_arena) +
+              sizeof(default_io) + sizeof(command_handler) + sizeof(channel_io) +
+              sizeof(channel_entry) + sizeof(dir_cache) + sizeof(dir_cache_size) +
+              sizeof(dir_cache_clock) + sizeof(cwd) +
+              sizeof(rx_fifo) + sizeof(rx_head) + sizeof(rx_tail) + sizeof(rx_armed) +
+              sizeof(rx_acked) + sizeof(rx_state) + sizeof(rx_count) + sizeof(bus_bytes) +
+              sizeof(copy_job) + sizeof(copy_job_status) + sizeof(copy_job_done) +
+              sizeof(copy_job_total) + sizeof(tree_job) + sizeof(tree_job_status) +
+              sizeof(tree_job_count) +
+#if P65_STATS
+              sizeof(stats) + sizeof(timer1_overflows) +
+#endif
+              VtableAndStringRam + CoreRam + HeapReserve + StackReserve <= RAMEND + 1 - RAMSTART,
+              "out of RAM for the stack");
+#endif
+
+
+
+// Strips leading and trailing slashes, and makes sure what's left is a
+// directory and short enough for a TreeJob.
+char CanonicalizeTreePath(char*& path, bool must_exist)
+{
+    while (*path == '/')
+        ++path;
+    int n = strlen(path);
+    while ((n > 0) && (path[n-1] == '/'))
+        path[--n] = 0;
+    if (n == 0)
+        return P65_EINVAL;  // not going to rm -r the whole card
+    if (n >= TreeJob::pathlen - 13)
+        return P65_ERANGE;
+    SdFile dir;
+    if (FindDirectory(path, n, dir))
+        return P65_EOK;
+    if (PathExists(path))
+        return P65_ENOTDIR;
+    return must_exist ? P65_ENOENT : P65_EOK;
+}
+
+
+
+char StartTreeJob(bool copying, const char* src, const char* dst)
+{
+    if (tree_job)
+        return P65_EBUSY;
+    char* p = (char*)AllocateHandlerMemory(sizeof(TreeJob));
+    if (!p)
+        return P65_ENOMEM;
+    tree_job = new(p) TreeJob(copying, src, dst);
+    tree_job_status = P65_EAGAIN;
+    tree_job_count = 0;
+    return P65_EOK;
+}
+
+
+
+// Returns true if there's still work for the job to do.
+bool RunTreeJob()
+{
+    if (!tree_job)
+        return false;
+    tree_job_status = tree_job->step();
+    tree_job_count = tree_job->count;
+    if (tree_job_status != P65_EAGAIN)
+    {
+        tree_job->~TreeJob();
+        handler_arena.release(tree_job);
+        tree_job = nullptr;
+    }
+    return (tree_job != nullptr);
+}
+
+
+
+/** "rmtree\0path" removes a directory and everything in it. */
+char HandleRemoveTree(char* command_buffer)
+{
+    return RemoveTree(command_buffer + 7);
+}
+
+
+
+char RemoveTree(char* path)
+{
+    char result = CanonicalizeTreePath(path, true);
+    if (result != P65_EOK)
+        return result;
+    return StartTreeJob(false, path, nullptr);
+}
+
+
+
+/** "cptree\0src\0dst" copies directory src and everything in it to dst.
+ *  If dst is already a directory, the contents of src are merged into it.
+ */
+char HandleCopyTree(char* command_buffer)
+{
+    char* src = command_buffer + 7;
+    return CopyTree(src, src + strlen(src) + 1);
+}
+
+
+
+char CopyTree(char* src, char* dst)
+{
+    char result = CanonicalizeTreePath(src, true);
+    if (result != P65_EOK)
+        return result;
+    result = CanonicalizeTreePath(dst, false);
+    if (result != P65_EOK)
+        return result;
+
+    // Copying a directory inside itself would never finish.
+    int n = strlen(src);
+    if ((0 == strncasecmp(src, dst, n)) && ((dst[n] == 0) || (dst[n] == '/')))
+        return P65_EINVAL;
+    uint8_t made = MakeDirectory(dst);
+    if ((made != P65_EOK) && (made != P65_EEXIST))
+        return made;
+    return StartTreeJob(true, src, dst);
+}
+
+
+
+/** "treejob" replies with the job status (P65_EAGAIN while it's still
+ *  running) and a 2-byte count of the entries it has done.
+ */
+void HandleTreeJobStatus()
+{
+    char buffer[3];
+    GetTreeJobStatus(buffer);
+    SetCommandResponse(buffer, 3);
+}
+
+
+
+void GetTreeJobStatus(char* buffer)
+{
+    buffer[0] = tree_job_status;
+    buffer[1] = tree_job_count & 0xFF;
+    buffer[2] = tree_job_count >> 8;
+}
+
+
+
+/** Renames or moves a file or directory by rewriting directory entries,
+ *  so no file data gets copied. We let the library create an empty entry
+ *  under the new name, copy everything but the name over from the old
+ *  entry, and then delete the old entry. Something open on a data channel
+ *  would be left with the old entry, so that fails with P65_EBUSY.
+ */
+char HandleRename(char* command_buffer)
+{
+    char* src_filename = command_buffer + 3;
+    return Rename(src_filename, src_filename + strlen(src_filename) + 1);
+}
+
+
+
+char Rename(char* src_filename, char* dst_filename)
+{
+    SdFile src_dir, dst_dir, src, dst;
+    const char *src_name, *dst_name;
+
+    if ((src_filename[0] == '\0') || (dst_filename[0] == '\0'))
+        return P65_EINVAL;
+    if (!OpenParentDir(src_filename, src_dir, src_name) || !src.open(&src_dir, src_name, O_READ))
+        return P65_ENOENT;
+    if (EntryOpen(src))
+        return P65_EBUSY;
+    if (!OpenParentDir(dst_filename, dst_dir, dst_name))
+        return P65_ENOENT;
+
+    // A directory can't be moved inside itself.
+    while (*src_filename == '/')
+        ++src_filename;
+    while (*dst_filename == '/')
+        ++dst_filename;
+    int n = strlen(src_filename);
+    if (src.isDir() && (0 == strncasecmp(src_filename, dst_filename, n)) && (dst_filename[n] == '/'))
+        return P65_EINVAL;
+
+    if (dst.open(&dst_dir, dst_name, O_READ))
+    {
+        bool same = (dst.dirBlock() == src.dirBlock()) && (dst.dirIndex() == src.dirIndex());
+        bool busy = EntryOpen(dst);
+        dst.close();
+        return same ? P65_EOK : busy ? P65_EBUSY : P65_EEXIST;
+    }
+
+    dir_t entry;
+    if (!src.dirEntry(&entry) || !dst.open(&dst_dir, dst_name, O_CREAT | O_EXCL | O_WRITE))
+        return P65_EIO;
+    if (src.isDir())
+        DirCacheClear();
+    else
+        DirCacheRefresh(dst_dir);
+    uint32_t dst_block = dst.dirBlock();
+    uint8_t dst_index = dst.dirIndex();
+    dst.close();
+
+    // From here on we write blocks straight to the card, so we borrow the
+    // volume's block cache as a buffer. Clearing it first also makes sure
+    // the library doesn't hang on to stale copies of the blocks we change.
+    uint8_t* block = SdVolume::cacheClear();
+    dir_t* entries = (dir_t*)block;
+
+    if (!raw_card.readBlock(dst_block, block))
+        return P65_EIO;
+    memcpy((uint8_t*)&entries[dst_index] + sizeof(entry.name), (uint8_t*)&entry + sizeof(entry.name),
+           sizeof(dir_t) - sizeof(entry.name));
+    if (!raw_card.writeBlock(dst_block, block))
+        return P65_EIO;
+
+    if (!raw_card.readBlock(src.dirBlock(), block))
+        return P65_EIO;
+    entries[src.dirIndex()].name[0] = DIR_NAME_DELETED;
+    if (!raw_card.writeBlock(src.dirBlock(), block))
+        return P65_EIO;
+
+    // A directory that moved to a new parent needs its ".." entry, the
+    // second one in its first block, pointed at the new parent. The root
+    // is always cluster 0 here.
+    uint32_t old_parent = src_dir.isRoot() ? 0 : src_dir.firstCluster();
+    uint32_t new_parent = dst_dir.isRoot() ? 0 : dst_dir.firstCluster();
+    if (src.isDir() && (old_parent != new_parent))
+    {
+        uint32_t dir_block = raw_volume.dataStartBlock() +
+            ((src.firstCluster() - 2) << raw_volume.clusterSizeShift());
+        if (!raw_card.readBlock(dir_block, block))
+            return P65_EIO;
+        entries[1].firstClusterLow = new_parent & 0xFFFF;
+        entries[1].firstClusterHigh = new_parent >> 16;
+        if (!raw_card.writeBlock(dir_block, block))
+            return P65_EIO;
+    }
+
+    return P65_EOK;
+}
+
+
+
+/** Creates filename size bytes long, in one contiguous run of blocks, so
+ *  that it can be opened with P65_O_CONTIG. Any file already there is
+ *  replaced. The SD library can only allocate a file that way when it
+ *  creates it, not as it grows. Until it's written, the file holds
+ *  whatever was on the card.
+ */
+char Fallocate(char* filename, uint32_t size)
+{
+    SdFile dir, f;
+    const char* name;
+
+    if ((filename[0] == '\0') || (size == 0))
+        return P65_EINVAL;
+    if (!OpenParentDir(filename, dir, name))
+        return P65_ENOENT;
+    if (f.open(&dir, name, O_READ))
+    {
+        bool is_dir = f.isDir();
+        f.close();
+        if (is_dir)
+            return P65_EISDIR;
+        if (!SdFile::remove(&dir, name))
+            return P65_EIO;
+    }
+    if (!f.createContiguous(&dir, name, size))
+        return P65_ENOSPC;
+    f.close();
+    DirCacheRefresh(dir);
+    return P65_EOK;
+}
+
 
-void HandleStat(char* command_buffer)
+
+char HandleFileClose(char* command_buffer)
 {
-    char* filename = command_buffer + 5;
-    if (strlen(filename) < 1)
-        return SetCommandResponse(P65_EINVAL);
+    return CloseFile(command_buffer[1] - 48);  // cheap conversion
+}
 
-    // While "/" is a valid filename to pass to SD.open() in order to read the root
-    // directory, it is not accepted by SD.exists(). So we have to treat it specially
-    // here.
-    if (!SD.exists(filename) && strcmp(filename, "/"))
-    {
-        return SetCommandResponse(P65_ENOENT);
-    }
 
-    File f = SD.open(filename, O_RDONLY);
-    if (!f)
-        return SetCommandResponse(P65_EIO);
 
-    char buffer[1 + sizeof(struct stat)];
-    buffer[0] = P65_EOK;
-    struct stat* s = (struct stat*)(buffer + 1);
+char CloseFile(int channel)
+{
+    if (channel < MIN_CHANNEL || channel > MAX_CHANNEL)
+        return P65_EINVAL;
+    ClearChannel(channel);
+    return P65_EOK;
+}
 
-    s->st_dev = 0;  // this probably should be filled in on 6502 side
-    s->st_ino = 0;  // yeah, we don't really have inodes.
-    s->st_mode = (f.isDirectory() ? 2 : 1);
-    s->st_nlink = 1;  // I guess?
-    s->st_uid = 0;
-    s->st_gid = 0;
-    s->st_size = f.size();
-    s->st_atim = s->st_ctim = s->st_mtim = {};
 
-    f.close();
-    return SetCommandResponse(buffer, 1 + sizeof(struct stat));
+
+/** Moves count bytes from the file open on channel src to the one on dst,
+ *  for CMD_SPLICE, without them crossing the bus. moved gets how many
+ *  bytes went, which is fewer than count if src ran out.
+ */
+char Splice(int src, int dst, uint32_t count, uint32_t* moved)
+{
+    *moved = 0;
+    if (src == dst)
+        return P65_EINVAL;
+    FileRW* from = GetIOHandler(src)->asFile();
+    FileRW* to = GetIOHandler(dst)->asFile();
+    if (!from || !to)
+        return P65_EBADF;
+    return from->spliceTo(*to, count, *moved);
 }
 
 
 
-/** Parse a file open command and create file reader/writer.
- *  On success, the return value is the file type. On failure, an error code.
+/* Sends a whole .prg file for CMD_LOAD, so the 6502 can load a program
+ * with one command instead of opening it and reading it in pieces. As one
+ * burst, we send the status, the load address (the file's first 2 bytes),
+ * the length of the rest of the file, and the rest of the file, packed by
+ * WritePacked(). Programs tend to have long runs of zeros. Returns
+ * P65_EOK if all of that went out, or an error for the caller to send.
  */
-char HandleFileOpen(char* command_buffer)
+char LoadProgram(char* filename)
 {
-    if (strlen(command_buffer) < 4)
+    File f;
+    char result = OpenPath(filename, O_RDONLY, f);
+    if (result != P65_EOK)
+        return result;
+    if (f.isDirectory())
     {
-        return P65_EINVAL;
+        f.close();
+        return P65_EISDIR;
+    }
+    uint32_t size = f.size();
+    uint16_t address = 0;
+    if ((size < 2) || (size > 0xffffUL + 2) || (f.read(&address, 2) != 2))
+    {
+        f.close();
+        return P65_ENOEXEC;
     }
+    uint16_t length = size - 2;
+
+    // Borrow the block cache as a buffer.
+    if (block_cache.owner)
+        block_cache.flush();
+    block_cache.owner = nullptr;
+
+    BeginWriteBurst();
+    WriteBurstByte(P65_EOK);
+    WriteBurstByte(address & 0xff);
+    WriteBurstByte(address >> 8);
+    WriteBurstByte(length & 0xff);
+    if (length == 0)
+        EndWriteBurst(length >> 8);
+    else
+        WriteBurstByte(length >> 8);
 
-    int channel = command_buffer[1] - 48;  // convert ascii to int
-    if (channel < MIN_CHANNEL || channel > MAX_CHANNEL)
+    while (length > 0)
     {
-        return P65_EINVAL;
+        int n = min(length, BlockCache::size);
+        {
+            SdBusyTimer timer;
+            // We've already told the 6502 how much is coming, so if the
+            // card lets us down all we can do is send zeros.
+            if (f.read(block_cache.data, n) != n)
+                memset(block_cache.data, 0, n);
+        }
+        length -= n;
+        WritePacked(block_cache.data, n, length == 0);
     }
 
-    uint8_t mode = command_buffer[2];
-    uint8_t sd_mode = TranslateMode(mode);
+    f.close();
+    return P65_EOK;
+}
 
-    char* filename = command_buffer + 3;
 
-    ClearChannel(channel);
 
-    if (mode & P65_O_WRONLY) // includes read/write
+/* Sends up to max bytes of a file for CMD_SLURP, so that a small file can
+ * be read with one command instead of an open, reads and a close. As one
+ * burst, we send the status, the file's whole size (4 bytes), how many
+ * bytes follow (2 bytes), and those bytes from the start of the file,
+ * packed by WritePacked(). Returns P65_EOK if all of that went out, or an
+ * error for the caller to send.
+ */
+char SlurpFile(char* filename, uint16_t max)
+{
+    File f;
+    char result = OpenPath(filename, O_RDONLY, f);
+    if (result != P65_EOK)
+        return result;
+    if (f.isDirectory())
     {
-        if ((mode & P65_O_TRUNC) && (SD.exists(filename)))
-            SD.remove(filename);
-        File f = SD.open(filename, sd_mode/*FILE_WRITE*/);
-        if (f)
-        {
-            if (f.isDirectory())
-            {
-                // opening a directory for writing is not allowed!
-                f.close();
-                return P65_EISDIR;
-            }
-            else
-            {
-                SetChannel<FileRW>(channel, f, mode);
-                return 1;  // return filetype for regular file
-            }
-        }
-        else
-        {
-            return P65_EIO;
-        }
+        f.close();
+        return P65_EISDIR;
     }
-    else if (mode & P65_O_RDONLY)
+    uint32_t size = f.size();
+    uint16_t count = (size < max) ? size : max;
+
+    // Borrow the block cache as a buffer.
+    if (block_cache.owner)
+        block_cache.flush();
+    block_cache.owner = nullptr;
+
+    BeginWriteBurst();
+    WriteBurstByte(P65_EOK);
+    for (int i = 0; i < 4; ++i)
+        WriteBurstByte(((unsigned char*)&size)[i]);
+    WriteBurstByte(count & 0xff);
+    if (count == 0)
+        EndWriteBurst(count >> 8);
+    else
+        WriteBurstByte(count >> 8);
+
+    while (count > 0)
     {
-        // While "/" is a valid filename to pass to SD.open() in order to read the root
-        // directory, it is not accepted by SD.exists(). So we have to treat it specially
-        // here.
-        if (!SD.exists(filename) && strcmp(filename, "/"))
+        int n = min(count, BlockCache::size);
         {
-            return P65_ENOENT;
+            SdBusyTimer timer;
+            // Like LoadProgram(), all we can do now if the card fails is
+            // send zeros.
+            if (f.read(block_cache.data, n) != n)
+                memset(block_cache.data, 0, n);
         }
-        File f = SD.open(filename);
-        if (f)
+        count -= n;
+        WritePacked(block_cache.data, n, count == 0);
+    }
+
+    f.close();
+    return P65_EOK;
+}
+
+
+
+/* CRC-32 (the zip one) and the CRC-16 XModem uses, for CMD_SUM. They're
+ * worked a nibble at a time from 16-entry tables, which is about as much
+ * flash as they're worth.
+ */
+const uint32_t crc32_table[16] PROGMEM =
+{
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+const uint16_t crc16_table[16] PROGMEM =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+};
+
+constexpr uint8_t SUM_CRC32 = 1;  // what CMD_SUM computes
+constexpr uint8_t SUM_CRC16 = 2;
+
+// The reply to CMD_SUM. Sums it wasn't asked for are 0.
+struct __attribute__((packed)) FileSum
+{
+    uint32_t crc32;
+    uint16_t crc16;
+    uint32_t count;  // bytes summed
+};
+
+void UpdateSums(FileSum& sum, uint8_t which, const unsigned char* data, int n)
+{
+    if (which & SUM_CRC32)
+    {
+        uint32_t crc = sum.crc32;
+        for (int i = 0; i < n; ++i)
         {
-            if (f.isDirectory())
-            {
-                SetChannel<DirectoryReader2>(channel, f);
-                return 2;  // return filetype directory
-            }
-            else
-            {
-                SetChannel<FileRW>(channel, f, mode);
-                return 1;  // return filetype regular file
-            }
+            crc ^= data[i];
+            crc = (crc >> 4) ^ pgm_read_dword(&crc32_table[crc & 15]);
+            crc = (crc >> 4) ^ pgm_read_dword(&crc32_table[crc & 15]);
         }
-        else
+        sum.crc32 = crc;
+    }
+    if (which & SUM_CRC16)
+    {
+        uint16_t crc = sum.crc16;
+        for (int i = 0; i < n; ++i)
         {
-            return P65_EIO;
+            crc = (crc << 4) ^ pgm_read_word(&crc16_table[(crc >> 12) ^ (data[i] >> 4)]);
+            crc = (crc << 4) ^ pgm_read_word(&crc16_table[(crc >> 12) ^ (data[i] & 15)]);
         }
+        sum.crc16 = crc;
     }
-
-    // fallthrough error
-    return P65_EINVAL;
 }
 
 
 
-char HandleDeleteFile(char* command_buffer)
+/** Sums length bytes of filename starting at offset, or up to the end of
+ *  the file if that comes first, so the 6502 can check a file without
+ *  reading it all over the bus. Reads go a cache full at a time through
+ *  the block cache, lined up with the file's blocks.
+ */
+char SumFile(char* filename, uint8_t which, uint32_t offset, uint32_t length, FileSum* sum)
 {
-    char* filename = command_buffer + 3;
-    if (*filename == 0)
-        return P65_EINVAL;
-    if (!SD.exists(filename))
-        return P65_ENOENT;
-    if (File f = SD.open(filename))
+    File f;
+    char result = OpenPath(filename, O_READ, f);
+    if (result != P65_EOK)
+        return result;
+    if (f.isDirectory())
     {
-        if (f.isDirectory())
+        f.close();
+        return P65_EISDIR;
+    }
+    uint32_t size = f.size();
+    if ((offset > size) || !f.seek(offset))
+    {
+        f.close();
+        return P65_ERANGE;
+    }
+    length = min(length, size - offset);
+
+    // Borrow the block cache as a buffer.
+    if (block_cache.owner)
+        block_cache.flush();
+    block_cache.owner = nullptr;
+
+    sum->crc32 = 0xffffffff;
+    sum->crc16 = 0;
+    sum->count = 0;
+    while (sum->count < length)
+    {
+        uint32_t position = offset + sum->count;
+        int n = BlockCache::size - (position & (BlockCache::size - 1));
+        n = min((uint32_t)n, length - sum->count);
         {
-            f.close();
-            return P65_EISDIR;
+            SdBusyTimer timer;
+            if (f.read(block_cache.data, n) != n)
+            {
+                f.close();
+                return P65_EIO;
+            }
         }
-        f.close();
+        UpdateSums(*sum, which, block_cache.data, n);
+        sum->count += n;
     }
-    if (SD.remove(filename))
-        return P65_EOK;
-    else
-        return P65_EIO;
+    f.close();
+    sum->crc32 = (which & SUM_CRC32) ? ~sum->crc32 : 0;
+    return P65_EOK;
 }
 
 
 
-char HandleDeleteDirectory(char* command_buffer)
+/* Copies one set of counters to buffer for CMD_STATS. index 0-7 is the
+ * CommandStats for that protocol command (index 0 covers any we don't
+ * know), and StatsTotalsIndex gets the TotalStats. StatsResetIndex clears
+ * everything and then returns the totals.
+ */
+#if P65_STATS
+char GetStats(uint8_t index, char* buffer)
 {
-    char* filename = command_buffer + 6;
-    if (*filename == 0)
-        return P65_EINVAL;
-    if (!SD.exists(filename))
-        return P65_ENOENT;
-    if (File f = SD.open(filename))
+    if (index == StatsResetIndex)
     {
-        if (!f.isDirectory())
-        {
-            f.close();
-            return P65_ENOTDIR;
-        }
-        f.rewindDirectory();
-        if (File f2 = f.openNextFile())
-        {
-            f2.close();
-            f.close();
-            return P65_EEXIST;
-        }
-        f.close();
+        memset(&stats, 0, sizeof(stats));
+        stats.totals.start_ms = millis();
+        index = StatsTotalsIndex;
+    }
+    if (index == StatsTotalsIndex)
+    {
+        TotalStats totals = stats.totals;
+        totals.start_ms = millis() - totals.start_ms;
+        memcpy(buffer, &totals, sizeof(totals));
+    }
+    else if (index < StatsTotalsIndex)
+    {
+        memcpy(buffer, &stats.commands[index], sizeof(CommandStats));
     }
-    if (SD.rmdir(filename))
-        return P65_EOK;
     else
-        return P65_EIO;
+    {
+        return P65_EINVAL;
+    }
+    return P65_EOK;
 }
+#else
+char GetStats(uint8_t, char*)
+{
+    return P65_ENOSYS;
+}
+#endif
 
 
 
-char HandleMkdir(char* command_buffer)
+/* Binary commands. These are an alternative to the text commands that
+ * don't need any parsing. The 6502 sends 0x70 followed by a frame:
+ *
+ *     opcode, # of args, then for each arg a length byte and that many bytes
+ *
+ * and we reply right away with a status byte. If the status is >= 0, a
+ * payload of a fixed size for that opcode follows; for OPEN, the status is
+ * the file type. Args are stored in command_buffer as 0-terminated strings,
+ * so the same functions serve text and binary commands. Numeric args are
+ * single bytes, not ASCII, except for sizes, which are 4 bytes, low byte
+ * first. Path args go through MakeFullPath() as they're stored, so they
+ * can be relative to the working directory. Text commands only take full
+ * paths.
+ */
+constexpr uint8_t CMD_OPEN = 1;      // channel, mode, filename
+constexpr uint8_t CMD_CLOSE = 2;     // channel
+constexpr uint8_t CMD_STAT = 3;      // filename. replies with struct stat
+constexpr uint8_t CMD_RM = 4;        // filename
+constexpr uint8_t CMD_RMDIR = 5;     // dirname
+constexpr uint8_t CMD_MKDIR = 6;     // dirname
+constexpr uint8_t CMD_CP = 7;        // src, dst
+constexpr uint8_t CMD_MV = 8;        // src, dst
+constexpr uint8_t CMD_RMTREE = 9;    // dirname
+constexpr uint8_t CMD_CPTREE = 10;   // src, dst
+constexpr uint8_t CMD_TREEJOB = 11;  // replies with job status & 2-byte count
+constexpr uint8_t CMD_STATS = 12;    // index. replies with 16 bytes of stats
+constexpr uint8_t CMD_LOAD = 13;     // filename. replies with a whole program, packed
+constexpr uint8_t CMD_FALLOCATE = 14;  // filename, size
+constexpr uint8_t CMD_OPENDIR = 15;  // channel, dirname, pattern, after. Status is the file type.
+constexpr uint8_t CMD_CHDIR = 16;    // dirname
+constexpr uint8_t CMD_GETCWD = 17;   // replies with the working directory, 0-padded to MaxCwd
+constexpr uint8_t CMD_COPY = 18;     // src, dst. Starts copying in the background.
+constexpr uint8_t CMD_COPYJOB = 19;  // replies with copy status, 4-byte bytes done & 4-byte total
+constexpr uint8_t CMD_COPYCANCEL = 20;
+constexpr uint8_t CMD_SUM = 21;      // filename, which sums, 4-byte offset, 4-byte length. Replies with a FileSum
+constexpr uint8_t CMD_GREP = 22;     // channel, file or dirname, pattern, flags. See GrepReader.
+constexpr uint8_t CMD_SPLICE = 23;   // src channel, dst channel, 4-byte count. Replies with 4-byte bytes moved
+constexpr uint8_t CMD_SLURP = 24;    // filename, 2-byte max. Replies with the size & up to max bytes, packed
+
+typedef char (*BinaryCommandFn)(char** args, char* reply);
+
+struct BinaryCommand
 {
-    char* filename = command_buffer + 6;
-    if (*filename == 0)
-        return P65_EINVAL;
-    if (SD.exists(filename))
-        return P65_EEXIST;
-    if (SD.mkdir(filename))
-        return P65_EOK;
-    else
-        return P65_EIO;
+    uint8_t nargs;      // number of args the command takes
+    uint8_t reply_len;  // payload size after a successful status
+    uint8_t path_args;  // bit n is set if arg n is a path
+    BinaryCommandFn fn;
+};
+
+// reply_len for commands whose fn sends the whole reply itself, status
+// and all, when it succeeds.
+constexpr uint8_t CustomReply = 0xff;
+
+char BinaryOpen(char** args, char*) { return OpenFile(args[0][0], args[1][0], args[2]); }
+char BinaryClose(char** args, char*) { return CloseFile(args[0][0]); }
+char BinaryStat(char** args, char* reply) { return Stat(args[0], (struct stat*)reply); }
+char BinaryRm(char** args, char*) { return DeleteFile(args[0]); }
+char BinaryRmdir(char** args, char*) { return DeleteDirectory(args[0]); }
+char BinaryMkdir(char** args, char*) { return MakeDirectory(args[0]); }
+char BinaryCp(char** args, char*) { return CopyFile(args[0], args[1]); }
+char BinaryMv(char** args, char*) { return Rename(args[0], args[1]); }
+char BinaryRmtree(char** args, char*) { return RemoveTree(args[0]); }
+char BinaryCptree(char** args, char*) { return CopyTree(args[0], args[1]); }
+char BinaryTreejob(char**, char* reply) { GetTreeJobStatus(reply); return P65_EOK; }
+char BinaryStats(char** args, char* reply) { return GetStats(args[0][0], reply); }
+char BinaryLoad(char** args, char*) { return LoadProgram(args[0]); }
+char BinaryChdir(char** args, char*) { return ChangeDirectory(args[0]); }
+char BinaryCopy(char** args, char*) { return StartCopyJob(args[0], args[1]); }
+char BinaryCopyjob(char**, char* reply) { GetCopyJobStatus(reply); return P65_EOK; }
+char BinaryCopycancel(char**, char*) { return CancelCopyJob(); }
+
+char BinaryGrep(char** args, char*) { return OpenSearch(args[0][0], args[1], args[2], args[3][0]); }
+
+char BinarySlurp(char** args, char*)
+{
+    uint16_t max;
+    memcpy(&max, args[1], sizeof(max));
+    return SlurpFile(args[0], max);
 }
 
+char BinarySplice(char** args, char* reply)
+{
+    uint32_t count;
+    memcpy(&count, args[2], sizeof(count));
+    return Splice(args[0][0], args[1][0], count, (uint32_t*)reply);
+}
+
+char BinarySum(char** args, char* reply)
+{
+    uint32_t offset, length;
+    memcpy(&offset, args[2], sizeof(offset));
+    memcpy(&length, args[3], sizeof(length));
+    return SumFile(args[0], args[1][0], offset, length, (FileSum*)reply);
+}
 
+static_assert(MaxCwd <= 1 + sizeof(struct stat), "CMD_GETCWD reply doesn't fit in the reply buffer");
 
-char HandleCopyFile(char* command_buffer)
+char BinaryGetcwd(char**, char* reply)
 {
-    constexpr int buflen = 64;
-    char buffer[buflen];
-    char* src_filename = command_buffer + 3;
-    char* dst_filename = src_filename + strlen(src_filename) + 1;
-    File src, dst;
+    memset(reply, 0, MaxCwd);
+    strcpy(reply, cwd);
+    return P65_EOK;
+}
 
-    if ((src_filename[0] == '\0') || (dst_filename[0] == '\0'))
-        return P65_EINVAL;
-    // SD library doesn't give me any exact way to tell if two files are
-    // the same thing, but we'll try to canonicalize as much as possible.
-    if (src_filename[0] == '/')
-        src_filename += 1;
-    if ((dst_filename[0] == '/') && (dst_filename[1] != 0))
-        dst_filename += 1;
-    if (0 == strcasecmp(src_filename, dst_filename))
-        return P65_EINVAL;
-    if (!SD.exists(src_filename))
-        return P65_ENOENT;
+// after is empty to start at the top, or the 18-byte dirent to start after.
+char BinaryOpendir(char** args, char*)
+{
+    return OpenSortedDirectory(args[0][0], args[1], args[2], (const struct dirent*)args[3]);
+}
+
+char BinaryFallocate(char** args, char*)
+{
+    uint32_t size;
+    memcpy(&size, args[1], sizeof(size));
+    return Fallocate(args[0], size);
+}
+
+// Indexed by opcode - 1.
+const BinaryCommand binary_commands[] PROGMEM =
+{
+    {3, 0, 0b100, BinaryOpen},
+    {1, 0, 0, BinaryClose},
+    {1, sizeof(struct stat), 0b1, BinaryStat},
+    {1, 0, 0b1, BinaryRm},
+    {1, 0, 0b1, BinaryRmdir},
+    {1, 0, 0b1, BinaryMkdir},
+    {2, 0, 0b11, BinaryCp},
+    {2, 0, 0b11, BinaryMv},
+    {1, 0, 0b1, BinaryRmtree},
+    {2, 0, 0b11, BinaryCptree},
+    {0, 3, 0, BinaryTreejob},
+    {1, sizeof(CommandStats), 0, BinaryStats},
+    {1, CustomReply, 0b1, BinaryLoad},
+    {2, 0, 0b1, BinaryFallocate},
+    {4, 0, 0b10, BinaryOpendir},
+    {1, 0, 0b1, BinaryChdir},
+    {0, MaxCwd, 0, BinaryGetcwd},
+    {2, 0, 0b11, BinaryCopy},
+    {0, 9, 0, BinaryCopyjob},
+    {0, 0, 0, BinaryCopycancel},
+    {4, sizeof(FileSum), 0b1, BinarySum},
+    {4, 0, 0b10, BinaryGrep},
+    {3, sizeof(uint32_t), 0, BinarySplice},
+    {2, CustomReply, 0b1, BinarySlurp},
+};
+constexpr int num_binary_commands = sizeof(binary_commands) / sizeof(binary_commands[0]);
 
-#if 1
-    if (src = SD.open(src_filename, FILE_READ | O_WRONLY))
-    {
-        if (src.isDirectory())
-        {
-            src.close();
-            return P65_EISDIR;
-        }
-    }
-    else
-    {
-        //src.close();
-        return P65_EIO;
-    }
 
-    // If dst_filename exists & is a folder, abort.
-    if (SD.exists(dst_filename) && (dst = SD.open(dst_filename, FILE_READ)))
+
+void CommandHandler::binaryCommand()
+{
+    constexpr int max_args = 4;
+    char* args[max_args];
+    uint8_t opcode = ReadByte();
+    uint8_t nargs = ReadByte();
+    int index = 0;
+    bool overrun = false;
+
+    BinaryCommand cmd = {};
+    bool known = (opcode > 0) && (opcode <= num_binary_commands);
+    if (known)
+        memcpy_P(&cmd, &binary_commands[opcode - 1], sizeof(cmd));
+
+    for (int i = 0; i < nargs; ++i)
     {
-        if (dst.isDirectory())
+        int len = (uint8_t)ReadByte();
+        int start = index;
+        if (i < max_args)
+            args[i] = command_buffer + index;
+        for (int j = 0; j < len; ++j)
         {
-            src.close();
-            dst.close();
-            return P65_EISDIR;
-            //      // make up a new destination name and stick it in buffer.
-            //      dst.close();
-            //      if (strlen(src_filename) + strlen(dst_filename) + 2 > buflen)
-            //      {
-            //        return P65_EINVAL; // name too long...
-            //      }
-            //      sprintf(buffer, "%s/%s",dst_filename, src_filename);
-            //      dst_filename = buffer;
+            char ch = ReadByte();
+            if (index < buflen - 1)
+                command_buffer[index++] = ch;
+            else
+                overrun = true;
         }
+        if (index < buflen)
+            command_buffer[index++] = 0;
         else
+            overrun = true;
+
+        if (!overrun && (i < max_args) && (cmd.path_args & (1 << i)))
         {
-            dst.close();
+            if (MakeFullPath(args[i], buflen - start))
+                index = start + strlen(args[i]) + 1;
+            else
+                overrun = true;
         }
     }
 
-    // so despite the fact that FILE_WRITE is apparently defined with O_APPEND,
-    // the actual effect is as if using O_TRUNC. Which begs the question of
-    // whether we can make append work at all... or if seek would avail us?
-    // or is that us doing that up above?
-    dst = SD.open(dst_filename, /*FILE_WRITE*/ O_WRITE | O_CREAT | O_TRUNC);
-    if (!dst)
+    // Any half-sent text command is gone now, and so is the response to
+    // the last one.
+    command_buffer_index = 0;
+    read_position = write_position = 0;
+
+    char status;
+    int reply_len = 0;
+    if (!known)
     {
-        src.close();
-        return P65_EIO;
+        status = P65_EBADCMD;
     }
-
-    // OK, we should have both src and dst open. Start copying?
-    int num_read = 0, num_written = 0;
-    int total_written = 0;
-    int count = src.size();
-    for (;;)
+    else
     {
-        num_read = src.read(buffer, buflen);
-        if (num_read == 0)
-            break;
-        num_written = dst.write(buffer, num_read);
-        total_written += num_written;
-        if (num_written != num_read)
-            break;
+        if (overrun || (nargs != cmd.nargs))
+        {
+            status = P65_EINVAL;
+        }
+        else
+        {
+            status = cmd.fn(args, buffer);
+            if ((cmd.reply_len == CustomReply) && !(status & 0x80))
+                return;  // already sent
+            if (!(status & 0x80))
+                reply_len = cmd.reply_len;
+        }
     }
 
-    src.close();
-    dst.close();
-
-    if (total_written != count)
+    BeginWriteBurst();
+    if (reply_len == 0)
     {
-        //SD.remove(dst_filename);
-        return P65_EIO;
+        EndWriteBurst(status);
+        return;
     }
-    else
-        return P65_EOK;
-#endif
+    WriteBurstByte(status);
+    for (int i = 0; i < reply_len - 1; ++i)
+        WriteBurstByte(buffer[i]);
+    EndWriteBurst(buffer[reply_len - 1]);
 }
 
 
 
-char HandleFileClose(char* command_buffer)
+// Gives each channel's idle() and each background job a step. None of
+// them moves more than a block in one, and we stop between them if the
+// 6502 starts a request, so it never waits behind more than a block of
+// idle work. Returns true if there's more idle work waiting to be done.
+bool RunIdleTasks()
 {
-    int channel = command_buffer[1] - 48;  // cheap conversion
-    if (channel < MIN_CHANNEL || channel > MAX_CHANNEL)
-        return P65_EINVAL;
-    ClearChannel(channel);
-    return P65_EOK;
+    for (int channel = MIN_CHANNEL; channel <= MAX_CHANNEL; ++channel)
+    {
+        if (RequestPending())
+            return true;
+        if (channel_io[channel])
+            channel_io[channel]->idle();
+    }
+    if (RequestPending())
+        return true;
+    bool busy = RunTreeJob();
+    if (RequestPending())
+        return true;
+    busy |= RunCopyJob();
+    return busy;
 }
 
 
 
 void loop()
 {
+    // Until the 6502 starts the next request, use the time for read-ahead,
+    // write-behind and background jobs. If it starts while we're busy, the
+    // interrupt takes the first bytes so that it doesn't have to wait.
+    ArmReceiver();
+#if P65_STATS
+    uint32_t idle_start = Ticks();
+#endif
+    while (!RequestPending() && RunIdleTasks())
+        ;
+#if P65_STATS
+    stats.totals.idle_us += MicrosSince(idle_start);
+
+    // Waiting for the next request doesn't count as bus wait.
+    uint32_t bus_wait = stats.totals.bus_wait_us;
     char protocol = ReadByte();
+    stats.totals.bus_wait_us = bus_wait;
+    uint32_t start = Ticks();
+    uint32_t start_bytes = BusBytes() - 1;
+#else
+    char protocol = ReadByte();
+#endif
+
     char channel = protocol & 0x0f;
-    char command = protocol & 0xf0;
+    uint8_t command = protocol & 0xf0;
 
     switch (command)
     {
@@ -1194,12 +4710,33 @@ void loop()
                 handler->read();
             }
             break;
+        case 0x60:  // 6502 sent an unescaped bulk read command
+            {
+                auto handler = GetIOHandler(channel);
+                handler->bulkRead();
+            }
+            break;
+        case 0x80:  // 6502 sent a packed bulk read command
+            {
+                auto handler = GetIOHandler(channel);
+                handler->packedRead();
+            }
+            break;
+        case 0x90:  // 6502 sent a directory listing read command
+            {
+                auto handler = GetIOHandler(channel);
+                handler->listRead();
+            }
+            break;
         case 0x50:  // 6502 sent a multibyte write command
             {
                 auto handler = GetIOHandler(channel);
                 handler->write();
             }
             break;
+        case 0x70:  // 6502 sent a binary command frame
+            command_handler.binaryCommand();
+            break;
         case 0x30:  // 6502 sending a seek command
             {
                 auto handler = GetIOHandler(channel);
@@ -1221,4 +4758,18 @@ void loop()
             }
             break;
     }
+
+#if P65_STATS
+    // Packed and listing reads count as bulk reads.
+    uint8_t index = (command <= 0x70) ? (command >> 4) : 0;
+    if ((command == 0x80) || (command == 0x90))
+        index = 0x60 >> 4;
+    CommandStats& c = stats.commands[index];
+    uint32_t us = MicrosSince(start);
+    ++c.count;
+    c.bytes += BusBytes() - start_bytes;
+    c.total_us += us;
+    if (us > c.max_us)
+        c.max_us = us;
+#endif
 }
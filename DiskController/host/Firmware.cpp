@@ -0,0 +1,4 @@
+/* DiskController.ino, built for the PC. See README.md. */
+
+#include "Arduino.h"
+#include "../DiskController.ino"
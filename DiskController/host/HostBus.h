@@ -0,0 +1,106 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Simulated VIA bus for the PC build. Rather than strobing CA1 and CA2,
+ * bytes go through two queues. The simulated 6502 puts a whole request in
+ * to_controller and calls loop(), which takes it apart with ReadByte() and
+ * leaves its reply in to_host. Each byte counts as one handshake, same as
+ * on the real bus, whichever direction it goes.
+ *
+ * loop() handles one request per call. It must never need more bytes than
+ * the 6502 sent - on the real bus it would wait, but here nobody else is
+ * going to come along and send them.
+ */
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <deque>
+
+struct HostBus
+{
+    std::deque<uint8_t> to_controller;
+    std::deque<uint8_t> to_host;
+    unsigned long handshakes = 0;
+};
+
+inline HostBus host_bus;
+
+
+inline char ReadByte()
+{
+    if (host_bus.to_controller.empty())
+    {
+        fprintf(stderr, "Controller is waiting for a byte the 6502 never sent.\n");
+        exit(1);
+    }
+    char result = host_bus.to_controller.front();
+    host_bus.to_controller.pop_front();
+    ++host_bus.handshakes;
+    return result;
+}
+
+
+inline void BeginWriteBurst()
+{
+    ;
+}
+
+
+inline void WriteBurstByte(char data)
+{
+    host_bus.to_host.push_back(data);
+    ++host_bus.handshakes;
+}
+
+
+inline void EndWriteBurst(char data)
+{
+    WriteBurstByte(data);
+}
+
+
+// No interrupt to arm; the whole request is already queued.
+inline void ArmReceiver()
+{
+    ;
+}
+
+
+inline bool RequestPending()
+{
+    return !host_bus.to_controller.empty();
+}
+
+
+inline void HandshakeInterrupt()
+{
+    ;
+}
@@ -0,0 +1,594 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Host directory implementation of the SD library stand-in. */
+
+#include "SD.h"
+
+// We want the real ones here.
+#undef stat
+#undef timespec
+
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+const char* host_sd_root = ".";
+unsigned long host_sd_lookups = 0;
+SDClass SD;
+
+
+struct HostFile
+{
+    std::string path;       // relative to host_sd_root, with a leading /
+    FILE* fp = nullptr;     // for files
+    DIR* dir = nullptr;     // for directories
+    uint8_t mode = 0;
+    uint32_t pos = 0;       // for a directory, the # of entries read so far
+    char name[256];
+};
+
+
+static std::string HostPath(const std::string& path)
+{
+    return std::string(host_sd_root) + "/" + path;
+}
+
+
+static bool HostStat(const std::string& path, struct stat* st)
+{
+    return ::stat(HostPath(path).c_str(), st) == 0;
+}
+
+
+// Counts the parts of path for host_sd_lookups, the way the library walks
+// them from the root.
+static void CountLookups(const char* path)
+{
+    for (const char* p = path; *p; ++p)
+        if ((*p != '/') && ((p == path) || (p[-1] == '/')))
+            ++host_sd_lookups;
+}
+
+
+bool SDClass::begin(uint8_t)
+{
+    struct stat st;
+    return (::stat(host_sd_root, &st) == 0) && S_ISDIR(st.st_mode);
+}
+
+
+File SDClass::open(const char* filepath, uint8_t mode)
+{
+    CountLookups(filepath);
+    return HostOpen(filepath, mode);
+}
+
+
+File HostOpen(const std::string& filepath, uint8_t mode)
+{
+    std::string path = filepath;
+    if (path.empty() || (path[0] != '/'))
+        path = "/" + path;
+    std::string host_path = HostPath(path);
+
+    struct stat st;
+    bool exists = HostStat(path, &st);
+    File file;
+    if (exists && S_ISDIR(st.st_mode))
+    {
+        DIR* dir = opendir(host_path.c_str());
+        if (!dir)
+            return file;
+        file.f = new HostFile;
+        file.f->dir = dir;
+    }
+    else
+    {
+        if (!exists && !(mode & O_CREAT))
+            return file;
+        if (exists && (mode & O_CREAT) && (mode & O_EXCL))
+            return file;
+        if (!exists || ((mode & O_TRUNC) && (mode & O_WRITE)))
+        {
+            FILE* fp = fopen(host_path.c_str(), "wb");
+            if (!fp)
+                return file;
+            fclose(fp);
+        }
+        FILE* fp = fopen(host_path.c_str(), (mode & O_WRITE) ? "r+b" : "rb");
+        if (!fp)
+            return file;
+        file.f = new HostFile;
+        file.f->fp = fp;
+    }
+    file.f->path = path;
+    file.f->mode = mode;
+    size_t slash = path.find_last_of('/');
+    std::string name = (path.size() > 1) ? path.substr(slash + 1) : path;
+    snprintf(file.f->name, sizeof(file.f->name), "%s", name.c_str());
+
+    // Like the SD library, files opened for writing start at the end.
+    if (file.f->fp && (mode & O_WRITE))
+        file.f->pos = file.size();
+    return file;
+}
+
+
+bool SDClass::exists(const char* filepath)
+{
+    CountLookups(filepath);
+    struct stat st;
+    return HostStat(filepath, &st);
+}
+
+
+// Like the SD library, this makes any missing parent directories too.
+bool SDClass::mkdir(const char* filepath)
+{
+    CountLookups(filepath);
+    std::string path = filepath;
+    for (size_t i = 1; i <= path.size(); ++i)
+    {
+        if ((i == path.size()) || (path[i] == '/'))
+        {
+            std::string part = path.substr(0, i);
+            struct stat st;
+            if (!HostStat(part, &st) && (::mkdir(HostPath(part).c_str(), 0777) != 0))
+                return false;
+        }
+    }
+    return true;
+}
+
+
+bool SDClass::remove(const char* filepath)
+{
+    CountLookups(filepath);
+    return unlink(HostPath(filepath).c_str()) == 0;
+}
+
+
+bool SDClass::rmdir(const char* filepath)
+{
+    CountLookups(filepath);
+    return ::rmdir(HostPath(filepath).c_str()) == 0;
+}
+
+
+
+size_t File::write(uint8_t b)
+{
+    return write(&b, 1);
+}
+
+
+size_t File::write(const uint8_t* buf, size_t size)
+{
+    if (!f || !f->fp || !(f->mode & O_WRITE))
+        return 0;
+    if (f->mode & O_APPEND)
+        f->pos = this->size();
+    fseek(f->fp, f->pos, SEEK_SET);
+    size_t n = fwrite(buf, 1, size, f->fp);
+    f->pos += n;
+    return n;
+}
+
+
+int File::read()
+{
+    uint8_t b;
+    return (read(&b, 1) == 1) ? b : -1;
+}
+
+
+int File::read(void* buf, uint16_t nbyte)
+{
+    if (!f || !f->fp)
+        return -1;
+    fseek(f->fp, f->pos, SEEK_SET);
+    size_t n = fread(buf, 1, nbyte, f->fp);
+    f->pos += n;
+    return n;
+}
+
+
+int File::peek()
+{
+    int ch = read();
+    if (ch != -1)
+        --f->pos;
+    return ch;
+}
+
+
+int File::available()
+{
+    return f ? size() - f->pos : 0;
+}
+
+
+// The library writes its cached block and the directory entry back to the
+// card. Here that's stdio's buffer going to the host file.
+void File::flush()
+{
+    if (f && f->fp)
+        fflush(f->fp);
+}
+
+
+bool File::seek(uint32_t pos)
+{
+    if (!f)
+        return false;
+    if (f->dir)
+    {
+        rewindDirectory();
+        while ((f->pos < pos) && readdir(f->dir))
+            ++f->pos;
+        return f->pos == pos;
+    }
+    if (pos > size())
+        return false;
+    f->pos = pos;
+    return true;
+}
+
+
+uint32_t File::position()
+{
+    return f ? f->pos : 0;
+}
+
+
+uint32_t File::size()
+{
+    if (!f || !f->fp)
+        return 0;
+    fflush(f->fp);
+    struct stat st;
+    if (fstat(fileno(f->fp), &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+
+void File::close()
+{
+    if (!f)
+        return;
+    if (f->fp)
+        fclose(f->fp);
+    if (f->dir)
+        closedir(f->dir);
+    delete f;
+    f = nullptr;
+}
+
+
+char* File::name()
+{
+    return f ? f->name : nullptr;
+}
+
+
+bool File::isDirectory()
+{
+    return f && f->dir;
+}
+
+
+File File::openNextFile(uint8_t mode)
+{
+    if (!f || !f->dir)
+        return File();
+    while (struct dirent* entry = readdir(f->dir))
+    {
+        ++f->pos;
+        if (entry->d_name[0] == '.')
+            continue;
+        std::string path = f->path;
+        if (path.back() != '/')
+            path += "/";
+        return HostOpen(path + entry->d_name, mode);
+    }
+    return File();
+}
+
+
+/* Contiguous files. Each one gets 64K blocks (32M) of made-up card, the
+ * first range for the first file asked about and so on. The raw card maps
+ * a block back to its file and offset.
+ */
+
+constexpr int BlocksPerFileShift = 16;
+static std::vector<std::string> block_files;
+
+
+static uint32_t FileBlocks(const std::string& path)
+{
+    size_t i = 0;
+    while ((i < block_files.size()) && (block_files[i] != path))
+        ++i;
+    if (i == block_files.size())
+        block_files.push_back(path);
+    return (i + 1) << BlocksPerFileShift;
+}
+
+
+// Finds the file and offset for block. Returns false if it's not in one.
+static bool BlockFile(uint32_t block, std::string& host_path, long& offset)
+{
+    size_t i = (block >> BlocksPerFileShift) - 1;
+    if (i >= block_files.size())
+        return false;
+    host_path = HostPath(block_files[i]);
+    offset = (long)(block & ((1 << BlocksPerFileShift) - 1)) * 512;
+    return true;
+}
+
+
+uint8_t Sd2Card::readBlock(uint32_t block, uint8_t* dst)
+{
+    std::string host_path;
+    long offset;
+    if (!BlockFile(block, host_path, offset))
+        return false;
+    FILE* fp = fopen(host_path.c_str(), "rb");
+    if (!fp)
+        return false;
+    memset(dst, 0, 512);
+    fseek(fp, offset, SEEK_SET);
+    fread(dst, 1, 512, fp);
+    fclose(fp);
+    return true;
+}
+
+
+// A block past the end of the file would be cluster slack on a card. We
+// don't write it, since that would make the file bigger.
+uint8_t Sd2Card::writeBlock(uint32_t block, const uint8_t* src)
+{
+    std::string host_path;
+    long offset;
+    if (!BlockFile(block, host_path, offset))
+        return false;
+    FILE* fp = fopen(host_path.c_str(), "r+b");
+    if (!fp)
+        return false;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    long n = (size - offset < 512) ? size - offset : 512;
+    bool ok = true;
+    if (n > 0)
+    {
+        fseek(fp, offset, SEEK_SET);
+        ok = (fwrite(src, 1, n, fp) == (size_t)n);
+    }
+    fclose(fp);
+    return ok;
+}
+
+
+uint8_t SdFile::open(SdFile* dir, const char* name, uint8_t mode)
+{
+    ++host_sd_lookups;
+    std::string p = dir->path + "/" + name;
+    struct stat st;
+    if (!HostStat(p, &st))
+    {
+        if (!(mode & O_CREAT))
+            return false;
+        FILE* fp = fopen(HostPath(p).c_str(), "wb");
+        if (!fp)
+            return false;
+        fclose(fp);
+    }
+    else if ((mode & O_CREAT) && (mode & O_EXCL))
+    {
+        return false;
+    }
+    else if (S_ISDIR(st.st_mode) && (mode & O_WRITE))
+    {
+        return false;
+    }
+    else if ((mode & O_TRUNC) && (mode & O_WRITE))
+    {
+        if (truncate(HostPath(p).c_str(), 0) != 0)
+            return false;
+    }
+    path = p;
+    this->mode = mode;
+    is_open = true;
+    rewind();
+    return true;
+}
+
+
+uint32_t SdFile::fileSize() const
+{
+    struct stat st;
+    return (HostStat(path, &st) && S_ISREG(st.st_mode)) ? st.st_size : 0;
+}
+
+
+uint8_t SdFile::remove(SdFile* dir, const char* name)
+{
+    ++host_sd_lookups;
+    return unlink(HostPath(dir->path + "/" + name).c_str()) == 0;
+}
+
+
+uint8_t SdFile::seekSet(uint32_t pos)
+{
+    if (!isDir())
+        return true;
+    dir_t entry;
+    rewind();
+    while ((position < pos) && (readDir(&entry) > 0))
+        ;
+    return position == pos;
+}
+
+
+// Gives the next entry in name order, skipping "." and "..", with the name
+// in 8.3 form but in its own case.
+int8_t SdFile::readDir(dir_t* dir)
+{
+    if (!is_open || !isDir())
+        return -1;
+    DIR* d = opendir(HostPath(path).c_str());
+    if (!d)
+        return -1;
+    std::string next;
+    bool found = false;
+    while (struct dirent* e = readdir(d))
+    {
+        std::string n = e->d_name;
+        if ((n[0] != '.') && (n > last) && (!found || (n < next)))
+        {
+            next = n;
+            found = true;
+        }
+    }
+    closedir(d);
+    if (!found)
+        return 0;
+    last = next;
+    position += sizeof(dir_t);
+
+    memset(dir, 0, sizeof(dir_t));
+    memset(dir->name, ' ', sizeof(dir->name));
+    size_t dot = next.find_last_of('.');
+    std::string base = next.substr(0, dot);
+    std::string ext = (dot == std::string::npos) ? "" : next.substr(dot + 1);
+    memcpy(dir->name, base.data(), min(base.size(), (size_t)8));
+    memcpy(dir->name + 8, ext.data(), min(ext.size(), (size_t)3));
+    struct stat st;
+    if (HostStat(path + "/" + next, &st))
+    {
+        dir->attributes = S_ISDIR(st.st_mode) ? DIR_ATT_DIRECTORY : 0;
+        dir->fileSize = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+    }
+    return sizeof(dir_t);
+}
+
+
+void SdFile::dirName(const dir_t& dir, char* name)
+{
+    int j = 0;
+    for (int i = 0; i < 11; ++i)
+    {
+        if (dir.name[i] == ' ')
+            continue;
+        if (i == 8)
+            name[j++] = '.';
+        name[j++] = dir.name[i];
+    }
+    name[j] = 0;
+}
+
+
+// Leaves the new directory open, like the library.
+uint8_t SdFile::makeDir(SdFile* dir, const char* name)
+{
+    ++host_sd_lookups;
+    std::string p = dir->path + "/" + name;
+    if (::mkdir(HostPath(p).c_str(), 0777) != 0)
+        return false;
+    path = p;
+    mode = O_READ;
+    is_open = true;
+    rewind();
+    return true;
+}
+
+
+// Only an empty directory goes, and it's closed after.
+uint8_t SdFile::rmDir()
+{
+    if (!is_open || isRoot() || !isDir() || (::rmdir(HostPath(path).c_str()) != 0))
+        return false;
+    is_open = false;
+    return true;
+}
+
+
+// Like the library's, this takes over f, so f shouldn't be used after.
+File::File(SdFile f, const char*)
+{
+    if (f.is_open)
+        *this = HostOpen(f.isRoot() ? "/" : f.path, f.mode & ~(O_CREAT | O_EXCL | O_TRUNC));
+}
+
+
+uint32_t SdFile::dirBlock() const
+{
+    return FileBlocks(path);
+}
+
+
+uint8_t SdFile::isDir() const
+{
+    struct stat st;
+    return isRoot() || (HostStat(path, &st) && S_ISDIR(st.st_mode));
+}
+
+
+uint8_t SdFile::createContiguous(SdFile* dir, const char* name, uint32_t size)
+{
+    if ((size == 0) || !open(dir, name, O_CREAT | O_EXCL | O_WRITE))
+        return false;
+    return truncate(HostPath(path).c_str(), size) == 0;
+}
+
+
+// Like the library, a file with no data isn't contiguous.
+uint8_t SdFile::contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock)
+{
+    struct stat st;
+    if (!is_open || !HostStat(path, &st) || !S_ISREG(st.st_mode) || (st.st_size == 0))
+        return false;
+    *bgnBlock = FileBlocks(path);
+    *endBlock = *bgnBlock + (st.st_size - 1) / 512;
+    return true;
+}
+
+
+void File::rewindDirectory()
+{
+    if (f && f->dir)
+    {
+        rewinddir(f->dir);
+        f->pos = 0;
+    }
+}
@@ -0,0 +1,221 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Stand-in for the Arduino SD library, for the PC build. Instead of a
+ * card, files live in a directory on the host, host_sd_root. Only the
+ * parts the firmware uses are here, and they try to behave the way the
+ * real library does - for example, opening a file for writing leaves the
+ * position at the end, and directory listings skip "." and "..". Names
+ * aren't limited to 8.3, though, and they're case sensitive.
+ *
+ * The raw card, volume and SdFile classes do just enough for contiguous
+ * files. There are no real blocks, so each contiguous file gets a made-up
+ * range of them, and the raw card reads and writes the file at the
+ * matching offset. There are no directory entries either, so rename
+ * doesn't work. readDir() makes them up, but only names that fit in 8.3
+ * come back right.
+ */
+
+#pragma once
+
+#include "Arduino.h"
+#include <string>
+
+// Mode flags, with the SdFat library's values.
+#define O_READ 0x01
+#define O_RDONLY O_READ
+#define O_WRITE 0x02
+#define O_WRONLY O_WRITE
+#define O_RDWR (O_READ | O_WRITE)
+#define O_APPEND 0x04
+#define O_SYNC 0x08
+#define O_CREAT 0x10
+#define O_EXCL 0x20
+#define O_TRUNC 0x40
+
+#define FILE_READ O_READ
+#define FILE_WRITE (O_READ | O_WRITE | O_CREAT | O_APPEND)
+
+// The directory standing in for the card. Set it before calling setup().
+extern const char* host_sd_root;
+
+// The number of directory entries looked up, one for each part of a path
+// that SD.open() and friends walk, or one for SdFile::open(). On a card,
+// each can mean reading a directory block or more.
+extern unsigned long host_sd_lookups;
+
+struct HostFile;
+class SdFile;
+
+class File
+{
+public:
+    File() = default;
+    File(SdFile f, const char* name);
+
+    size_t write(uint8_t b);
+    size_t write(const uint8_t* buf, size_t size);
+    size_t write(const char* buf, size_t size) { return write((const uint8_t*)buf, size); }
+    int read();
+    int read(void* buf, uint16_t nbyte);
+    int peek();
+    int available();
+    void flush();
+    bool seek(uint32_t pos);
+    uint32_t position();
+    uint32_t size();
+    void close();
+    operator bool() { return f != nullptr; }
+
+    char* name();
+    bool isDirectory();
+    File openNextFile(uint8_t mode = O_RDONLY);
+    void rewindDirectory();
+
+private:
+    friend class SDClass;
+    friend File HostOpen(const std::string& path, uint8_t mode);
+    // Shared by copies, like the real File's SdFile pointer. close() frees
+    // it, so copies mustn't be used after that - same as on the Arduino.
+    HostFile* f = nullptr;
+};
+
+// SD.open() without counting any lookups, for when the library would
+// already have the directory entry in hand.
+File HostOpen(const std::string& path, uint8_t mode);
+
+
+class SDClass
+{
+public:
+    bool begin(uint8_t csPin);
+    File open(const char* filepath, uint8_t mode = FILE_READ);
+    bool exists(const char* filepath);
+    bool mkdir(const char* filepath);
+    bool remove(const char* filepath);
+    bool rmdir(const char* filepath);
+};
+
+extern SDClass SD;
+
+
+// Raw access classes. See above.
+#define SPI_FULL_SPEED 0
+#define SPI_HALF_SPEED 1
+#define DIR_NAME_DELETED 0xE5
+#define DIR_ATT_VOLUME_ID 0x08
+#define DIR_ATT_DIRECTORY 0x10
+
+struct dir_t
+{
+    uint8_t name[11];
+    uint8_t attributes;
+    uint8_t reservedNT;
+    uint8_t creationTimeTenths;
+    uint16_t creationTime;
+    uint16_t creationDate;
+    uint16_t lastAccessDate;
+    uint16_t firstClusterHigh;
+    uint16_t lastWriteTime;
+    uint16_t lastWriteDate;
+    uint16_t firstClusterLow;
+    uint32_t fileSize;
+};
+
+static inline uint8_t DIR_IS_SUBDIR(const dir_t* dir)
+{
+    return (dir->attributes & (DIR_ATT_VOLUME_ID | DIR_ATT_DIRECTORY)) == DIR_ATT_DIRECTORY;
+}
+
+class Sd2Card
+{
+public:
+    uint8_t init(uint8_t, uint8_t) { return true; }
+    uint8_t readBlock(uint32_t block, uint8_t* dst);
+    uint8_t writeBlock(uint32_t block, const uint8_t* src);
+    uint8_t writeStart(uint32_t block, uint32_t) { next_block = block; return true; }
+    uint8_t writeData(const uint8_t* src) { return writeBlock(next_block++, src); }
+    uint8_t writeStop() { return true; }
+
+private:
+    uint32_t next_block = 0;
+};
+
+class SdVolume
+{
+public:
+    uint8_t init(Sd2Card*) { return true; }
+    // The raw card goes around File's FILE*s, so they mustn't be holding
+    // on to anything.
+    static uint8_t* cacheClear()
+    {
+        static uint8_t block[512];
+        fflush(nullptr);
+        return block;
+    }
+    uint8_t clusterSizeShift() const { return 0; }
+    uint32_t dataStartBlock() const { return 0; }
+};
+
+class SdFile
+{
+public:
+    uint8_t open(SdFile* dir, const char* name, uint8_t mode);
+    uint8_t openRoot(SdVolume*) { path.clear(); is_open = true; rewind(); return true; }
+    uint8_t close() { is_open = false; return true; }
+    uint8_t isOpen() const { return is_open; }
+    uint32_t dirBlock() const;  // not a block, but different for each file
+    uint8_t dirIndex() const { return 0; }
+    uint8_t dirEntry(dir_t*) { return false; }
+    uint32_t firstCluster() const { return isRoot() ? 0 : dirBlock(); }
+    uint8_t isDir() const;
+    uint8_t isRoot() const { return path.empty(); }
+    uint32_t fileSize() const;
+    uint8_t seekSet(uint32_t pos);  // only for directories; File(SdFile) does files
+    uint32_t curPosition() const { return position; }
+    void rewind() { position = 0; last.clear(); }
+    int8_t readDir(dir_t* dir);
+    static void dirName(const dir_t& dir, char* name);
+    uint8_t makeDir(SdFile* dir, const char* name);
+    uint8_t rmDir();
+    uint8_t createContiguous(SdFile* dir, const char* name, uint32_t size);
+    uint8_t contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock);
+    static uint8_t remove(SdFile* dir, const char* name);
+
+private:
+    friend class File;
+    std::string path;       // relative to host_sd_root. Empty for the root.
+    uint8_t mode = 0;
+    bool is_open = false;
+    // A directory is read in name order. last is the name readDir() gave
+    // out last, so removing entries doesn't make it skip any, as on a
+    // card.
+    uint32_t position = 0;
+    std::string last;
+};
@@ -0,0 +1,1419 @@
+/* Copyright (c) 2024, Christopher Just
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ *    Redistributions in binary form must reproduce the above
+ *    copyright notice, this list of conditions and the following
+ *    disclaimer in the documentation and/or other materials
+ *    provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Benchmark for the disk controller protocol. It plays the 6502's part
+ * over the simulated bus, the way OS/SD.asm would, and reports how many
+ * bytes of payload each handshake carries and how long each command takes
+ * on this machine. The timings only mean anything relative to each other:
+ * they're the firmware's code running on a PC against a host directory,
+ * not an ATmega talking to an SD card. The handshake counts are exact.
+ *
+ * Usage: bench [directory]
+ * Without a directory it makes a scratch one in /tmp and removes it after.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Arduino.h"
+#include "SD.h"
+#include "HostBus.h"
+
+namespace fs = std::filesystem;
+
+// From DiskController.ino
+void setup();
+void loop();
+bool RunIdleTasks();
+
+// Values the 6502 uses; see OS/os3.inc.
+constexpr uint8_t O_RDONLY_65 = 0x01;
+constexpr uint8_t O_WRONLY_65 = 0x02;
+constexpr uint8_t O_RDWR_65 = 0x03;
+constexpr uint8_t O_CREAT_65 = 0x10;
+constexpr uint8_t O_TRUNC_65 = 0x20;
+constexpr uint8_t O_CONTIG_65 = 0x08;
+constexpr uint8_t SD_CMD_OPEN = 1;
+constexpr uint8_t SD_CMD_CLOSE = 2;
+constexpr uint8_t SD_CMD_STAT = 3;
+constexpr uint8_t SD_CMD_MKDIR = 6;
+constexpr uint8_t SD_CMD_CP = 7;
+constexpr uint8_t SD_CMD_MV = 8;
+constexpr uint8_t SD_CMD_RMTREE = 9;
+constexpr uint8_t SD_CMD_CPTREE = 10;
+constexpr uint8_t SD_CMD_TREEJOB = 11;
+constexpr uint8_t SD_CMD_STATS = 12;
+constexpr uint8_t SD_CMD_LOAD = 13;
+constexpr uint8_t SD_CMD_FALLOCATE = 14;
+constexpr uint8_t SD_CMD_OPENDIR = 15;
+constexpr uint8_t SD_CMD_CHDIR = 16;
+constexpr uint8_t SD_CMD_GETCWD = 17;
+constexpr uint8_t SD_CMD_COPY = 18;
+constexpr uint8_t SD_CMD_COPYJOB = 19;
+constexpr uint8_t SD_CMD_COPYCANCEL = 20;
+constexpr uint8_t SD_CMD_SUM = 21;
+constexpr uint8_t SD_CMD_GREP = 22;
+constexpr uint8_t SD_CMD_SPLICE = 23;
+constexpr uint8_t SD_CMD_SLURP = 24;
+constexpr uint8_t GREP_ICASE = 1;
+constexpr uint8_t P65_EBUSY_65 = 0x80 | 6;
+constexpr uint8_t P65_EINVAL_65 = 0x80 | 7;
+constexpr uint8_t P65_EAGAIN_65 = 0x80 | 10;
+constexpr uint8_t P65_EINTR_65 = 0x80 | 12;
+constexpr uint8_t P65_EBADF_65 = 0x80 | 16;
+constexpr uint8_t P65_EISDIR_65 = 0x80 | 21;
+constexpr uint8_t P65_ENOTDIR_65 = 0x80 | 20;
+constexpr uint8_t SEEK_CUR_65 = 0;
+constexpr uint8_t SEEK_SET_65 = 2;
+constexpr int StatSize = 43;
+
+constexpr int FileSize = 64 * 1024;
+constexpr int ProgramSize = 16 * 1024;
+constexpr int DirEntries = 32;
+constexpr int SubDirs = 2;
+constexpr int DirentSize = 18;
+constexpr int Chunk = 256;
+constexpr int SdBufLen = 32;    // SD_BUF_LEN in OS/os3.inc
+constexpr int MaxCwd = 32;
+constexpr int BigChunk = 2000;  // more than a block, and not lined up with them
+constexpr int Repeats = 200;
+constexpr int RecordSize = 16;
+constexpr int HeaderSize = 4;
+constexpr int LogFiles = 3;
+constexpr int LogLines = 2000;
+
+
+static void Fail(const char* what)
+{
+    fprintf(stderr, "bench: %s\n", what);
+    exit(1);
+}
+
+
+/* The simulated 6502. */
+
+static void Send(uint8_t b)
+{
+    host_bus.to_controller.push_back(b);
+}
+
+
+static void SendWord(uint16_t w)
+{
+    Send(w & 0xff);
+    Send(w >> 8);
+}
+
+
+// Lets the controller work through everything we've sent, then gives it a
+// moment of idle time, like the 6502 would between requests.
+static void Run()
+{
+    while (!host_bus.to_controller.empty())
+        loop();
+    RunIdleTasks();
+}
+
+
+static uint8_t Receive()
+{
+    if (host_bus.to_host.empty())
+        Fail("expected a reply from the controller");
+    uint8_t b = host_bus.to_host.front();
+    host_bus.to_host.pop_front();
+    return b;
+}
+
+
+// Unpacks n bytes of a packed reply, the way the 6502 does.
+static std::vector<uint8_t> ReceivePacked(int n)
+{
+    std::vector<uint8_t> out;
+    while ((int)out.size() < n)
+    {
+        uint8_t h = Receive();
+        if (h < 128)
+        {
+            for (int i = 0; i <= h; ++i)
+                out.push_back(Receive());
+        }
+        else
+        {
+            uint8_t b = Receive();
+            out.insert(out.end(), 257 - h, b);
+        }
+    }
+    if ((int)out.size() != n)
+        Fail("packed data unpacked to the wrong size");
+    return out;
+}
+
+
+// Reads one escaped char. Returns -1 at EOF and -2 for an error.
+static int ReceiveEscaped()
+{
+    uint8_t b = Receive();
+    if (b != 0x1b)
+        return b;
+    b = Receive();
+    if (b == 0x1b)
+        return b;
+    if (b == 0xff)
+        return -1;
+    Receive();  // error code
+    return -2;
+}
+
+
+static uint8_t BinaryCommand(uint8_t opcode, const std::vector<std::string>& args,
+                             uint8_t* reply = nullptr, int reply_len = 0)
+{
+    Send(0x70);
+    Send(opcode);
+    Send(args.size());
+    for (auto& arg : args)
+    {
+        Send(arg.size());
+        for (char c : arg)
+            Send(c);
+    }
+    Run();
+    uint8_t status = Receive();
+    if (!(status & 0x80))
+    {
+        for (int i = 0; i < reply_len; ++i)
+            reply[i] = Receive();
+    }
+    return status;
+}
+
+
+static void Open(int channel, uint8_t mode, const std::string& name)
+{
+    if (BinaryCommand(SD_CMD_OPEN, {std::string(1, channel), std::string(1, mode), name}) & 0x80)
+        Fail(("can't open " + name).c_str());
+}
+
+
+static void Close(int channel)
+{
+    BinaryCommand(SD_CMD_CLOSE, {std::string(1, channel)});
+}
+
+
+
+/* Benchmarks. Each one returns the number of commands it sent and the
+ * number of payload bytes they moved. Opening and closing files isn't
+ * counted.
+ */
+
+struct Counts
+{
+    unsigned long commands = 0;
+    unsigned long bytes = 0;
+};
+
+
+static Counts ReadGetc()
+{
+    Counts counts;
+    for (;;)
+    {
+        Send(0x10 | 1);
+        Run();
+        ++counts.commands;
+        if (ReceiveEscaped() < 0)
+            break;
+        ++counts.bytes;
+    }
+    return counts;
+}
+
+
+static Counts ReadEscaped()
+{
+    Counts counts;
+    for (bool eof = false; !eof; )
+    {
+        Send(0x40 | 1);
+        SendWord(Chunk);
+        Run();
+        ++counts.commands;
+        for (int i = 0; i < Chunk; ++i)
+        {
+            if (ReceiveEscaped() < 0)
+            {
+                eof = true;
+                break;
+            }
+            ++counts.bytes;
+        }
+    }
+    return counts;
+}
+
+
+static Counts ReadBulkBy(int chunk)
+{
+    Counts counts;
+    for (;;)
+    {
+        Send(0x60 | 1);
+        SendWord(chunk);
+        Run();
+        ++counts.commands;
+        if (Receive() != 0)
+            Fail("bulk read failed");
+        int n = Receive();
+        n |= Receive() << 8;
+        if (n == 0)
+            break;
+        for (int i = 0; i < n; ++i)
+            Receive();
+        counts.bytes += n;
+    }
+    return counts;
+}
+
+
+static Counts ReadBulk() { return ReadBulkBy(Chunk); }
+
+// What SD_GETC does now, filling its buffer a frame at a time.
+static Counts ReadGetcBuffered() { return ReadBulkBy(SdBufLen); }
+
+
+// Each byte of the test files, so the packed reads can be checked.
+static uint8_t DataByte(int i) { return i * 7; }
+static uint8_t SparseByte(int i) { return ((i % 64) < 16) ? DataByte(i) : ' '; }
+static uint8_t ProgramByte(int i) { return (i < ProgramSize / 4) ? DataByte(i) : 0; }
+static int DirFileSize(int i) { return i * 37; }    // 0 to 2 bytes of size
+
+
+static Counts ReadPacked(uint8_t (*expected)(int))
+{
+    Counts counts;
+    for (;;)
+    {
+        Send(0x80 | 1);
+        SendWord(Chunk);
+        Run();
+        ++counts.commands;
+        if (Receive() != 0)
+            Fail("packed read failed");
+        int n = Receive();
+        n |= Receive() << 8;
+        if (n == 0)
+            break;
+        std::vector<uint8_t> data = ReceivePacked(n);
+        for (int i = 0; i < n; ++i)
+            if (data[i] != expected(counts.bytes + i))
+                Fail("wrong data from packed read");
+        counts.bytes += n;
+    }
+    return counts;
+}
+
+
+static Counts ReadPackedData() { return ReadPacked(DataByte); }
+static Counts ReadPackedSparse() { return ReadPacked(SparseByte); }
+
+
+static Counts WritePutc()
+{
+    Counts counts;
+    for (int i = 0; i < FileSize; ++i)
+    {
+        Send(0x20 | 1);
+        Send(i);
+        Run();
+        ++counts.commands;
+        ++counts.bytes;
+    }
+    return counts;
+}
+
+
+static Counts WriteBlockBy(int chunk)
+{
+    Counts counts;
+    for (int i = 0; i < FileSize; i += chunk)
+    {
+        Send(0x50 | 1);
+        SendWord(chunk);
+        for (int j = 0; j < chunk; ++j)
+            Send(i + j);
+        Run();
+        ++counts.commands;
+        int n = Receive();
+        n |= Receive() << 8;
+        counts.bytes += n;
+    }
+    return counts;
+}
+
+
+static Counts WriteBlock() { return WriteBlockBy(Chunk); }
+
+// What SD_PUTC does now, sending its buffer each time it fills.
+static Counts WritePutcBuffered() { return WriteBlockBy(SdBufLen); }
+
+
+// Preallocates a file and writes it with O_CONTIG, in pieces big enough
+// for whole blocks to go straight to the card. Then checks what's there.
+static Counts WriteContiguous()
+{
+    Counts counts;
+    std::string size;
+    for (int i = 0; i < 4; ++i)
+        size += (char)(FileSize >> (8 * i));
+    if (BinaryCommand(SD_CMD_FALLOCATE, {"/bench/contig.bin", size}) != 0)
+        Fail("fallocate failed");
+    Open(1, O_WRONLY_65 | O_CONTIG_65, "/bench/contig.bin");
+
+    for (int i = 0; i < FileSize; )
+    {
+        int n = std::min((i == 0) ? 100 : BigChunk, FileSize - i);
+        Send(0x50 | 1);
+        SendWord(n);
+        for (int j = 0; j < n; ++j)
+            Send(i + j);
+        Run();
+        ++counts.commands;
+        int written = Receive();
+        written |= Receive() << 8;
+        if (written != n)
+            Fail("contiguous write came up short");
+        counts.bytes += n;
+        i += n;
+    }
+    Close(1);
+
+    FILE* fp = fopen((std::string(host_sd_root) + "/bench/contig.bin").c_str(), "rb");
+    if (!fp)
+        Fail("contiguous file went missing");
+    int i = 0;
+    for (int ch; (ch = fgetc(fp)) != EOF; ++i)
+        if ((i >= FileSize) || (ch != (uint8_t)i))
+            Fail("wrong data in contiguous file");
+    fclose(fp);
+    if (i != FileSize)
+        Fail("contiguous file is the wrong size");
+    return counts;
+}
+
+
+static void SendSeek(int32_t offset, uint8_t whence)
+{
+    Send(0x30 | 1);
+    for (int j = 0; j < 4; ++j)
+        Send(offset >> (8 * j));
+    Send(whence);
+    Run();
+    if (Receive() != 0)
+        Fail("seek failed");
+    for (int j = 0; j < 4; ++j)
+        Receive();
+}
+
+
+static Counts Seek()
+{
+    Counts counts;
+    std::mt19937 random(65);
+    for (int i = 0; i < Repeats; ++i)
+    {
+        SendSeek(random() % FileSize, SEEK_SET_65);
+
+        Send(0x10 | 1);
+        Run();
+        if (ReceiveEscaped() < 0)
+            Fail("read after seek failed");
+        counts.commands += 2;
+        ++counts.bytes;
+    }
+    return counts;
+}
+
+
+// What a program reading fixed-size records does: read a record's header,
+// back up and read the whole record, then skip ahead to the next one.
+static Counts SeekRecords()
+{
+    Counts counts;
+    for (int offset = 0; offset < Repeats * RecordSize; offset += RecordSize)
+    {
+        for (int size : {HeaderSize, RecordSize})
+        {
+            Send(0x40 | 1);
+            SendWord(size);
+            Run();
+            for (int i = 0; i < size; ++i)
+                if (ReceiveEscaped() != (uint8_t)((offset + i) * 7))
+                    Fail("wrong data after seek");
+            counts.bytes += size;
+            if (size == HeaderSize)
+                SendSeek(-HeaderSize, SEEK_CUR_65);
+        }
+        counts.commands += 3;
+    }
+    return counts;
+}
+
+
+static Counts Stat()
+{
+    Counts counts;
+    uint8_t reply[StatSize];
+    for (int i = 0; i < Repeats; ++i)
+    {
+        if (BinaryCommand(SD_CMD_STAT, {"/bench/data.bin"}, reply, StatSize) != 0)
+            Fail("stat failed");
+        ++counts.commands;
+        counts.bytes += StatSize;
+    }
+    return counts;
+}
+
+
+// Opens and closes every file in /bench/dir, by its full path.
+static Counts OpenFiles()
+{
+    Counts counts;
+    for (int i = 0; i < DirEntries; ++i)
+    {
+        Open(1, O_RDONLY_65, "/bench/dir/FILE" + std::to_string(i) + ".TXT");
+        Close(1);
+        counts.commands += 2;
+    }
+    return counts;
+}
+
+
+static void Chdir(const std::string& dir, const char* expect)
+{
+    char cwd[MaxCwd + 1] = {};
+    if ((BinaryCommand(SD_CMD_CHDIR, {dir}) != 0) ||
+        (BinaryCommand(SD_CMD_GETCWD, {}, (uint8_t*)cwd, MaxCwd) != 0) || strcmp(cwd, expect))
+        Fail(("can't change to " + dir).c_str());
+}
+
+
+// The same, but by paths relative to the working directory.
+static Counts OpenRelative()
+{
+    Counts counts;
+    Chdir("/bench//./dir/", "/bench/dir");
+    for (int i = 0; i < DirEntries; ++i)
+    {
+        Open(1, O_RDONLY_65, "FILE" + std::to_string(i) + ".TXT");
+        Close(1);
+        counts.commands += 2;
+    }
+    Open(1, O_RDONLY_65, "../dir/SUB0/../FILE1.TXT");
+    Close(1);
+    if (BinaryCommand(SD_CMD_CHDIR, {"FILE0.TXT"}) != P65_ENOTDIR_65)
+        Fail("changed to a file");
+
+    // Deeper than the directory cache.
+    if (BinaryCommand(SD_CMD_MKDIR, {"/bench/deep/a/b/c/d/e"}) != 0)
+        Fail("can't make deep directories");
+    Chdir("/bench/deep/a/b/c/d/e", "/bench/deep/a/b/c/d/e");
+    Chdir("../../..", "/bench/deep/a/b");
+    Chdir("c/d", "/bench/deep/a/b/c/d");
+    Chdir("/", "/");
+    return counts;
+}
+
+
+static Counts ListDirectory()
+{
+    Counts counts;
+    Open(1, O_RDONLY_65, "/bench/dir");
+    counts = ReadBulk();
+    Close(1);
+    return counts;
+}
+
+
+
+// Reads a sorted listing to the end, checking the order as it goes.
+static Counts ReadSorted(std::vector<std::string>& names)
+{
+    Counts counts;
+    std::string last;
+    int last_type = 3;
+    for (;;)
+    {
+        Send(0x60 | 1);
+        SendWord(DirentSize);
+        Run();
+        ++counts.commands;
+        if (Receive() != 0)
+            Fail("sorted listing failed");
+        int n = Receive();
+        n |= Receive() << 8;
+        if (n == 0)
+            break;
+        if (n != DirentSize)
+            Fail("sorted listing sent part of a dirent");
+        char d[DirentSize];
+        for (int i = 0; i < n; ++i)
+            d[i] = Receive();
+        std::string name = d;
+        int type = d[13];
+        if ((type > last_type) || ((type == last_type) && (name <= last)))
+            Fail("sorted listing is out of order");
+        last = name;
+        last_type = type;
+        names.push_back(name);
+        counts.bytes += n;
+    }
+    return counts;
+}
+
+
+static void OpenSorted(const std::string& pattern, const std::string& after)
+{
+    if (BinaryCommand(SD_CMD_OPENDIR, {std::string(1, 1), "/bench/dir", pattern, after}) != 2)
+        Fail("can't open sorted listing");
+}
+
+
+// The whole directory, then only the names that match a pattern, then the
+// rest of the directory after the first few entries.
+static Counts ListSorted()
+{
+    std::vector<std::string> all, some, rest;
+    OpenSorted("", "");
+    Counts counts = ReadSorted(all);
+    Close(1);
+    if ((all.size() != DirEntries + SubDirs) || (all[0] != "SUB0") || (all[2] != "FILE0.TXT"))
+        Fail("sorted listing has the wrong entries");
+
+    OpenSorted("file1?.*", "");
+    ReadSorted(some);
+    Close(1);
+    if ((some.size() != 10) || (some[0] != "FILE10.TXT"))
+        Fail("pattern matched the wrong entries");
+
+    std::string after(DirentSize, '\0');
+    after.replace(0, all[4].size(), all[4]);
+    after[13] = 1;
+    OpenSorted("", after);
+    ReadSorted(rest);
+    Close(1);
+    if (!std::equal(rest.begin(), rest.end(), all.begin() + 5) || (rest.size() != all.size() - 5))
+        Fail("listing didn't pick up where it stopped");
+    return counts;
+}
+
+
+
+// Reads the directory open on channel 1 with listing reads, the way
+// sd_readdir does, unpacking each entry into a struct dirent. Counts the
+// bytes of dirent that were unpacked.
+static Counts ListCompact()
+{
+    Counts counts;
+    std::vector<std::string> names;
+    for (;;)
+    {
+        Send(0x90 | 1);
+        SendWord(SdBufLen);
+        Run();
+        ++counts.commands;
+        if (Receive() != 0)
+            Fail("listing read failed");
+        int n = Receive();
+        n |= Receive() << 8;
+        if (n == 0)
+            break;
+        if (n > SdBufLen)
+            Fail("listing read sent too much");
+        for (int i = 0; i < n; )
+        {
+            uint8_t header = Receive();
+            int len = header & 0x0f;
+            int size_len = header >> 5;
+            i += 1 + len + size_len;
+            if ((len == 0) || (size_len > 4) || (i > n))
+                Fail("listing read sent a bad entry");
+            std::string name;
+            for (int j = 0; j < len; ++j)
+                name += (char)Receive();
+            uint32_t size = 0;
+            for (int j = 0; j < size_len; ++j)
+                size |= (uint32_t)Receive() << (8 * j);
+            bool is_dir = name.compare(0, 3, "SUB") == 0;
+            uint32_t expected = is_dir ? 0 : DirFileSize(atoi(name.c_str() + 4));
+            if ((((header & 0x10) != 0) != is_dir) || (size != expected))
+                Fail("listing read sent the wrong type or size");
+            names.push_back(name);
+            counts.bytes += DirentSize;
+        }
+    }
+    std::sort(names.begin(), names.end());
+    if ((names.size() != DirEntries + SubDirs) || (names[0] != "FILE0.TXT") ||
+        (std::unique(names.begin(), names.end()) != names.end()))
+        Fail("listing read sent the wrong entries");
+    return counts;
+}
+
+
+
+static Counts Load()
+{
+    Counts counts;
+    for (int i = 0; i < Repeats / 10; ++i)
+    {
+        if (BinaryCommand(SD_CMD_LOAD, {"/bench/prog.prg"}) != 0)
+            Fail("load failed");
+        uint16_t address = Receive();
+        address |= Receive() << 8;
+        int n = Receive();
+        n |= Receive() << 8;
+        if ((address != 0x1000) || (n != ProgramSize))
+            Fail("load sent the wrong header");
+        std::vector<uint8_t> program = ReceivePacked(n);
+        for (int j = 0; j < n; ++j)
+            if (program[j] != ProgramByte(j))
+                Fail("load sent the wrong program");
+        ++counts.commands;
+        counts.bytes += n;
+    }
+    return counts;
+}
+
+
+
+// Checks that the copy of data.bin at path is all there.
+static void CheckCopy(const std::string& path)
+{
+    FILE* fp = fopen((std::string(host_sd_root) + path).c_str(), "rb");
+    if (!fp)
+        Fail("copy went missing");
+    int i = 0;
+    for (int ch; (ch = fgetc(fp)) != EOF; ++i)
+        if ((i >= FileSize) || (ch != DataByte(i)))
+            Fail("wrong data in copy");
+    fclose(fp);
+    if (i != FileSize)
+        Fail("copy is the wrong size");
+}
+
+
+static Counts CopyFile()
+{
+    Counts counts;
+    for (int i = 0; i < 4; ++i)
+    {
+        if (BinaryCommand(SD_CMD_CP, {"/bench/data.bin", "/bench/copy.bin"}) != 0)
+            Fail("cp failed");
+        ++counts.commands;
+        counts.bytes += FileSize;
+    }
+    CheckCopy("/bench/copy.bin");
+    return counts;
+}
+
+
+// Copies in the background, polling for progress, then checks that a
+// cancelled copy leaves nothing behind.
+static Counts CopyJob()
+{
+    Counts counts;
+    uint8_t reply[9];
+    uint32_t done, total;
+    if (BinaryCommand(SD_CMD_COPY, {"/bench/data.bin", "/bench/job.bin"}) != 0)
+        Fail("couldn't start copy job");
+    ++counts.commands;
+    uint32_t last = 0;
+    uint8_t status;
+    do
+    {
+        if (BinaryCommand(SD_CMD_COPYJOB, {}, reply, sizeof(reply)) != 0)
+            Fail("copy job status failed");
+        ++counts.commands;
+        status = reply[0];
+        memcpy(&done, reply + 1, 4);
+        memcpy(&total, reply + 5, 4);
+        if ((total != FileSize) || (done < last) || (done > total))
+            Fail("copy job progress is off");
+        last = done;
+    } while (status == P65_EAGAIN_65);
+    if ((status != 0) || (done != total))
+        Fail("copy job failed");
+    counts.bytes += done;
+    CheckCopy("/bench/job.bin");
+
+    if ((BinaryCommand(SD_CMD_COPY, {"/bench/data.bin", "/bench/cancel.bin"}) != 0) ||
+        (BinaryCommand(SD_CMD_COPY, {"/bench/data.bin", "/bench/busy.bin"}) == 0) ||
+        (BinaryCommand(SD_CMD_COPYCANCEL, {}) != 0) ||
+        (BinaryCommand(SD_CMD_COPYJOB, {}, reply, sizeof(reply)) != 0) ||
+        (reply[0] != P65_EINTR_65) ||
+        fs::exists(fs::path(host_sd_root) / "bench" / "cancel.bin"))
+        Fail("copy job didn't cancel");
+    counts.commands += 4;
+    return counts;
+}
+
+
+
+// Bit at a time, to check the controller's tables.
+static uint32_t Crc32(int start, int n)
+{
+    uint32_t crc = 0xffffffff;
+    for (int i = start; i < start + n; ++i)
+    {
+        crc ^= DataByte(i);
+        for (int j = 0; j < 8; ++j)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+
+static uint16_t Crc16(int start, int n)
+{
+    uint16_t crc = 0;
+    for (int i = start; i < start + n; ++i)
+    {
+        crc ^= DataByte(i) << 8;
+        for (int j = 0; j < 8; ++j)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+
+static std::string Long(uint32_t n)
+{
+    return std::string((const char*)&n, 4);
+}
+
+
+// Sums all of data.bin and then ranges of it, on the controller.
+static Counts Sum()
+{
+    Counts counts;
+    for (int i = 0; i < Repeats / 10; ++i)
+    {
+        int offset = (i == 0) ? 0 : i * 1000 + 7;
+        int n = (i == 0) ? FileSize : i * 3000;
+        uint8_t reply[10];
+        if (BinaryCommand(SD_CMD_SUM, {"/bench/data.bin", "\x03", Long(offset), Long(n)},
+                          reply, sizeof(reply)) != 0)
+            Fail("sum failed");
+        uint32_t crc32, count;
+        uint16_t crc16;
+        memcpy(&crc32, reply, 4);
+        memcpy(&crc16, reply + 4, 2);
+        memcpy(&count, reply + 6, 4);
+        n = std::min(n, FileSize - offset);  // the last few run past the end
+        if ((count != (uint32_t)n) || (crc32 != Crc32(offset, n)) || (crc16 != Crc16(offset, n)))
+            Fail("sum is wrong");
+        ++counts.commands;
+        counts.bytes += n;
+    }
+    return counts;
+}
+
+
+
+static std::string LogLine(int file, int i)
+{
+    char line[40];
+    if ((i + file) % 97 == 0)
+        snprintf(line, sizeof(line), "%05d Error: code %d\n", i, i % 7);
+    else
+        snprintf(line, sizeof(line), "%05d status ok\n", i);
+    return line;
+}
+
+
+// Where the lines that match "error*CODE" start in each log file.
+static std::vector<uint32_t> LogMatches(int file)
+{
+    std::vector<uint32_t> offsets;
+    uint32_t offset = 0;
+    for (int i = 0; i < LogLines; ++i)
+    {
+        std::string line = LogLine(file, i);
+        if (line.find("Error: code") != std::string::npos)
+            offsets.push_back(offset);
+        offset += line.size();
+    }
+    return offsets;
+}
+
+
+// Reads the GrepMatch records off channel 1 a frame at a time, the way
+// SD_GETC does. A record for line 0 starts a new file.
+static void ReadMatches(Counts& counts, std::vector<std::pair<std::string, std::vector<uint32_t>>>& files)
+{
+    std::vector<uint8_t> data;
+    for (;;)
+    {
+        Send(0x60 | 1);
+        SendWord(SdBufLen);
+        Run();
+        ++counts.commands;
+        if (Receive() != 0)
+            Fail("grep read failed");
+        int n = Receive();
+        n |= Receive() << 8;
+        if (n == 0)
+            break;
+        for (int i = 0; i < n; ++i)
+            data.push_back(Receive());
+    }
+    for (size_t i = 0; i + 8 <= data.size(); )
+    {
+        uint32_t line, offset;
+        memcpy(&line, &data[i], 4);
+        memcpy(&offset, &data[i + 4], 4);
+        i += 8;
+        if (line == 0)
+        {
+            files.push_back({std::string((const char*)&data[i], offset), {}});
+            i += offset;
+        }
+        else
+        {
+            if (files.empty())
+                files.push_back({"", {}});
+            files.back().second.push_back(offset);
+        }
+    }
+}
+
+
+// Searches one log file, then the whole directory of them.
+static Counts Grep()
+{
+    Counts counts;
+    std::vector<std::pair<std::string, std::vector<uint32_t>>> files;
+    if (BinaryCommand(SD_CMD_GREP, {"\x01", "/bench/logs/LOG0.TXT", "error*CODE", "\x01"}) != 0)
+        Fail("grep failed");
+    ReadMatches(counts, files);
+    Close(1);
+    if ((files.size() != 1) || (files[0].second != LogMatches(0)))
+        Fail("grep found the wrong lines");
+
+    files.clear();
+    if (BinaryCommand(SD_CMD_GREP, {"\x01", "/bench/logs", "error*CODE", "\x01"}) != 0)
+        Fail("grep failed");
+    ReadMatches(counts, files);
+    Close(1);
+    if (files.size() != LogFiles)
+        Fail("grep missed a file");
+    for (auto& file : files)
+    {
+        int i = file.first[3] - '0';
+        if ((file.first != "LOG" + std::to_string(i) + ".TXT") || (file.second != LogMatches(i)))
+            Fail("grep found the wrong lines");
+    }
+
+    // Case matters without GREP_ICASE.
+    files.clear();
+    if (BinaryCommand(SD_CMD_GREP, {"\x01", "/bench/logs/LOG0.TXT", "error", std::string(1, 0)}) != 0)
+        Fail("grep failed");
+    ReadMatches(counts, files);
+    Close(1);
+    if (!files.empty())
+        Fail("grep ignored case");
+
+    counts.bytes = (LogFiles + 2) * fs::file_size(fs::path(host_sd_root) / "bench" / "logs" / "LOG0.TXT");
+    return counts;
+}
+
+
+
+static uint32_t SpliceChannels(int src, int dst, uint32_t count)
+{
+    uint32_t moved;
+    if (BinaryCommand(SD_CMD_SPLICE, {std::string(1, src), std::string(1, dst), Long(count)},
+                      (uint8_t*)&moved, sizeof(moved)) != 0)
+        Fail("splice failed");
+    return moved;
+}
+
+
+// Checks that the file at path holds data.bin's bytes from start, after
+// header.
+static void CheckSplice(const std::string& path, const std::string& header, int start)
+{
+    FILE* fp = fopen((std::string(host_sd_root) + path).c_str(), "rb");
+    if (!fp)
+        Fail("splice went missing");
+    int i = 0;
+    for (int ch; (ch = fgetc(fp)) != EOF; ++i)
+    {
+        int expect = (i < (int)header.size()) ? (uint8_t)header[i] :
+                     DataByte(start + (i - header.size()) % (FileSize - start));
+        if (ch != expect)
+            Fail("wrong data in splice");
+    }
+    fclose(fp);
+    if (i != (int)header.size() + 2 * (FileSize - start))
+        Fail("splice is the wrong size");
+}
+
+
+// Splices from part way through data.bin to a write-only file, then
+// after some bytes the 6502 wrote to a read-write one, twice over.
+static Counts Splice()
+{
+    Counts counts;
+    constexpr int start = 100;
+    Open(1, O_RDONLY_65, "/bench/data.bin");
+    Open(2, O_WRONLY_65 | O_CREAT_65 | O_TRUNC_65, "/bench/splice.bin");
+    SendSeek(start, SEEK_SET_65);
+    for (int i = 0; i < 2; ++i)
+    {
+        if ((SpliceChannels(1, 2, 1000) != 1000) ||
+            (SpliceChannels(1, 2, 0xffffffff) != FileSize - start - 1000) ||
+            (SpliceChannels(1, 2, 1000) != 0))
+            Fail("splice moved the wrong amount");
+        counts.commands += 3;
+        counts.bytes += FileSize - start;
+        SendSeek(start, SEEK_SET_65);
+    }
+    Close(2);
+    CheckSplice("/bench/splice.bin", "", start);
+
+    std::string header = "header";
+    Open(2, O_RDWR_65 | O_CREAT_65 | O_TRUNC_65, "/bench/splice.bin");
+    Send(0x50 | 2);
+    SendWord(header.size());
+    for (char c : header)
+        Send(c);
+    Run();
+    Receive();
+    Receive();
+    for (int i = 0; i < 2; ++i)
+    {
+        if (SpliceChannels(1, 2, 0xffffffff) != FileSize - start)
+            Fail("splice moved the wrong amount");
+        ++counts.commands;
+        counts.bytes += FileSize - start;
+        SendSeek(start, SEEK_SET_65);
+    }
+    if ((BinaryCommand(SD_CMD_SPLICE, {"\x01", "\x01", Long(1)}) != P65_EINVAL_65) ||
+        (BinaryCommand(SD_CMD_SPLICE, {"\x01", "\x03", Long(1)}) != P65_EBADF_65) ||
+        (BinaryCommand(SD_CMD_SPLICE, {"\x01", std::string(1, 0), Long(1)}) != P65_EBADF_65))
+        Fail("splice took bad channels");
+    Close(2);
+    Close(1);
+    CheckSplice("/bench/splice.bin", header, start);
+    return counts;
+}
+
+
+
+// Reads a file with one CMD_SLURP. Returns the file's size.
+static uint32_t Slurp(const std::string& name, uint16_t max, std::vector<uint8_t>& data)
+{
+    if (BinaryCommand(SD_CMD_SLURP, {name, std::string((const char*)&max, 2)}) != 0)
+        Fail("slurp failed");
+    uint32_t size = 0;
+    for (int i = 0; i < 4; ++i)
+        size |= (uint32_t)Receive() << (8 * i);
+    int n = Receive();
+    n |= Receive() << 8;
+    data = ReceivePacked(n);
+    return size;
+}
+
+
+// Reads every file in dir the way a program loading its resources would,
+// then a piece of a big file, and checks the errors.
+static Counts SlurpFiles()
+{
+    Counts counts;
+    std::vector<uint8_t> data;
+    for (int i = 0; i < DirEntries; ++i)
+    {
+        std::string name = "/bench/dir/FILE" + std::to_string(i) + ".TXT";
+        if (Slurp(name, 0x1000, data) != (uint32_t)DirFileSize(i) ||
+            (data.size() != (size_t)DirFileSize(i)))
+            Fail("slurp sent the wrong size");
+        for (int j = 0; j < DirFileSize(i); ++j)
+            if (data[j] != (uint8_t)j)
+                Fail("slurp sent the wrong data");
+        ++counts.commands;
+        counts.bytes += data.size();
+    }
+
+    if ((Slurp("/bench/data.bin", 1000, data) != FileSize) || (data.size() != 1000))
+        Fail("slurp didn't stop at max");
+    for (int j = 0; j < 1000; ++j)
+        if (data[j] != DataByte(j))
+            Fail("slurp sent the wrong data");
+    ++counts.commands;
+    counts.bytes += data.size();
+
+    if ((BinaryCommand(SD_CMD_SLURP, {"/bench/dir", Long(16).substr(0, 2)}) != P65_EISDIR_65) ||
+        (BinaryCommand(SD_CMD_SLURP, {"/bench/none.txt", Long(16).substr(0, 2)}) == 0))
+        Fail("slurp read something that isn't a file");
+    return counts;
+}
+
+
+
+// Writes count bytes of data to a channel with one $50, and returns how
+// many the controller says it wrote.
+static int WriteTo(int channel, const std::string& data)
+{
+    Send(0x50 | channel);
+    SendWord(data.size());
+    for (char c : data)
+        Send(c);
+    Run();
+    int n = Receive();
+    n |= Receive() << 8;
+    return n;
+}
+
+
+// Reads up to n bytes from channel 1 with one bulk read.
+static std::string ReadFrom(int n)
+{
+    Send(0x60 | 1);
+    SendWord(n);
+    Run();
+    if (Receive() != 0)
+        Fail("bulk read failed");
+    int count = Receive();
+    count |= Receive() << 8;
+    std::string data;
+    for (int i = 0; i < count; ++i)
+        data += (char)Receive();
+    return data;
+}
+
+
+static std::string FileContents(const std::string& path)
+{
+    std::string data;
+    FILE* fp = fopen((std::string(host_sd_root) + path).c_str(), "rb");
+    if (!fp)
+        Fail("file went missing");
+    for (int ch; (ch = fgetc(fp)) != EOF; )
+        data += (char)ch;
+    fclose(fp);
+    return data;
+}
+
+
+// Writes to a file opened read-only, which mustn't change it, and to one
+// opened read-write, which must.
+static Counts WriteModes()
+{
+    Counts counts;
+    std::string hello = "hello world";
+    Open(1, O_WRONLY_65 | O_CREAT_65 | O_TRUNC_65, "/bench/hello.txt");
+    if (WriteTo(1, hello) != (int)hello.size())
+        Fail("write came up short");
+    Close(1);
+
+    Open(1, O_RDONLY_65, "/bench/hello.txt");
+    if (WriteTo(1, "XY") != 0)
+        Fail("wrote to a read-only file");
+    if (ReadFrom(hello.size()) != hello)
+        Fail("read-only file changed in the cache");
+    Close(1);
+    if (FileContents("/bench/hello.txt") != hello)
+        Fail("read-only file changed");
+    counts.commands += 2;
+
+    Open(1, O_RDWR_65, "/bench/hello.txt");
+    SendSeek(0, SEEK_SET_65);   // opening for writing starts at the end
+    if (WriteTo(1, "XY") != 2)
+        Fail("write to a read-write file came up short");
+    SendSeek(0, SEEK_SET_65);
+    if (FileContents("/bench/hello.txt") != "XYllo world")
+        Fail("seek didn't write back the cached block");
+    if (ReadFrom(hello.size()) != "XYllo world")
+        Fail("read-write file reads back wrong");
+    Close(1);
+    if (FileContents("/bench/hello.txt") != "XYllo world")
+        Fail("read-write file wasn't written");
+    counts.commands += 3;
+    counts.bytes += 2 + 2 * hello.size();
+    return counts;
+}
+
+
+
+// Renaming rewrites directory entries on the card, which the host build
+// can't do, but it has to refuse before that if either name is open.
+static Counts RenameOpen()
+{
+    Counts counts;
+    Open(1, O_WRONLY_65 | O_CREAT_65 | O_TRUNC_65, "/bench/busy.txt");
+    Close(1);
+
+    Open(1, O_RDONLY_65, "/bench/busy.txt");
+    if (BinaryCommand(SD_CMD_MV, {"/bench/busy.txt", "/bench/moved.txt"}) != P65_EBUSY_65)
+        Fail("renamed a file that's open");
+    Close(1);
+    Open(2, O_RDONLY_65, "/bench/data.bin");
+    if (BinaryCommand(SD_CMD_MV, {"/bench/busy.txt", "/bench/data.bin"}) != P65_EBUSY_65)
+        Fail("renamed over a file that's open");
+    Close(2);
+    if (!fs::exists(fs::path(host_sd_root) / "bench" / "busy.txt") ||
+        fs::exists(fs::path(host_sd_root) / "bench" / "moved.txt"))
+        Fail("rename of an open file changed something");
+    counts.commands += 2;
+    return counts;
+}
+
+
+
+// Polls a tree job until it's done, and returns how many polls that took.
+// Each one gives the job a single idle step.
+static int WaitTreeJob(Counts& counts, uint16_t entries)
+{
+    uint8_t reply[3];
+    int polls = 0;
+    do
+    {
+        if (BinaryCommand(SD_CMD_TREEJOB, {}, reply, sizeof(reply)) != 0)
+            Fail("tree job status failed");
+        ++polls;
+    } while (reply[0] == P65_EAGAIN_65);
+    counts.commands += polls;
+    if ((reply[0] != 0) || (reply[1] + 256 * reply[2] != entries))
+        Fail("tree job failed");
+    return polls;
+}
+
+
+// Copies a tree in the background and then removes the copy. No step may
+// copy more than a block, so the big file takes a poll per block.
+static Counts CopyTree()
+{
+    Counts counts;
+    if (BinaryCommand(SD_CMD_CPTREE, {"/bench/tree", "/bench/treecopy"}) != 0)
+        Fail("couldn't start cptree");
+    ++counts.commands;
+    if (WaitTreeJob(counts, 4) < FileSize / 512)
+        Fail("cptree copied more than a block in one step");
+    CheckCopy("/bench/treecopy/SUB/DATA.BIN");
+    if (FileContents("/bench/treecopy/SUB/DEEP/SMALL.BIN") !=
+        FileContents("/bench/tree/SUB/DEEP/SMALL.BIN"))
+        Fail("wrong data in tree copy");
+    counts.bytes += FileSize;
+
+    if (BinaryCommand(SD_CMD_RMTREE, {"/bench/treecopy"}) != 0)
+        Fail("couldn't start rmtree");
+    ++counts.commands;
+    WaitTreeJob(counts, 5);
+    if (fs::exists(fs::path(host_sd_root) / "bench" / "treecopy"))
+        Fail("rmtree left the tree behind");
+    return counts;
+}
+
+
+
+struct Test
+{
+    const char* name;
+    Counts (*fn)();
+    const char* file;  // opened on channel 1 first, if not null
+    uint8_t mode;
+};
+
+static const Test tests[] =
+{
+    {"read getc",    ReadGetc,      "/bench/data.bin", O_RDONLY_65},
+    {"getc buffered", ReadGetcBuffered, "/bench/data.bin", O_RDONLY_65},
+    {"read escaped", ReadEscaped,   "/bench/data.bin", O_RDONLY_65},
+    {"read bulk",    ReadBulk,      "/bench/data.bin", O_RDONLY_65},
+    {"read packed",  ReadPackedData, "/bench/data.bin", O_RDONLY_65},
+    {"sparse bulk",  ReadBulk,      "/bench/sparse.bin", O_RDONLY_65},
+    {"sparse packed", ReadPackedSparse, "/bench/sparse.bin", O_RDONLY_65},
+    {"write putc",   WritePutc,     "/bench/out.bin",  O_WRONLY_65 | O_CREAT_65 | O_TRUNC_65},
+    {"putc buffered", WritePutcBuffered, "/bench/out.bin", O_WRONLY_65 | O_CREAT_65 | O_TRUNC_65},
+    {"write block",  WriteBlock,    "/bench/out.bin",  O_WRONLY_65 | O_CREAT_65 | O_TRUNC_65},
+    {"write contig", WriteContiguous, nullptr,         0},
+    {"write modes",  WriteModes,    nullptr,           0},
+    {"rename open",  RenameOpen,    nullptr,           0},
+    {"seek",         Seek,          "/bench/data.bin", O_RDONLY_65},
+    {"seek records", SeekRecords,   "/bench/data.bin", O_RDONLY_65},
+    {"stat",         Stat,          nullptr,           0},
+    {"open files",   OpenFiles,     nullptr,           0},
+    {"open relative", OpenRelative, nullptr,           0},
+    {"list dir",     ListDirectory, nullptr,           0},
+    {"list sorted",  ListSorted,    nullptr,           0},
+    {"list compact", ListCompact,   "/bench/dir",      O_RDONLY_65},
+    {"load program", Load,          nullptr,           0},
+    {"copy file",    CopyFile,      nullptr,           0},
+    {"copy job",     CopyJob,       nullptr,           0},
+    {"copy tree",    CopyTree,      nullptr,           0},
+    {"sum",          Sum,           nullptr,           0},
+    {"grep",         Grep,          nullptr,           0},
+    {"splice",       Splice,        nullptr,           0},
+    {"slurp",        SlurpFiles,    nullptr,           0},
+};
+
+
+static void MakeTestFile(const fs::path& path, int size, uint8_t (*byte)(int))
+{
+    FILE* fp = fopen(path.c_str(), "wb");
+    if (!fp)
+        Fail("can't create test file");
+    for (int i = 0; i < size; ++i)
+        fputc(byte(i), fp);
+    fclose(fp);
+}
+
+
+static void MakeTestFiles(const fs::path& root)
+{
+    fs::create_directories(root / "bench" / "dir");
+    MakeTestFile(root / "bench" / "data.bin", FileSize, DataByte);
+    MakeTestFile(root / "bench" / "sparse.bin", FileSize, SparseByte);
+    FILE* fp = fopen((root / "bench" / "prog.prg").c_str(), "wb");
+    if (!fp)
+        Fail("can't create test program");
+    fputc(0x00, fp);    // load address $1000
+    fputc(0x10, fp);
+    for (int i = 0; i < ProgramSize; ++i)
+        fputc(ProgramByte(i), fp);
+    fclose(fp);
+    for (int i = 0; i < SubDirs; ++i)
+        fs::create_directories(root / "bench" / "dir" / ("SUB" + std::to_string(SubDirs - 1 - i)));
+    fs::create_directories(root / "bench" / "tree" / "SUB" / "DEEP");
+    MakeTestFile(root / "bench" / "tree" / "SUB" / "DATA.BIN", FileSize, DataByte);
+    MakeTestFile(root / "bench" / "tree" / "SUB" / "DEEP" / "SMALL.BIN", 100, DataByte);
+    fs::create_directories(root / "bench" / "logs");
+    for (int i = 0; i < LogFiles; ++i)
+    {
+        fp = fopen((root / "bench" / "logs" / ("LOG" + std::to_string(i) + ".TXT")).c_str(), "wb");
+        if (!fp)
+            Fail("can't create test log");
+        for (int j = 0; j < LogLines; ++j)
+            fputs(LogLine(i, j).c_str(), fp);
+        fclose(fp);
+    }
+    for (int i = 0; i < DirEntries; ++i)
+    {
+        std::string name = "FILE" + std::to_string(i) + ".TXT";
+        fp = fopen((root / "bench" / "dir" / name).c_str(), "wb");
+        if (!fp)
+            Fail("can't create test directory");
+        for (int j = 0; j < DirFileSize(i); ++j)
+            fputc(j, fp);
+        fclose(fp);
+    }
+}
+
+
+static int Cleanup(const fs::path& root, bool scratch)
+{
+    if (scratch)
+        fs::remove_all(root);
+    else
+        fs::remove_all(root / "bench");
+    return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+    fs::path root;
+    bool scratch = (argc < 2);
+    if (scratch)
+    {
+        char path[] = "/tmp/p65benchXXXXXX";
+        if (!mkdtemp(path))
+            Fail("can't make a scratch directory");
+        root = path;
+    }
+    else
+    {
+        root = argv[1];
+    }
+    std::string root_string = root.string();
+    host_sd_root = root_string.c_str();
+    MakeTestFiles(root);
+
+    setup();
+
+    printf("%-14s %9s %11s %9s %10s %10s %8s\n",
+           "test", "commands", "handshakes", "bytes", "bytes/hs", "usec/cmd", "lookups");
+    for (auto& test : tests)
+    {
+        if (test.file)
+            Open(1, test.mode, test.file);
+
+        unsigned long handshakes = host_bus.handshakes;
+        unsigned long lookups = host_sd_lookups;
+        auto start = std::chrono::steady_clock::now();
+        Counts counts = test.fn();
+        auto end = std::chrono::steady_clock::now();
+        handshakes = host_bus.handshakes - handshakes;
+        lookups = host_sd_lookups - lookups;
+
+        if (test.file)
+            Close(1);
+
+        double usec = std::chrono::duration<double, std::micro>(end - start).count();
+        printf("%-14s %9lu %11lu %9lu %10.3f %10.2f %8lu\n", test.name, counts.commands,
+               handshakes, counts.bytes, (double)counts.bytes / handshakes,
+               usec / counts.commands, lookups);
+    }
+
+    // What the controller's own counters made of all that.
+    static const char* const names[] =
+        {"other", "getc", "putc", "seek", "read", "write", "bulk", "command"};
+    uint32_t reply[4];
+    if (BinaryCommand(SD_CMD_STATS, {std::string(1, 8)}, (uint8_t*)reply, sizeof(reply)) != 0)
+    {
+        printf("\ncontroller built without P65_STATS\n");
+        return Cleanup(root, scratch);
+    }
+    printf("\n%-14s %9s %11s %10s %10s\n", "controller", "count", "bytes", "total us", "max us");
+    for (int i = 0; i < 8; ++i)
+    {
+        BinaryCommand(SD_CMD_STATS, {std::string(1, i)}, (uint8_t*)reply, sizeof(reply));
+        printf("%-14s %9u %11u %10u %10u\n", names[i], reply[0], reply[1], reply[2], reply[3]);
+    }
+    BinaryCommand(SD_CMD_STATS, {std::string(1, 8)}, (uint8_t*)reply, sizeof(reply));
+    printf("sd %u us, bus wait %u us, idle %u us, over %u ms\n",
+           reply[0], reply[1], reply[2], reply[3]);
+
+    return Cleanup(root, scratch);
+}
@@ -35,7 +35,7 @@
 .import dev_getc, dev_writestr, dev_putc, dev_open, dev_close, dev_ioctl, set_filename, set_filemode, init_devices
 .import dev_read
 .import TokenizeCommandLine, test_tokenizer
-.import load_program
+.import load_program, fallocate, sd_opendir, sd_readdir, chdir, getcwd
 
 ; TODO
 ;
@@ -219,6 +219,7 @@ skip:
 		DispatchCommandLine m_command, process_m
 		DispatchCommandLine load_command, ProcessLoadCommand
 		DispatchCommandLine ls_command, ProcessLsCommand
+		DispatchCommandLine cd_command, ProcessCdCommand
 		;DispatchCommandLine mkdir_command, ProcessMkdirCommand
 		DispatchCommandLine more_command, ProcessMoreCommand
 		;DispatchCommandLine rm_command, ProcessRmCommand
@@ -229,12 +230,18 @@ skip:
 		DispatchCommandLine uptime_command, UptimeCommand
 		DispatchCommandLine cls_command, ProcessCLSCommand
 
-		; OK, well maybe it's a program to be run. We can try running from current directory or from /c
+		; OK, well maybe it's a program to be run. We can try running from current directory or from /
 		lda argv0L
 		ldx argv0H
 		jsr load_program
 		cmp #0
+		beq loaded
+		cmp #P65_ENOENT
 		bne error
+		jsr load_from_root
+		cmp #0
+		bne error
+loaded:
 		;jsr print_program_addresses
 		jsr execute_program
 		cmp #0				; check execute_program return value
@@ -323,6 +330,7 @@ program_return:
 b_command:		.asciiz "b"
 g_command:		.asciiz "g"		
 ls_command:		.asciiz "kls"	; kernel ls
+cd_command:		.asciiz "cd"
 mkdir_command:	.asciiz "mkdir"
 rmdir_command:	.asciiz "rmdir"
 rm_command:		.asciiz "rm"
@@ -436,46 +444,50 @@ errtable:
 ; KLS is a fast and simple directory lister. It doesn't have the formatting 
 ; of the external cutil/ls but it also doesn't have any loading time, so I'm
 ; keeping it around.
+; kls [dir [pattern]]. The disk controller sorts the listing, and leaves 
+; out any names that don't match pattern.
 .proc ProcessLsCommand
 		lda #2
 		jsr setdevice
+		stz ptr1		; start at the top of the listing
+		stz ptr1h
+		stz ptr2		; no pattern
+		stz ptr2h
 
 		; we need to write each argument, separated by spaces
 		lda argc
 		cmp #1
 		bne ckarg2
-		; if there was only one arg, we need to stick a "/" string somewhere.
+		; if there was only one arg, we need to stick a "." string somewhere.
 		; We can use the command buffer since we don't need it anymore.
-		lda #'/'
+		lda #'.'
 		sta buffer
 		stz buffer+1
 		lda #<buffer
 		ldx #>buffer
 		jsr set_filename
-		bra set_mode
+		bra open
 ckarg2:
 		cmp #2
 		beq syntax_ok
+		cmp #3
+		bne bad_syntax
+		lda argv2L
+		sta ptr2
+		lda argv2H
+		sta ptr2h
+		bra syntax_ok
+bad_syntax:
 		lda #P65_ESYNTAX
 		bra error
 syntax_ok:
 		lda argv1L
 		ldx argv1H
 		jsr set_filename
-set_mode:
-		lda #O_RDONLY
-		jsr set_filemode
-
-		jsr dev_open
-		; we should really check if the result is a directory...
+open:
+		jsr sd_opendir		; fails if it isn't a directory
 		cmp #0
 		bmi error
-		beq read_loop
-		cmp #2
-		beq read_loop
-
-		lda #P65_ENOTDIR
-		bra error
 
 		; OK, now we need some place to write a dirent to. Let's again use the
 		; buffer. We need to read & process individual dirents until we hit
@@ -486,18 +498,16 @@ read_loop:
 		;lda #'*'
 		;jsr sendchar
 
-		lda #<buffer	; calling dev_read may change the value stored in 
+		lda #<buffer	; printstring may change the value stored in 
 		sta ptr1		; ptr1, so we always refresh it.
 		lda #>buffer
 		sta ptr1h
 
-		lda #18
-		ldx #0
-		jsr dev_read
+		jsr sd_readdir
 		cpx #0
-		bne done
-		cmp #18
-		bne done
+		bne error
+		cmp #0
+		beq done
 
 		; OK, filename is 1st element of dirent, should just be at buffer.
 		printstring buffer
@@ -574,12 +584,77 @@ cleanup:
 
 
 
+; Loads the program named by argv0 from the root directory, for when it 
+; isn't in the working directory. Names that already start with / and 
+; ones too long for scratchbuffer aren't tried again.
+; Returns the error code in A.
+; Uses A,X,Y and whatever load_program does
+.proc load_from_root
+		lda argv0L
+		sta ptr1
+		lda argv0H
+		sta ptr1h
+		ldy #0
+		lda (ptr1),y
+		cmp #'/'
+		beq not_found
+		lda #'/'
+		sta scratchbuffer
+copy:	lda (ptr1),y
+		sta scratchbuffer+1,y
+		beq copied
+		iny
+		cpy #30
+		bne copy
+not_found:
+		lda #P65_ENOENT
+		rts
+copied:
+		lda #<scratchbuffer
+		ldx #>scratchbuffer
+		jmp load_program
+.endproc
+
+
+
+; cd [dir] changes the disk controller's working directory. Without an 
+; argument, it prints the working directory.
+.proc ProcessCdCommand
+		lda argc
+		cmp #2
+		beq change
+		cmp #1
+		beq print
+		lda #P65_ESYNTAX
+		bra error
+change:
+		lda argv1L
+		ldx argv1H
+		jsr chdir
+		cmp #0
+		bne error
+		jmp _commandline
+print:
+		lda #<scratchbuffer		; SD_MAX_CWD bytes, just big enough
+		sta ptr1
+		lda #>scratchbuffer
+		sta ptr1h
+		jsr getcwd
+		cmp #0
+		bne error
+		printstring scratchbuffer
+		printstring crlf
+		jmp _commandline
+error:
+		jsr perror
+		jmp _commandline
+.endproc
+
+
+
 ; Loads a program into memory but does not immediately launch it. It can then
 ; be launched with the g or r commands.
 .proc ProcessLoadCommand
-		; setup
-		lda #O_RDONLY
-		jsr set_filemode
 		lda argc
 		cmp #2
 		beq filename_ok
@@ -605,14 +680,50 @@ error:
 ; memory?  but buffer pos is still a problem!
 .proc ProcessSaveCommand
 		; setup
-		lda #(O_WRONLY | O_TRUNC | O_CREAT)
-		jsr set_filemode
 		lda argc
 		cmp #2
 		beq filename_ok
 		lda #P65_ESYNTAX
 		bra error
 filename_ok:
+		; We know the size up front, so preallocate the file and write it
+		; with O_CONTIG. That's the 2-byte address plus everything from
+		; the program address up to and including program_end, which is
+		; what the loop below writes.
+		sec
+		lda		program_end_low
+		sbc		program_address_low
+		sta		tmp1
+		lda		program_end_high
+		sbc		program_address_high
+		sta		tmp2
+		stz		tmp3
+		stz		tmp4
+		clc
+		lda		tmp1
+		adc		#3
+		sta		tmp1
+		lda		tmp2
+		adc		#0
+		sta		tmp2
+		lda		tmp3
+		adc		#0
+		sta		tmp3
+		lda		#<tmp1
+		sta		ptr2
+		lda		#>tmp1
+		sta		ptr2h
+		lda		argv1L
+		ldx		argv1H
+		jsr		fallocate
+		ldy		#(O_WRONLY | O_CONTIG)
+		cmp		#0
+		beq		set_mode
+		ldy		#(O_WRONLY | O_TRUNC | O_CREAT)	; no room in one piece. Write it the usual way.
+set_mode:
+		tya
+		jsr		set_filemode
+
 		lda argv1L
 		ldx argv1H
 		jsr set_filename
@@ -37,14 +37,23 @@
 .include "OS3.inc"
 .export SD_IOCTL, SD_GETC, SD_PUTC, SD_OPEN, SD_CLOSE, SD_SEEK
 .export SD_READ, SD_WRITE
+.export sd_cmd_begin, sd_cmd_byte, sd_cmd_string, sd_cmd_data, sd_cmd_end, sd_cmd_read
+.export sd_command, sd_unpack, sd_opendir, sd_readdir, sd_opengrep
+.export sd_sync, sd_splice
 .import _print_hex, _print_char, dev_write_hex
 
 		
 .proc SD_IOCTL
-			; Only current IOCTL for SD is init, A=0
+			; IOCTLs for SD are init, A=0, and flush, A=1
+			cmp #IO_FLUSH
+			beq flush
 			cmp #0
 			bne error
 			; Initialization 
+			ldx		#SD_DATA_CHANNELS
+clear:		stz		sd_buf_mode-1,x	; every channel's buffer starts empty
+			dex
+			bne		clear
 			lda 	#%00001111
 			sta		VIA_PCR		; set CA2 high, CA1 positive edge trigger
 			stz		VIA_DDRA	; start in read mode
@@ -55,6 +64,14 @@
 			lda #0				; return P65_EOK
 			tax
 			rts
+flush:
+			; Sends anything SD_PUTC has buffered.
+			phy
+			jsr		sd_sync
+			ply
+			lda #0
+			tax
+			rts
 error:
 			; Invalid ioctl number
 			lda #P65_EINVAL
@@ -102,6 +119,66 @@ wait:
 
 
 
+; Burst writes. WriteByte switches port A to output and back for every
+; byte. For a multi-byte command we switch it once with Begin_Write_Burst,
+; send each byte with WriteBurstByte (or the inline Write_Burst_Byte), and
+; switch back to read mode with End_Write_Burst. The peripheral only drives
+; the bus after we set CA2 low in ReadByte, which is always after
+; End_Write_Burst.
+.macro Begin_Write_Burst
+		ldx		#$ff			; DDR to write mode
+		stx		VIA_DDRA
+.endmacro
+
+.macro End_Write_Burst
+		stz		VIA_DDRA		; back to read mode
+.endmacro
+
+; Sends the byte in A without changing the port direction. Uses only A.
+.macro Write_Burst_Byte
+		sta		VIA_DATAA
+
+		lda		#%00001101
+		sta		VIA_PCR			; set CA2 low, CA1 still positive edge trigger
+
+		Wait_CA1 				; CA1 high means peripheral has read the data
+
+		lda		#%00001110
+		sta		VIA_PCR			; set CA2 high, CA1 negative edge trigger
+
+		Wait_CA1 				; CA1 trigger means peripheral is ready
+.endmacro
+
+
+
+; Inline version of ReadByte for the bulk copy loops. Stores the byte at
+; (ptr1),y and doesn't touch X or Y.
+.macro Read_To_Buffer
+		lda		#%00001101
+		sta		VIA_PCR			; set CA2 low, CA1 still positive edge trigger
+
+		Wait_CA1 				; CA1 high means peripheral has prepared the data
+
+		lda		VIA_DATAA
+		sta		(ptr1),y
+
+		lda		#%00001110
+		sta		VIA_PCR			; set CA2 high, CA1 negative edge trigger
+
+		Wait_CA1 				; CA1 trigger means peripheral has released the bus
+.endmacro
+
+
+
+; Byte to be written is in A. Port A must already be in write mode.
+; Uses A
+.proc WriteBurstByte
+		Write_Burst_Byte
+		rts
+.endproc
+
+
+
 .proc ReadByte
 ; problem: how do we make sure CA1 is low before we do this? or are we just safe?
 		lda		#%00001101
@@ -121,6 +198,266 @@ wait:
 .endproc
 
 
+;=============================================================================
+; SD channel buffers
+;=============================================================================
+; On a data channel, SD_GETC and SD_PUTC go through a buffer of SD_BUF_LEN
+; bytes, so that programs working a character at a time don't pay for a 
+; whole command per byte. A channel's buffer holds either bytes read ahead 
+; of the program or bytes it has written that the controller hasn't seen 
+; yet, never both. SD_GETC fills it with one bulk read ($60), and SD_PUTC 
+; sends it with one multibyte write ($50) when it's full.
+; Everything else that uses the channel - SD_READ, SD_WRITE, SD_SEEK, 
+; SD_OPEN, SD_CLOSE and the IO_FLUSH ioctl - empties the buffer first, so
+; the controller's file position is where the program thinks it is.
+; sd_readdir uses the buffer too, for directory entries in compact form.
+; Channel 0 is the command channel and isn't buffered.
+;=============================================================================
+
+.assert sd_buffers + SD_DATA_CHANNELS * SD_BUF_LEN <= $0500, error, "SD buffers overlap program memory"
+.assert sd_buf_end + SD_DATA_CHANNELS <= CURRENT_DEVICE, error, "SD buffer tables overlap devtab variables"
+
+.rodata
+; Offset of each data channel's buffer in sd_buffers, indexed by channel - 1.
+SD_BUF_BASE:
+.repeat SD_DATA_CHANNELS, I
+.byte I * SD_BUF_LEN
+.endrepeat
+.code
+
+
+; Empties the current channel's buffer. Buffered writes are sent. Bytes 
+; read ahead are dropped, and their count is returned in A so that the 
+; caller can allow for them. Returns 0 if there weren't any.
+; Uses A,X,Y
+.proc sd_drop
+			ldx		DEVICE_CHANNEL
+			beq		none
+			lda		sd_buf_mode-1,x
+			stz		sd_buf_mode-1,x
+			cmp		#SD_BUF_WRITE
+			beq		flush
+			cmp		#SD_BUF_READ
+			bne		none
+			lda		sd_buf_end-1,x		; read ahead = end - pos
+			sec
+			sbc		sd_buf_pos-1,x
+			rts
+flush:		jsr		sd_flush
+none:		lda		#0
+			rts
+.endproc
+
+
+; Like sd_drop, but seeks back over bytes that were read ahead, for callers
+; that carry on from the current position.
+; Uses A,X,Y
+.proc sd_sync
+			jsr		sd_drop
+			cmp		#0
+			beq		done
+			eor		#$ff				; offset is -A
+			ina
+			pha
+			Begin_Write_Burst
+			lda		DEVICE_CHANNEL
+			ora		#$30
+			jsr		WriteBurstByte
+			pla
+			jsr		WriteBurstByte
+			ldy		#3
+high:		lda		#$ff
+			jsr		WriteBurstByte
+			dey
+			bne		high
+			lda		#0					; SEEK_CUR
+			jsr		WriteBurstByte
+			End_Write_Burst
+			jsr		ReadByte			; status
+			cmp		#P65_EOK
+			bne		done
+			ldy		#4					; new position, which we don't need
+skip:		jsr		ReadByte
+			dey
+			bne		skip
+done:		rts
+.endproc
+
+
+; Sends the current channel's buffered writes and empties the buffer. The
+; channel stays in SD_BUF_WRITE mode.
+; Uses A,X,Y
+.proc sd_flush
+			ldx		DEVICE_CHANNEL
+			lda		sd_buf_end-1,x
+			sec
+			sbc		SD_BUF_BASE-1,x
+			beq		done
+			pha
+			Begin_Write_Burst
+			lda		DEVICE_CHANNEL
+			ora		#$50
+			jsr		WriteBurstByte
+			pla
+			jsr		WriteBurstByte		; count, low byte
+			lda		#0
+			jsr		WriteBurstByte
+			ldx		DEVICE_CHANNEL
+			ldy		SD_BUF_BASE-1,x
+loop:		lda		sd_buffers,y
+			jsr		WriteBurstByte
+			iny
+			tya
+			cmp		sd_buf_end-1,x
+			bne		loop
+			lda		SD_BUF_BASE-1,x
+			sta		sd_buf_end-1,x
+			End_Write_Burst
+			jsr		ReadByte			; # of bytes written. Like SD_PUTC, we
+			jsr		ReadByte			; have nowhere to report a short write.
+done:		rts
+.endproc
+
+
+; Refills the current channel's buffer with one read command, which is in
+; A: $60 for a bulk read or $90 for a listing read. Returns with carry set
+; at end of file or on an error, with A = 0 or the error, and X = 
+; DEVICE_CHANNEL.
+; Uses A,X,Y
+.proc sd_fill
+			pha
+			Begin_Write_Burst
+			pla
+			ora		DEVICE_CHANNEL
+			jsr		WriteBurstByte
+			lda		#SD_BUF_LEN
+			jsr		WriteBurstByte
+			lda		#0
+			jsr		WriteBurstByte
+			End_Write_Burst
+			jsr		ReadByte			; status
+			cmp		#P65_EOK
+			bne		fail
+			jsr		ReadByte			; count. Never more than SD_BUF_LEN,
+			pha							; so the high byte is 0.
+			jsr		ReadByte
+			ldx		DEVICE_CHANNEL
+			lda		SD_BUF_BASE-1,x
+			sta		sd_buf_pos-1,x
+			sta		sd_buf_end-1,x
+			tay
+			pla
+			beq		fail				; empty frame means end of file
+			clc
+			adc		sd_buf_end-1,x
+			sta		sd_buf_end-1,x
+loop:		jsr		ReadByte
+			sta		sd_buffers,y
+			iny
+			tya
+			ldx		DEVICE_CHANNEL
+			cmp		sd_buf_end-1,x
+			bne		loop
+			clc
+			rts
+fail:		ldx		DEVICE_CHANNEL
+			sec
+			rts
+.endproc
+
+
+; Reads the next entry of the directory open on the current channel into 
+; the struct dirent at ptr1. The controller sends entries in a compact 
+; form (see CompactDirent in the controller), several at a time, and they
+; wait in the channel's buffer like bytes read ahead by SD_GETC.
+; Returns 1 in A for an entry and 0 at the end of the directory, with 
+; X = 0, or an error in A with X = $FF.
+; Uses A,X,Y, tmp1, tmp2
+.proc sd_readdir
+			ldx		DEVICE_CHANNEL
+			bne		start
+			lda		#P65_EBADF
+			ldx		#$ff
+			rts
+start:		lda		sd_buf_mode-1,x
+			cmp		#SD_BUF_LIST
+			beq		check
+			jsr		sd_drop
+			ldx		DEVICE_CHANNEL
+			lda		#SD_BUF_LIST
+			sta		sd_buf_mode-1,x
+			lda		SD_BUF_BASE-1,x
+			sta		sd_buf_pos-1,x
+			sta		sd_buf_end-1,x
+check:		lda		sd_buf_pos-1,x
+			cmp		sd_buf_end-1,x
+			bne		unpack
+			lda		#$90
+			jsr		sd_fill				; entries are never split between fills
+			bcs		stop
+			lda		sd_buf_pos-1,x
+
+unpack:		tax							; X indexes sd_buffers from here on
+			lda		sd_buffers,x		; header
+			inx
+			sta		tmp1
+			and		#$0f
+			sta		tmp2				; length of the name
+			ldy		#0
+name:		cpy		tmp2
+			beq		pad
+			lda		sd_buffers,x
+			sta		(ptr1),y
+			inx
+			iny
+			bra		name
+pad:		lda		#0					; d_name is 13 bytes, zero filled
+			sta		(ptr1),y
+			iny
+			cpy		#13
+			bne		pad
+
+			lda		tmp1				; d_type is 2 for a directory, 1 for a file
+			and		#$10
+			beq		file
+			lda		#1
+file:		ina
+			sta		(ptr1),y
+			iny
+
+			lda		tmp1				; # of bytes of d_size that were sent
+			lsr
+			lsr
+			lsr
+			lsr
+			lsr
+			sta		tmp2
+size:		lda		tmp2				; the rest are 0
+			beq		store
+			dec		tmp2
+			lda		sd_buffers,x
+			inx
+store:		sta		(ptr1),y
+			iny
+			cpy		#18
+			bne		size
+
+			txa
+			ldx		DEVICE_CHANNEL
+			sta		sd_buf_pos-1,x
+			lda		#1
+			ldx		#0
+			rts
+
+stop:		cmp		#0					; end of the directory, or an error
+			beq		done
+			ldx		#$ff
+			rts
+done:		tax
+			rts
+.endproc
+
+
 ;=============================================================================
 ; SD_GETC
 ; Read a character from the SD card device.
@@ -130,11 +467,46 @@ wait:
 ; If no character is available, returns with carry clear
 ; If a character was read, carry is set. A contains the character, X = 0
 ; If EOF, carry is set, AX contains $FFFF
+; Data channels are read through their buffer; see "SD channel buffers".
 ; Uses A,X
 ;=============================================================================
 .proc SD_GETC
-		lda DEVICE_CHANNEL
-		ora #$10
+		ldx DEVICE_CHANNEL
+		beq unbuffered
+		phy
+		lda sd_buf_mode-1,x
+		cmp #SD_BUF_READ
+		beq check
+		jsr sd_sync			; switching from writing, or starting out
+		ldx DEVICE_CHANNEL
+		lda #SD_BUF_READ
+		sta sd_buf_mode-1,x
+		lda SD_BUF_BASE-1,x
+		sta sd_buf_pos-1,x
+		sta sd_buf_end-1,x
+check:
+		ldy sd_buf_pos-1,x
+		tya
+		cmp sd_buf_end-1,x
+		bne take
+		lda #$60
+		jsr sd_fill
+		bcs buffered_eof
+		ldy sd_buf_pos-1,x
+take:
+		lda sd_buffers,y
+		inc sd_buf_pos-1,x
+		ply
+		sec
+		ldx #$00
+		rts
+buffered_eof:
+		ply
+		lda #$ff
+		bra eof
+
+unbuffered:
+		lda #$10			; channel 0
 		jsr	WriteByte
 		;lda	#$19		; "gimme a byte" command
 		;jsr	WriteByte
@@ -170,18 +542,51 @@ eof:
 ;=============================================================================
 ; Write the character in A to the current SD DEVICE_CHANNEL. 
 ; Returns the character written in A.
+; Data channels are written through their buffer, which goes to the 
+; controller when it's full, or on IO_FLUSH, seek or close.
 ; Uses A,X
 ;=============================================================================
 .proc SD_PUTC
-		phy					; save y, and save A in y
-		tay
-		lda DEVICE_CHANNEL
-		ora #$20
+		phy					; save y
+		ldx DEVICE_CHANNEL
+		beq unbuffered
+		pha
+		lda sd_buf_mode-1,x
+		cmp #SD_BUF_WRITE
+		beq put
+		jsr sd_sync			; switching from reading, or starting out
+		ldx DEVICE_CHANNEL
+		lda #SD_BUF_WRITE
+		sta sd_buf_mode-1,x
+		lda SD_BUF_BASE-1,x
+		sta sd_buf_end-1,x
+put:
+		ldy sd_buf_end-1,x
+		pla
+		sta sd_buffers,y
+		inc sd_buf_end-1,x
+		pha
+		lda SD_BUF_BASE-1,x	; full?
+		clc
+		adc #SD_BUF_LEN
+		cmp sd_buf_end-1,x
+		bne done
+		jsr sd_flush
+done:
+		pla					; return character written
+		ply
+		rts
+
+unbuffered:
+		tay					; save A in y
+		Begin_Write_Burst
+		lda #$20			; channel 0
 		;jsr WriteByte
 		;lda #$18 		; "send a byte" command
-		jsr WriteByte
+		jsr WriteBurstByte
 		tya
-		jsr WriteByte
+		jsr WriteBurstByte
+		End_Write_Burst
 		tya					; return character written
 		ply					; restore y
 		rts
@@ -189,88 +594,347 @@ eof:
 
 
 
-; writes a pointer to SD_PUTC without the trailing 0
-; argument is a pointer, which doesn't live in page 0.
-.macro 		sd_writestr pointer
-.scope
-			lda pointer
-			sta ptr1
-			lda pointer+1
-			sta ptr1h
-			ldy #0
-loop:		lda (ptr1),y
-			beq done
-			jsr SD_PUTC
+;=============================================================================
+; Binary commands
+;=============================================================================
+; Commands for the disk controller like open, close, stat, etc. are sent as
+; a single frame on the command channel:
+;     $70, opcode, # of args, then for each arg a length byte & that many bytes
+; The controller replies with a status byte and, if the status is >= 0, a 
+; payload of a fixed size for that opcode (see the SD_CMD_* values in 
+; os3.inc). 
+; A command is sent with sd_cmd_begin, one sd_cmd_byte or sd_cmd_string 
+; call per argument, and sd_cmd_end. The whole frame goes out as one write
+; burst, so nothing else can use the bus in between. Any payload is then 
+; read with sd_cmd_read.
+;=============================================================================
+
+; Opcode in A, number of args in X.
+; Uses A,X
+.proc sd_cmd_begin
+			phx
+			pha
+			Begin_Write_Burst
+			lda		#$70
+			jsr		WriteBurstByte
+			pla
+			jsr		WriteBurstByte	; opcode
+			pla
+			jmp		WriteBurstByte	; # of args
+.endproc
+
+
+; Sends a 1-byte arg. Value in A.
+; Uses A
+.proc sd_cmd_byte
+			pha
+			lda		#1
+			jsr		WriteBurstByte	; length
+			pla
+			jmp		WriteBurstByte
+.endproc
+
+
+; Sends a string arg, without the terminating 0. Pointer in AX.
+; Strings are cut off at 255 characters.
+; Uses A,X,Y, ptr1
+.proc sd_cmd_string
+			sta		ptr1
+			stx		ptr1h
+			ldy		#0
+find_end:	lda		(ptr1),y
+			beq		found_end
 			iny
-			bne loop
-done:		nop
-.endscope
-.endmacro
-			
+			bne		find_end
+			dey						; too long. send the first 255.
+found_end:	tya
+			tax						; length in X
+			jsr		WriteBurstByte
+			cpx		#0
+			beq		done
+			ldy		#0
+loop:		lda		(ptr1),y
+			jsr		WriteBurstByte
+			iny
+			dex
+			bne		loop
+done:		rts
+.endproc
+
 
+; Sends a binary arg, like a 4-byte size. Pointer in AX, length in Y.
+; Uses A,X,Y, ptr1
+.proc sd_cmd_data
+			sta		ptr1
+			stx		ptr1h
+			tya
+			tax						; length in X
+			jsr		WriteBurstByte
+			cpx		#0
+			beq		done
+			ldy		#0
+loop:		lda		(ptr1),y
+			jsr		WriteBurstByte
+			iny
+			dex
+			bne		loop
+done:		rts
+.endproc
+
+
+; Finishes the frame and reads the status byte into A.
+; Uses A,X
+.proc sd_cmd_end
+			End_Write_Burst
+			jmp		ReadByte
+.endproc
+
+
+; Reads a reply payload. Buffer pointer in ptr1, # of bytes in A. 0 means
+; 256.
+; Uses A,Y, tmp1
+.proc sd_cmd_read
+			sta		tmp1
+			ldy		#0
+loop:		Read_To_Buffer
+			iny
+			cpy		tmp1
+			bne		loop
+			rts
+.endproc
+
+
+
+
+; Sends a whole frame that the caller has put together, and reads the 
+; reply. This lets programs use commands the OS doesn't have a routine for.
+; ptr1 points to the frame, starting with the opcode. Frame length in A.
+; ptr2 points to a buffer for the reply payload. Payload length in X.
+; Returns the status in A. The payload is only read if the status is >= 0.
+; Uses A,X,Y, ptr1, tmp1, tmp2
+.proc sd_command
+			sta		tmp1
+			stx		tmp2
+			Begin_Write_Burst
+			lda		#$70
+			jsr		WriteBurstByte
+			ldy		#0
+loop:		cpy		tmp1
+			beq		sent
+			lda		(ptr1),y
+			jsr		WriteBurstByte
+			iny
+			bne		loop
+sent:		jsr		sd_cmd_end		; status in A
+			cmp		#0
+			bmi		done
+			ldx		tmp2
+			beq		done
+			pha
+			lda		ptr2
+			sta		ptr1
+			lda		ptr2h
+			sta		ptr1h
+			txa
+			jsr		sd_cmd_read
+			pla
+done:		rts
+.endproc
 
 ;=============================================================================
 ; SD_OPEN
 ;=============================================================================
 ; Open a file on the currently set DEVICE_CHANNEL.
 ; DEVICE_FILEMODE and DEVICE_FILENAME should be set with appropriate values.
-; To open a file, we send an open message to the command channel (channel 0).
-; For this driver, we're building up a command string starting with "o", the
-; channel number, the file mode, and the filename.
-; Filemode is byte value, not a character representation.
-; The file mode is now a 1-byte set of UNIX-like flags, and probably not 
-; printable. But also not ever 0!
+; We send an SD_CMD_OPEN command with the channel number, the file mode,
+; and the filename.
+; The file mode is a 1-byte set of UNIX-like flags.
+; Returns the file type in A (X = 0), or an error code in A (X = $FF).
 ; Uses: A,X,Y
 ;       ptr1
 ;=============================================================================
 .proc SD_OPEN
-			lda 	DEVICE_CHANNEL
-			pha		; store device channel for later
-			stz		DEVICE_CHANNEL	; send to command channel to send open.
-			tay		; device channel in y
-			
-			lda		#'o'
-			jsr		SD_PUTC
-			
-			tya		; channel back in a
-			clc
-			adc		#'0'	; convert number to ascii on the cheap
-			jsr 	SD_PUTC
-			
+			jsr		sd_drop			; for whatever was open here before
+			lda		#SD_CMD_OPEN
+			ldx		#3
+			jsr		sd_cmd_begin
+			lda		DEVICE_CHANNEL
+			jsr		sd_cmd_byte
 			lda		DEVICE_FILEMODE
-			jsr		SD_PUTC
-			
-			sd_writestr DEVICE_FILENAME
-			
-			lda		#0			; explicit end-of-string
-			jsr		SD_PUTC
-			lda     #0
-			jsr     SD_PUTC		; end of array-of-strings
-			
-			jsr		SD_GETC			; read back the return code
-			; return code is in A.  1 is true, 0 is false
+			jsr		sd_cmd_byte
+			lda		DEVICE_FILENAME
+			ldx		DEVICE_FILENAME+1
+			jsr		sd_cmd_string
+			jsr		sd_cmd_end		; read back the return code
 			
 			cmp #0			; A >= 0 is success
 			bpl return_ok
 			ldx #$ff
-			bra return				; 
+			rts
 return_ok:
 			tay						; save result code
 			ldx DEVICE_OFFSET
 			lda DEVICE_FILEMODE
 			sta DEVTAB + DEVENTRY::FILEMODE, X	; save device filemode to DEVTAB
 			tya						; restore result code
-			;lda #P65_EOK				; We're just returning EOK
 			ldx #0
+			rts
+.endproc
+
 
-return:		ply						; pull dev channel off of stack
-			sty		DEVICE_CHANNEL	; restore device channel
+
+;=============================================================================
+; sd_opendir
+;=============================================================================
+; Opens directory DEVICE_FILENAME on the current DEVICE_CHANNEL for a sorted
+; listing: directories first, then files, each in name order. Reads return
+; the same 18-byte dirents as a directory opened with SD_OPEN. The disk 
+; controller does the sorting, so a listing of any size can be read 
+; without keeping it in memory.
+; ptr2 points to a pattern the names have to match, where ? stands for any
+; character and * for any run of them, or is 0 to list everything.
+; ptr1 points to a dirent to start after, to pick up a listing where an
+; earlier one stopped, or is 0 to start at the top.
+; Returns the file type (2) in A (X = 0), or an error code in A (X = $FF).
+; Uses: A,X,Y
+;       ptr1
+;=============================================================================
+.proc sd_opendir
+			jsr		sd_drop			; for whatever was open here before
+			lda		ptr1h			; sd_cmd_string needs ptr1
+			pha
+			lda		ptr1
+			pha
+			lda		#SD_CMD_OPENDIR
+			ldx		#4
+			jsr		sd_cmd_begin
+			lda		DEVICE_CHANNEL
+			jsr		sd_cmd_byte
+			lda		DEVICE_FILENAME
+			ldx		DEVICE_FILENAME+1
+			jsr		sd_cmd_string
+			lda		ptr2
+			ldx		ptr2h
+			bne		pattern
+			cmp		#0
+			bne		pattern
+			jsr		WriteBurstByte	; no pattern. A is 0, an empty arg.
+			bra		after
+pattern:	jsr		sd_cmd_string
+after:		pla
+			plx
+			bne		dirent
+			cmp		#0
+			bne		dirent
+			jsr		WriteBurstByte	; start at the top
+			bra		send
+dirent:		ldy		#18
+			jsr		sd_cmd_data
+send:		jsr		sd_cmd_end		; read back the return code
+
+			cmp		#0				; A >= 0 is success
+			bpl		return_ok
+			ldx		#$ff
+			rts
+return_ok:
+			ldx		DEVICE_OFFSET
+			lda		#O_RDONLY
+			sta		DEVTAB + DEVENTRY::FILEMODE, X	; mark the channel open
+			lda		#2
+			ldx		#0
+			rts
+.endproc
+
+
+
+;=============================================================================
+; sd_opengrep
+;=============================================================================
+; Starts a search of DEVICE_FILENAME, a file or every file in a directory,
+; on the current DEVICE_CHANNEL. The disk controller reads the files and 
+; sends back only where the matching lines are: reads return 8-byte 
+; records of the line number and the offset where the line starts, 4 bytes
+; each, low byte first. When searching a directory, a record with line 0
+; comes before the matches in each file, followed by the file's name, 
+; offset bytes long.
+; ptr2 points to the pattern, where ? stands for any character and * for
+; any run of them within the line.
+; Flags in A. Bit 0 set ignores case.
+; Returns the file type (1) in A (X = 0), or an error code in A (X = $FF).
+; Uses: A,X,Y
+;       ptr1
+;=============================================================================
+.proc sd_opengrep
+			pha						; flags
+			jsr		sd_drop			; for whatever was open here before
+			lda		#SD_CMD_GREP
+			ldx		#4
+			jsr		sd_cmd_begin
+			lda		DEVICE_CHANNEL
+			jsr		sd_cmd_byte
+			lda		DEVICE_FILENAME
+			ldx		DEVICE_FILENAME+1
+			jsr		sd_cmd_string
+			lda		ptr2
+			ldx		ptr2h
+			jsr		sd_cmd_string
+			pla
+			jsr		sd_cmd_byte
+			jsr		sd_cmd_end		; read back the return code
+
+			cmp		#0				; A >= 0 is success
+			bpl		return_ok
+			ldx		#$ff
+			rts
+return_ok:
+			ldx		DEVICE_OFFSET
+			lda		#O_RDONLY
+			sta		DEVTAB + DEVENTRY::FILEMODE, X	; mark the channel open
+			lda		#1
+			ldx		#0
+			rts
+.endproc
+
+
+
+;=============================================================================
+; sd_splice
+;=============================================================================
+; Moves bytes from the SD channel in A to the current DEVICE_CHANNEL, each
+; from its file's current position, inside the disk controller. Only the 
+; command crosses the bus. Both channels' buffers have to be empty first -
+; see sd_sync.
+; ptr1 points to a 4-byte count, which is replaced with the number of 
+; bytes moved. That's fewer than the count if the source file ran out.
+; Returns 0 in A (X = 0), or an error code in A (X = $FF).
+; Uses: A,X,Y
+;       tmp1
+;=============================================================================
+.proc sd_splice
+			pha
+			lda		#SD_CMD_SPLICE
+			ldx		#3
+			jsr		sd_cmd_begin
+			pla
+			jsr		sd_cmd_byte		; source channel
+			lda		DEVICE_CHANNEL
+			jsr		sd_cmd_byte		; destination channel
+			lda		ptr1
+			ldx		ptr1h
+			ldy		#4
+			jsr		sd_cmd_data		; count
+			jsr		sd_cmd_end
+
+			cmp		#0				; A >= 0 is success
+			bpl		return_ok
+			ldx		#$ff
+			rts
+return_ok:
+			lda		#4
+			jsr		sd_cmd_read		; bytes moved, over the count
+			lda		#0
+			tax
 			rts
-;return_err:	ply						; pull dev channel off of stack
-;			sty		DEVICE_CHANNEL	; restore device channel
-;			ldx #$ff
-;			rts
-			
 .endproc
 
 
@@ -278,34 +942,28 @@ return:		ply						; pull dev channel off of stack
 ;=============================================================================
 ; SD_CLOSE
 ;=============================================================================
-; Closes the file open on channel DEVICE_CHANNEL.
-; The format sent to the Arduino is "cn", where n is the channel number.
+; Closes the file open on channel DEVICE_CHANNEL, with an SD_CMD_CLOSE 
+; command.
+; Returns P65_EOK or an error code in A.
 ; Uses A,X,Y
 ;=============================================================================
 .proc SD_CLOSE
-			lda 	DEVICE_CHANNEL
-			tay		; device channel in y
-			stz		DEVICE_CHANNEL
-			
-			lda		#'c'
-			jsr		SD_PUTC
-			
-			tya
-			clc
-			adc		#'0'	; convert number to ascii on the cheap
-			jsr 	SD_PUTC
-			
-			lda 	#0
-			jsr		SD_PUTC
-			lda 	#0
-			jsr		SD_PUTC ; end of array-of-strings
-			
-			sty		DEVICE_CHANNEL	; restore device channel
+			jsr		sd_drop
+			lda		#SD_CMD_CLOSE
+			ldx		#1
+			jsr		sd_cmd_begin
+			lda		DEVICE_CHANNEL
+			jsr		sd_cmd_byte
+			jsr		sd_cmd_end
 			
 			ldx     DEVICE_OFFSET
 			stz 	DEVTAB + DEVENTRY::FILEMODE,x ; clear channel filemode
 
-			rts
+			ldx		#0
+			cmp		#0
+			bpl		done
+			dex
+done:		rts
 .endproc
 
 
@@ -319,29 +977,56 @@ return:		ply						; pull dev channel off of stack
 ; Modifies AXY, ptr1, ptr2
 ;=============================================================================
 .proc SD_SEEK
+			; Bytes the buffer read ahead put the controller that far past
+			; the program's position, so a relative seek has to allow for
+			; them.
+			pha
+			jsr		sd_drop
+			tay						; bytes read ahead
+			pla
+			pha
+			bne		send			; whence isn't SEEK_CUR
+			tya
+			beq		send
+			eor		#$ff			; offset -= Y
+			sec
+			adc		ptr1
+			sta		ptr1
+			lda		ptr1h
+			sbc		#0
+			sta		ptr1h
+			lda		ptr2
+			sbc		#0
+			sta		ptr2
+			lda		ptr2h
+			sbc		#0
+			sta		ptr2h
+send:
 			; The command sent to the Arduino is a 7-byte sequence:
 			; channel#, 0x1a, offset (32-bit little endian), whence
-			pha		; Save whence value for later
+			; The whence value is saved on the stack for later.
 			
+			Begin_Write_Burst
 			lda		DEVICE_CHANNEL
 			ora		#$30
-			jsr		WriteByte
+			jsr		WriteBurstByte
 
 			;lda		#$1a			; seek command 
 			;jsr		WriteByte
 
 			; offset is 4-bytes - little endian
 			lda 	ptr1
-			jsr		WriteByte
+			jsr		WriteBurstByte
 			lda		ptr1h
-			jsr		WriteByte
+			jsr		WriteBurstByte
 			lda		ptr2
-			jsr		WriteByte
+			jsr		WriteBurstByte
 			lda		ptr2h
-			jsr		WriteByte
+			jsr		WriteBurstByte
 
 			pla		; recover whence
-			jsr		WriteByte
+			jsr		WriteBurstByte
+			End_Write_Burst
 
 			jsr 	ReadByte		; read return value
 			cmp		#P65_EOK
@@ -370,8 +1055,16 @@ ret_err:
 ; The count is signed, and we should probably check that it's positive.
 ; Returns number of bytes read in AX. 0 for end of file,
 ; or a P65 error value for error.
-; Uses AXY, tmp1, tmp2, tmp3, ptr1
+; This uses the unescaped bulk read command ($60). Each reply is a status
+; byte, a 2-byte count, and then exactly that many raw bytes, so the copy
+; loop doesn't need to check for escape codes. The controller may send
+; fewer bytes than we asked for, in which case we ask again for the rest.
+; A count of 0 means end of file.
+; Files opened with O_PACKED use the packed bulk read command ($80)
+; instead. The count is the same, but the bytes are packed; see sd_unpack.
+; Uses AXY, tmp1, tmp2, tmp3, tmp4, ptr1
 .proc SD_READ
+		jsr sd_sync		; start from where SD_GETC/SD_PUTC left off
 		pla				; Recover # of bytes to read from stack
 		plx
 
@@ -381,58 +1074,158 @@ ret_err:
         bne nonzero
         rts             ; count is 0, so we can just return 0.
 nonzero:
-        sta tmp1        ; low byte of count
-        stx tmp2        ; high byte of count
+        sta tmp1        ; low byte of count remaining
+        stx tmp2        ; high byte of count remaining
+        phx             ; save the original count so we can work out
+        pha             ; how many bytes we actually read.
+        ldy #0
 
-		; Send the read command: channel/command, lsb of count, msb of count:
-		lda DEVICE_CHANNEL
-		ora #$40
-		jsr	WriteByte
+next_frame:
+		; Send the bulk read command: channel/command, lsb of count, msb of count:
+		Begin_Write_Burst
+		jsr is_packed
+		beq unpacked
+		lda #$80
+		bra send_command
+unpacked:
+		lda #$60
+send_command:
+		ora DEVICE_CHANNEL
+		jsr	WriteBurstByte
 		lda tmp1
-		jsr WriteByte
+		jsr WriteBurstByte
 		lda tmp2
-		jsr WriteByte
+		jsr WriteBurstByte
+		End_Write_Burst
 
-        stz tmp3        ; initialize read count
-        ldy #0
- 
-loop:
+		jsr ReadByte	; status
+		cmp #P65_EOK
+		bne error
+		jsr ReadByte	; byte count for this frame
+		sta tmp3
 		jsr ReadByte
-		cmp #$1b		; check for escape code
-		bne save_byte
-		jsr ReadByte 	; 2nd byte of escape code
-		cmp #$00		; no char available yet
-		beq loop
-		cmp #$ff		; EOF
-		beq done
-		cmp #'e'		; error code follows
-		;beq error
-		; fall through to save_byte
-		bne save_byte	
-		jsr ReadByte	; get error value & return
-		ldx #$FF
-		rts
+		sta tmp4
+		ora tmp3
+		beq done		; empty frame means end of file
+
+		sec				; count remaining -= frame count
+		lda tmp1
+		sbc tmp3
+		sta tmp1
+		lda tmp2
+		sbc tmp4
+		sta tmp2
 
-save_byte:
-        sta (ptr1),y    ; save character to buffer
+		jsr is_packed
+		beq copy
+		tya				; sd_unpack wants the whole address in ptr1
+		clc
+		adc ptr1
+		sta ptr1
+		bcc unpack
+		inc ptr1+1
+unpack:
+		jsr sd_unpack
+		ldy #0
+		bra more
+
+copy:
+		Read_To_Buffer
         iny
-        bne test_count
-        inc tmp3        ; if Y rolled over, we need to increment
-        inc ptr1+1      ; tmp3 and ptr1+1
+        bne dec_count
+        inc ptr1+1      ; if Y rolled over, we need to increment ptr1+1
+dec_count:
+		lda tmp3		; 16-bit decrement of the frame count
+		bne dec_low
+		dec tmp4
+dec_low:
+		dec tmp3
+		lda tmp3
+		ora tmp4
+		bne copy
 
-test_count:
-        ; if y/tmp3 == tmp1/tmp2, we are ready to exit.
-        cpy tmp1
-        bne loop
-        lda tmp3
-        cmp tmp2
-        bne loop
+more:
+		lda tmp1		; anything left to ask for?
+		ora tmp2
+		bne next_frame
 		; fall through to done
 done:
-        tya             ; load read count into AX
-        ldx tmp3
+		sec				; bytes read = original count - count remaining
+		pla
+		sbc tmp1
+		tay
+		pla
+		sbc tmp2
+		tax
+		tya
         rts
 
+error:
+		tay				; status is the error code to return
+		pla				; discard the saved count
+		pla
+		tya
+		ldx #$FF
+		rts
+
+; Z is clear if the current device was opened with O_PACKED.
+is_packed:
+		ldx DEVICE_OFFSET
+		lda DEVTAB + DEVENTRY::FILEMODE,x
+		and #O_PACKED
+		rts
+
+.endproc
+
+
+
+; Reads a packed payload, unpacking it into the buffer at ptr1 as it
+; arrives. The unpacked size is in tmp3 (low) and tmp4, and mustn't be 0.
+; The packing is PackBits: a header byte h of 0-127 is followed by h+1
+; literal bytes, and one of 129-255 by a byte to repeat 257-h times.
+; Leaves ptr1 pointing just past the unpacked data.
+; Uses A,X,Y, tmp3, tmp4, ptr1
+.proc sd_unpack
+next:		jsr		ReadByte		; header
+			tax
+			bmi		repeat
+			inx						; h+1 literal bytes
+			ldy		#0
+literal:	Read_To_Buffer
+			iny
+			dex
+			bne		literal
+			bra		advance
+
+repeat:		eor		#$ff			; 257-h = (255-h) + 2 copies
+			ina
+			ina
+			tax
+			ldy		#0
+			Read_To_Buffer			; the first copy
+			lda		(ptr1)
+fill:		iny
+			dex
+			beq		advance
+			sta		(ptr1),y
+			bra		fill
+
+advance:	tya						; Y bytes done. Move ptr1 past them,
+			clc
+			adc		ptr1
+			sta		ptr1
+			bcc		count
+			inc		ptr1h
+count:		tya						; and take them off the count.
+			eor		#$ff
+			sec
+			adc		tmp3
+			sta		tmp3
+			bcs		check
+			dec		tmp4
+check:		ora		tmp4
+			bne		next
+			rts
 .endproc
 
 
@@ -446,6 +1239,7 @@ done:
 ; actually need to keep track of total count. We always send the entire
 ; buffer to the device & let it decide what to do about it.
 .proc SD_WRITE
+		jsr sd_sync		; start from where SD_GETC/SD_PUTC left off
 		pla				; Recover # of bytes to write from stack
 		plx
         cmp #0
@@ -458,20 +1252,22 @@ nonzero:
         stx tmp2        ; high byte of count
 
 		; Send the write command: channel/command, lsb of count, msb of count:
+		; The command and the data all go out as a single burst.
+		Begin_Write_Burst
 		lda DEVICE_CHANNEL
 		ora #$50
-		jsr	WriteByte
+		jsr	WriteBurstByte
 		lda tmp1
-		jsr WriteByte
+		jsr WriteBurstByte
 		lda tmp2
-		jsr WriteByte
+		jsr WriteBurstByte
 
         stz tmp3        ; initialize read count
         ldy #0
  
 loop:
 		lda (ptr1),y
-		jsr WriteByte
+		Write_Burst_Byte
         iny
         bne test_count
         inc tmp3        ; if Y rolled over, we need to increment
@@ -485,6 +1281,7 @@ test_count:
         bne loop
 		; fall through to done
 done:
+		End_Write_Burst
 		; Finally, we're going to read either an error code or
 		; # bytes written from the SD card, return in AX
 		jsr ReadByte
@@ -32,10 +32,11 @@
 .include "os3.inc"
 .import SERIAL_IOCTL, SERIAL_GETC, SERIAL_PUTC
 .import SD_IOCTL, SD_GETC, SD_PUTC, SD_OPEN, SD_CLOSE, SD_SEEK, SD_READ, SD_WRITE
+.import sd_opendir, sd_readdir, sd_opengrep, sd_sync, sd_splice
 .import TTY_IOCTL, TTY_GETC, TTY_OPEN, TTY_CLOSE
 .import _print_string, hexits, _print_hex
 .export dev_ioctl, dev_getc, dev_putc, setdevice, set_filename, set_filemode, dev_open
-.export dev_close, init_devices, openfile
+.export dev_close, init_devices, openfile, open_listing, read_listing, open_search, splice
 .export dev_seek, dev_get_status
 .export dev_read, dev_write, dev_writestr, dev_write_hex
 
@@ -88,10 +89,21 @@ DEVTAB_TEMPLATE:		; an array of DEVENTRY structs
 .word TTY_IOCTL, TTY_GETC, NULLFN, TTY_OPEN, TTY_CLOSE, NOSEEK, DEFAULT_READ, DEFAULT_WRITE
 
 ;.align 16
-.byte 0, 0	; Empty Device 2
-.word NULLFN, NULLFN, NULLFN, NULLFN, NULLFN, NOSEEK, NULLRW, NULLRW
+.repeat SD_DATA_CHANNELS - 2, I
+.byte 3 + I, 0	; SD Card Data Channel 3 and up
+.word SD_IOCTL, SD_GETC, SD_PUTC, SD_OPEN, SD_CLOSE, SD_SEEK, SD_READ, SD_WRITE
+.endrepeat
 DEVTAB_TEMPLATE_END:
 
+.assert DEVTAB + (DEVTAB_TEMPLATE_END - DEVTAB_TEMPLATE) <= rbuffer, error, "DEVTAB overlaps rbuffer"
+
+; devtab indices of the SD card data channels, in the order openfile tries them.
+SD_DATA_DEVICES:
+.byte 2, 3
+.repeat SD_DATA_CHANNELS - 2, I
+.byte 5 + I
+.endrepeat
+
 .code
 
 ; A generic empty function. Any devtab entry that doesn't need a specific
@@ -240,7 +252,7 @@ loop:	lda DEVTAB_TEMPLATE-1,X
 ; ptr1 points to a buffer. AX contains # of bytes to be read.
 ; Returns number of bytes read in AX. 0 for end of file,
 ; or a P65 error code
-; Uses AXY, tmp1, tmp2, tmp3, ptr1
+; Uses AXY, tmp1, tmp2, tmp3, tmp4, ptr1
 .proc dev_read
 			; Note that actual implementations read count from the stack.
 			cpx #$80	; If the high bit of AX is set, we need to cap the count at 0x7fff
@@ -305,23 +317,18 @@ ready:
 ; pass the name of a file an AX, mode in Y
 ; returns a file handle in A, or -1 on failure
 ; Allocates a file handle if one is available.
-; For now, I'm hardcoding it to look at devtab entries 2 & 3,
-; but we could add special identifiers for serial port or 
-; disk command channel...
+; For now, it looks for a closed SD card data channel from the
+; SD_DATA_DEVICES list, but we could add special identifiers for
+; serial port or disk command channel...
 .proc openfile
 			pha		
 			phx
 			phy
-			lda		#2
-			jsr		setdevice
-			ldx		DEVICE_OFFSET
-			cmp		DEVTAB + DEVENTRY::FILEMODE,X
-			beq		do_open
-			lda 	#3
-			jsr		setdevice
-			ldx		DEVICE_OFFSET
-			cmp		DEVTAB + DEVENTRY::FILEMODE,X
-			beq		do_open
+			jsr		find_free_file
+			bcc		do_open
+			ply						; discard mode & filename
+			plx
+			pla
 			lda		#P65_EMFILE			; No available file descriptors
 			ldx		#$ff
 			rts
@@ -343,6 +350,157 @@ on_fail:	rts
 
 
 
+; Opens a sorted directory listing on a free SD card data channel, like
+; openfile. See sd_opendir in SD.asm.
+; Pass the directory name in AX, a pattern in ptr2 (or 0), and a dirent to
+; start after in ptr1 (or 0).
+; Returns a file handle in A (X = 0), or an error code in A (X = $FF).
+; Uses A,X,Y, ptr1
+.proc open_listing
+			pha
+			phx
+			jsr		find_free_file
+			plx
+			pla
+			bcs		no_channel
+			jsr		set_filename
+			jsr		sd_opendir
+			cpx		#0
+			bne		done			; return the error
+			lda		CURRENT_DEVICE
+done:		rts
+no_channel:
+			lda		#P65_EMFILE		; No available file descriptors
+			ldx		#$ff
+			rts
+.endproc
+
+
+
+; Starts a search for the lines of a file, or of every file in a
+; directory, that contain a pattern, on a free SD card data channel. Read
+; the matches from the file handle. See sd_opengrep in SD.asm.
+; Pass the file or directory name in AX, the pattern in ptr2, and the 
+; flags in Y.
+; Returns a file handle in A (X = 0), or an error code in A (X = $FF).
+; Uses A,X,Y, ptr1
+.proc open_search
+			phy
+			pha
+			phx
+			jsr		find_free_file
+			plx
+			pla
+			bcs		no_channel
+			jsr		set_filename
+			pla						; flags
+			jsr		sd_opengrep
+			cpx		#0
+			bne		done			; return the error
+			lda		CURRENT_DEVICE
+done:		rts
+no_channel:
+			ply
+			lda		#P65_EMFILE		; No available file descriptors
+			ldx		#$ff
+			rts
+.endproc
+
+
+
+; Reads the next entry of a listing from open_listing (or a directory
+; opened with openfile) into the struct dirent at ptr1. See sd_readdir in 
+; SD.asm.
+; Pass the file handle in A.
+; Returns 1 in A for an entry or 0 at the end (X = 0), or an error code
+; in A (X = $FF).
+; Uses A,X,Y, tmp1, tmp2
+.proc read_listing
+			jsr		set_data_device
+			bcs		bad_device
+			jmp		sd_readdir
+bad_device:
+			lda		#P65_EBADF		; not an SD card data channel
+			ldx		#$ff
+			rts
+.endproc
+
+
+
+; Moves bytes from one open file on the SD card to another without them
+; crossing the bus, like for joining files together. See sd_splice in 
+; SD.asm.
+; Pass the source file handle in A, the destination's in X, and a pointer
+; to a 4-byte count in ptr1. The count is replaced with the number of bytes
+; moved, which is fewer if the source ran out.
+; Returns 0 in A (X = 0), or an error code in A (X = $FF).
+; Uses A,X,Y
+.proc splice
+			phx						; destination
+			jsr		set_data_device
+			bcs		bad_source
+			jsr		sd_sync			; the source's read-ahead goes back
+			plx
+			lda		DEVICE_CHANNEL
+			pha						; source channel
+			txa
+			jsr		set_data_device
+			bcs		bad_device
+			jsr		sd_sync			; the destination's buffered writes go out
+			pla
+			jmp		sd_splice
+bad_source:
+			plx
+			bra		fail
+bad_device:
+			pla
+fail:		lda		#P65_EBADF		; not an SD card data channel
+			ldx		#$ff
+			rts
+.endproc
+
+
+
+; Makes the SD card data channel with the devtab index in A the current
+; device. Returns with carry set if A isn't one.
+; Uses A,X,Y
+.proc set_data_device
+			ldy		#0
+find:		cmp		SD_DATA_DEVICES,y
+			beq		found
+			iny
+			cpy		#SD_DATA_CHANNELS
+			bne		find
+			sec
+			rts
+found:		jsr		setdevice
+			clc
+			rts
+.endproc
+
+
+
+; Makes the first closed SD card data channel from SD_DATA_DEVICES the
+; current device. Returns with carry set if they're all open.
+; Uses A,X,Y
+.proc find_free_file
+			ldy		#0
+loop:		lda		SD_DATA_DEVICES,y
+			jsr		setdevice		; only uses AX
+			ldx		DEVICE_OFFSET
+			lda		DEVTAB + DEVENTRY::FILEMODE,X
+			beq		found			; FILEMODE is 0 if the device is closed
+			iny
+			cpy		#SD_DATA_CHANNELS
+			bne		loop
+			sec
+			rts
+found:		clc
+			rts
+.endproc
+
+
+
 ; Writes a string to the current device, including terminating 0.
 ; Maximum string length is 256 bytes.
 ; String pointer in ax
@@ -30,66 +30,60 @@
 ;; filesystem.asm - file & directory operations
 
 .include "os3.inc"
-.import set_filename, setdevice, dev_writestr, dev_getc, dev_putc, dev_read
-.import mkdir_command, rmdir_command, rm_command, cp_command, mv_command
-.import dev_open, dev_close, set_filemode, _print_char, _print_hex
-.export mkdir, rmdir, rm, cp, mv, load_program, stat
+.import set_filename
+.import sd_cmd_begin, sd_cmd_string, sd_cmd_data, sd_cmd_end, sd_cmd_read
+.import sd_unpack
+.export mkdir, rmdir, rm, cp, mv, load_program, stat, fallocate
+.export rmtree, cptree, treejob_status, chdir, getcwd
+.export cp_start, cp_status, cp_cancel, slurp
 
 
 ; Create a new directory 
-; AX points to a string with a pathname relative to /.
+; AX points to a string with a pathname, relative to the working
+; directory if it doesn't start with /.
 ; Returns: P65_EOK or error code in A
 ; Modifies AXY, ptr1
 .proc mkdir
         jsr set_filename
-        lda #1
-        jsr setdevice      ; send to SD card command channel.
-        lda #<mkdir_command
-        ldx #>mkdir_command
+        lda #SD_CMD_MKDIR
         jmp dos_singlearg
 .endproc
 
 
 ; Remove a directory, which must be empty
-; AX points to a string with a pathname relative to /.
+; AX points to a string with a pathname, relative to the working
+; directory if it doesn't start with /.
 ; Returns: P65_EOK or error code in A
 ; Modifies AXY, ptr1
 .proc rmdir
         jsr set_filename
-        lda #1
-        jsr setdevice      ; send to SD card command channel.
-        lda #<rmdir_command
-        ldx #>rmdir_command
+        lda #SD_CMD_RMDIR
         jmp dos_singlearg
 .endproc
 
 
 ; Remove a file.
-; AX points to a string with a pathname relative to /.
+; AX points to a string with a pathname, relative to the working
+; directory if it doesn't start with /.
 ; Returns: P65_EOK or error code in A
 ; Modifies AXY, ptr1
 .proc rm
         jsr set_filename
-        lda #1
-        jsr setdevice      ; send to SD card command channel.
-        lda #<rm_command
-        ldx #>rm_command
+        lda #SD_CMD_RM
         jmp dos_singlearg
 .endproc
 
 
-; helper for mkdir etc. expects operator string in AX,
-; argument in DEVICE_FILENAME, and current device is SD command.
+; helper for mkdir etc. expects the SD_CMD_* opcode in A and the
+; argument in DEVICE_FILENAME.
 ; Modifiees AXY, ptr1
 .proc dos_singlearg
-        jsr dev_writestr
+        ldx #1
+        jsr sd_cmd_begin
         lda DEVICE_FILENAME
         ldx DEVICE_FILENAME+1
-        jsr dev_writestr
-   	lda #0
-        jsr dev_putc		; and a marker for end of array-of-strings
-        jsr dev_getc        ; read response code
-        rts
+        jsr sd_cmd_string
+        jmp sd_cmd_end      ; read response code
 .endproc
 
 
@@ -99,45 +93,184 @@
 ; Modifies AXY, ptr1
 .proc cp
         jsr set_filename
-        lda #1
-        jsr setdevice      ; send to SD card command channel.
-        lda #<cp_command
-        ldx #>cp_command
+        lda #SD_CMD_CP
         jmp dos_doublearg
 .endproc
 
 
-; Move a file
+; Move or rename a file or directory
 ; AX is the src filename, ptr2 contains the dest name.
-; Unfortunately this is a copy and then delete...
+; The disk controller just rewrites the directory entry, so this doesn't
+; copy any file data. Fails with P65_EEXIST if dest already exists.
 ; Returns: P65_EOK or error code in A
 ; Modifies AXY, ptr1
 .proc mv
         jsr set_filename
-        lda #1
-        jsr setdevice      ; send to SD card command channel.
-        lda #<mv_command
-        ldx #>mv_command
+        lda #SD_CMD_MV
+        jmp dos_doublearg
+.endproc
+
+
+; Start removing a directory and everything in it. The disk controller
+; does this in the background; poll treejob_status to see when it's done.
+; AX points to a string with a pathname, relative to the working
+; directory if it doesn't start with /.
+; Returns: P65_EOK if the job started, or error code in A
+; Modifies AXY, ptr1
+.proc rmtree
+        jsr set_filename
+        lda #SD_CMD_RMTREE
+        jmp dos_singlearg
+.endproc
+
+
+; Start copying a directory and everything in it. The disk controller
+; does this in the background; poll treejob_status to see when it's done.
+; AX is the src directory, ptr2 contains the dest name.
+; Returns: P65_EOK if the job started, or error code in A
+; Modifies AXY, ptr1
+.proc cptree
+        jsr set_filename
+        lda #SD_CMD_CPTREE
+        jmp dos_doublearg
+.endproc
+
+
+; Get the progress of the current or last rmtree/cptree job.
+; Returns: Status in A - P65_EAGAIN while the job is still running, then
+; P65_EOK or an error code once it's done. The number of entries done so 
+; far in X (low byte) and Y (high byte).
+; Modifies AXY, ptr1, tmp1
+.proc treejob_status
+        lda #SD_CMD_TREEJOB
+        ldx #0
+        jsr sd_cmd_begin
+        jsr sd_cmd_end      ; the job status is the command's status
+        lda #<scratchbuffer
+        sta ptr1
+        lda #>scratchbuffer
+        sta ptr1h
+        lda #3
+        jsr sd_cmd_read     ; read status & count
+        ldx scratchbuffer+1
+        ldy scratchbuffer+2
+        lda scratchbuffer
+        rts
+.endproc
+
+
+; Start copying a file in the background. The disk controller copies it
+; a block at a time in between other requests; poll cp_status to see how
+; far it's got, or cp_cancel to stop it.
+; AX is the src filename, ptr2 contains the dest name.
+; Returns: P65_EOK if the copy started, or error code in A
+; Modifies AXY, ptr1
+.proc cp_start
+        jsr set_filename
+        lda #SD_CMD_COPY
         jmp dos_doublearg
 .endproc
 
 
-; helper for cp & mv. expects operator string in AX,
-; src argument in DEVICE_FILENAME, dest argument in ptr2
-; and current device is SD command channel.
-; Modifies AXY, ptr1, ptr2
+; Get the progress of the current or last background copy.
+; ptr1 points to a 9-byte buffer for the status, then the number of bytes
+; copied so far and the size of the file, 4 bytes each, low byte first.
+; Returns: Status in A - P65_EAGAIN while the copy is still running, then
+; P65_EOK, P65_EINTR if it was cancelled, or an error code.
+; Modifies AXY, tmp1
+.proc cp_status
+        lda #SD_CMD_COPYJOB
+        ldx #0
+        jsr sd_cmd_begin
+        jsr sd_cmd_end
+        cmp #0
+        bne done
+        lda #9
+        jsr sd_cmd_read     ; read status & counts
+        lda (ptr1)
+done:   rts
+.endproc
+
+
+; Stop the background copy, and remove what's been copied so far.
+; Returns: P65_EOK, or P65_EINVAL if no copy is running, in A
+; Modifies AX
+.proc cp_cancel
+        lda #SD_CMD_COPYCANCEL
+        ldx #0
+        jsr sd_cmd_begin
+        jmp sd_cmd_end
+.endproc
+
+
+; Change the disk controller's working directory, which paths that don't
+; start with / are relative to. It's kept by the controller, so it lasts 
+; until the next chdir or reset, through any programs that run.
+; AX points to a string with the directory name.
+; Returns: P65_EOK or error code in A
+; Modifies AXY, ptr1
+.proc chdir
+        jsr set_filename
+        lda #SD_CMD_CHDIR
+        jmp dos_singlearg
+.endproc
+
+
+; Get the disk controller's working directory, as a full path.
+; ptr1 points to a buffer of SD_MAX_CWD bytes.
+; Returns: P65_EOK or error code in A
+; Modifies AXY, tmp1
+.proc getcwd
+        lda #SD_CMD_GETCWD
+        ldx #0
+        jsr sd_cmd_begin
+        jsr sd_cmd_end
+        cmp #0
+        bne done
+        lda #SD_MAX_CWD
+        jsr sd_cmd_read     ; the path, 0-padded
+        lda #P65_EOK
+done:   rts
+.endproc
+
+
+; helper for cp & mv. expects the SD_CMD_* opcode in A,
+; src argument in DEVICE_FILENAME, dest argument in ptr2.
+; Modifies AXY, ptr1
 .proc dos_doublearg
-        jsr dev_writestr    ; Write the command string which is in AX
+        ldx #2
+        jsr sd_cmd_begin
         lda DEVICE_FILENAME
         ldx DEVICE_FILENAME+1
-        jsr dev_writestr    ; Write source name
+        jsr sd_cmd_string   ; Write source name
         lda ptr2
         ldx ptr2h
-        jsr dev_writestr    ; Write dest name
-   	lda #0              ; and a marker for end of array-of-strings
-	jsr dev_putc		
-        jsr dev_getc        ; read response code
-        rts
+        jsr sd_cmd_string   ; Write dest name
+        jmp sd_cmd_end      ; read response code
+.endproc
+
+
+
+; Create a file whose data is one contiguous run of blocks, replacing any
+; file already there. Opened with O_CONTIG, it can then be written without
+; the disk controller updating the FAT as it goes. Until it's written, it
+; holds whatever was on the card.
+; AX is the filename, ptr2 points to the 4-byte size, low byte first.
+; Returns: P65_EOK or error code in A
+; Modifies AXY, ptr1
+.proc fallocate
+        jsr set_filename
+        lda #SD_CMD_FALLOCATE
+        ldx #2
+        jsr sd_cmd_begin
+        lda DEVICE_FILENAME
+        ldx DEVICE_FILENAME+1
+        jsr sd_cmd_string   ; Write filename
+        lda ptr2
+        ldx ptr2h
+        ldy #4
+        jsr sd_cmd_data     ; Write size
+        jmp sd_cmd_end      ; read response code
 .endproc
 
 
@@ -146,155 +279,150 @@
 ; cc65 stat struct layout.
 ; Filename in AX. Memory buffer in ptr1
 ; returns a P:65 error code in AX
-; Uses AXY, ptr1, ptr2
+; Uses AXY, ptr1, ptr2, tmp1
 .proc stat
         jsr set_filename
-        lda #1
-        jsr setdevice
         lda ptr1
         sta ptr2
         lda ptr1h
         sta ptr2h
-        lda #<stat_command
-        ldx #>stat_command
-        jsr dev_writestr        ; write command
-        lda DEVICE_FILENAME
-        ldx DEVICE_FILENAME+1
-        jsr dev_writestr        ; write filename
-        lda #0
-        jsr dev_putc            ; write end-of-array marker
-read_status:
-        jsr dev_getc            ; read response code
-        bcc read_status
+        lda #SD_CMD_STAT
+        jsr dos_singlearg       ; send filename & read response code
         cmp #0
-        bne done
+        bne error
         lda ptr2                ; Copy buffer ptr back to ptr1
         sta ptr1
         lda ptr2h
         sta ptr1h
         lda #43                 ; is the size actually 43 bytes? padding?
-        ldx #0
-        jsr dev_read            ; read stat struct
-        cmp #43
-        bne read_error
+        jsr sd_cmd_read         ; read stat struct
         lda #1                  ; Disk device number
         ldy #0
         sta (ptr2),y            ; save device number to struct stat
         lda #P65_EOK            ; set return code
         ldx #0
-done:
         rts
-read_error:
-        lda #P65_EAGAIN
-        ldx #0
+error:
+        ldx #$FF
         rts
-stat_command:
-        .asciiz "stat"
 .endproc
 
 
 
 ; Load a program into memory
 ; Program name in AX
+; The disk controller sends the whole thing in reply to one SD_CMD_LOAD:
+; the load address, the length, and then the program, packed.
 ; returns error code in AX
-; Uses AXY, tmp1-3, ptr1, ptr2 (mostly for read)
+; Uses AXY, tmp1, tmp3, tmp4, ptr1
 .proc load_program
         jsr set_filename
-	; setup
-	lda #O_RDONLY
-	jsr set_filemode
-		
-	lda #2
-	jsr setdevice
-	jsr dev_open
-		
-	; check return code which is in A - we want a regular file (1)
-	cmp #0
-	bmi error
-	beq open_success
-	cmp #1
-	beq open_success
-		
-	lda #P65_EISDIR	; and fall thru to error handler
+        lda #SD_CMD_LOAD
+        jsr dos_singlearg   ; send filename & read status
+        cmp #0
+        bmi error
+
+        ; Read the address & length. For now the length goes where the end
+        ; address will be.
+        lda #<program_address_low
+        sta ptr1
+        lda #>program_address_low
+        sta ptr1h
+        lda #4
+        jsr sd_cmd_read
+
+        lda program_end_low     ; keep the length for sd_unpack
+        sta tmp3
+        clc
+        adc program_address_low
+        sta program_end_low
+        lda program_end_high
+        sta tmp4
+        adc program_address_high
+        sta program_end_high
+
+        lda program_address_low
+        sta ptr1
+        lda program_address_high
+        sta ptr1h
+        lda tmp3
+        ora tmp4
+        beq done                ; nothing after the address
+        jsr sd_unpack
+done:
+        lda #P65_EOK  ; Set return code
+        tax
+        rts
 
 	; an error happened.  Print the command response & return to command line
 error:
         ldx #0  ; shouldn't this be FF for consistency?
         rts
-		
-open_success:
-	; read file content on device 2
-	lda #2
-	jsr	setdevice
-        
-get1:	
-        jsr 	dev_getc
-	bcc	get1
-	sta	program_address_low
-	sta	ptr2
-get2:	
-        jsr	dev_getc
-	bcc 	get2
-	sta	program_address_high
-	sta	ptr2h
-
-        ; Read using dev_read
-loop:
-        lda ptr2        ; Read wants buffer pointer in ptr1.
-        sta ptr1        ; But also modifies it, so we keep our
-        lda ptr2h       ; count in ptr2.
-        sta ptr1h
-        lda #$00
-        ldx #$04 ; read 1k at a time?
-        jsr dev_read    ; 0 in AX indicates EOF
-        ;bra fake_error ; bail after 1st read, see what memory looks like
-        ; can we print out the return code of read? is there an unexpected error?
-        ;phx
-        ;pha
-        ;txa
-        ;jsr _print_hex
-        ;pla
-        ;pha
-        ;jsr _print_hex
-        ;pla
-        ;plx
-
-        ; Check return value of read. $0000 in AX indicates EOF, so we're done.
-        ; An $FF in X indicates an error. Anything else is # bytes read which
-        ; we'll add to ptr2.
-        cpx #0
-        bne check_for_error
-        cmp #0
-        beq done        ; Read end of file
-check_for_error:
-        cpx #$ff        ; $FFFF in AX indicates an error
-        beq error
-        ;bne inc_loop
-        ;cmp #$ff
-        ;bne inc_loop
-        ; there was an error during the read. Return error value
-;fake_error:
-        ;lda #P65_EIO
-        ;bra error
-inc_loop:
-        clc             ; add the current value in AX to ptr1/ptr1h.
-        adc ptr2        ; Usually this will just be $0400 except for
-        sta ptr2        ; the last read of the file.
-        txa             ; This also ensures ptr2 points to 1 past end
-        adc ptr2h       ; of program when we finish.
-        sta ptr2h
+.endproc
 
-        bra loop
 
-done:
-	jsr dev_close
 
-        lda ptr2
-        sta program_end_low
+; Read a small file with one command. The disk controller opens it, sends
+; its size and up to the count of bytes from the start, packed, and closes
+; it again, all in reply to one SD_CMD_SLURP.
+; AX points to the file name, ptr1 to the buffer, and ptr2 to the 4-byte
+; size of the file followed by a 2-byte count. Set the count to the most
+; the buffer holds. It's replaced with the number of bytes read, and the
+; size is filled in with the whole file's.
+; Returns: P65_EOK in A (X = 0), or error code in A (X = $FF)
+; Uses AXY, tmp1, tmp3, tmp4, ptr1
+.proc slurp
+        pha
+        phx
+        lda ptr1                ; the frame needs ptr1, so keep the buffer
+        sta tmp3                ; pointer here
+        lda ptr1h
+        sta tmp4
+        lda #SD_CMD_SLURP
+        ldx #2
+        jsr sd_cmd_begin
+        plx
+        pla
+        jsr sd_cmd_string       ; file name
+        clc
+        lda ptr2                ; the count comes after the size
+        adc #4
+        pha
         lda ptr2h
-        sta program_end_high
+        adc #0
+        tax
+        pla
+        ldy #2
+        jsr sd_cmd_data         ; most to send
+        jsr sd_cmd_end
+        cmp #0
+        bmi error
 
-        lda #P65_EOK  ; Set return code
+        lda ptr2                ; read the size & count over ours
+        sta ptr1
+        lda ptr2h
+        sta ptr1h
+        lda #6
+        jsr sd_cmd_read
+
+        lda tmp3                ; then the data, into the buffer
+        sta ptr1
+        lda tmp4
+        sta ptr1h
+        ldy #4
+        lda (ptr2),y
+        sta tmp3
+        iny
+        lda (ptr2),y
+        sta tmp4
+        ora tmp3
+        beq done                ; empty file, or nothing asked for
+        jsr sd_unpack
+done:
+        lda #P65_EOK
         tax
         rts
+error:
+        ldx #$FF
+        rts
 .endproc
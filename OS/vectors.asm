@@ -29,9 +29,12 @@
 
 .import _commandline, _print_string, _print_hex, _read_char, _print_char
 .import setdevice, dev_open, dev_close, dev_putc, dev_getc
-.import set_filename, set_filemode, openfile
+.import set_filename, set_filemode, openfile, open_listing, read_listing, open_search, splice
 .import dev_ioctl, dev_seek, dev_read, dev_write, dev_get_status
 .import mkdir, rmdir, rm, cp, mv, stat
+.import rmtree, cptree, treejob_status, chdir, getcwd
+.import cp_start, cp_status, cp_cancel, slurp
+.import sd_command
 .import RESET
 ;.export PutChar, GetChar, SET_FILENAME, SET_FILEMODE, DEV_OPEN, DEV_CLOSE, DEV_PUTC, DEV_GETC
 ;.export DEV_SEEK, DEV_GET_STATUS
@@ -39,6 +42,20 @@
 
 
 .segment "kernal_table"
+FS_SLURP:       jmp slurp               ; FF72
+FS_SPLICE:      jmp splice              ; FF75
+FS_OPEN_SEARCH: jmp open_search         ; FF78
+FS_CP_CANCEL:   jmp cp_cancel           ; FF7B
+FS_CP_STATUS:   jmp cp_status           ; FF7E
+FS_CP_START:    jmp cp_start            ; FF81
+FS_GETCWD:      jmp getcwd              ; FF84
+FS_CHDIR:       jmp chdir               ; FF87
+FS_READ_LISTING: jmp read_listing       ; FF8A
+FS_OPEN_LISTING: jmp open_listing       ; FF8D
+SD_COMMAND:     jmp sd_command          ; FF90
+FS_TREEJOB_STATUS: jmp treejob_status   ; FF93
+FS_CPTREE:      jmp cptree              ; FF96
+FS_RMTREE:      jmp rmtree              ; FF99
 DEV_WRITE:      jmp dev_write           ; FF9C
 FS_STAT:        jmp stat                ; FF9F
 FS_MKDIR:       jmp mkdir               ; FFA2